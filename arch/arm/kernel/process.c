@@ -28,7 +28,9 @@
 #include <linux/tick.h>
 #include <linux/utsname.h>
 #include <linux/uaccess.h>
+#include <linux/notifier.h>
 
+#include <asm/idle.h>
 #include <asm/leds.h>
 #include <asm/processor.h>
 #include <asm/system.h>
@@ -72,6 +74,20 @@ void enable_hlt(void)
 
 EXPORT_SYMBOL(enable_hlt);
 
+static ATOMIC_NOTIFIER_HEAD(idle_notifier);
+
+void idle_notifier_register(struct notifier_block *n)
+{
+	atomic_notifier_chain_register(&idle_notifier, n);
+}
+EXPORT_SYMBOL_GPL(idle_notifier_register);
+
+void idle_notifier_unregister(struct notifier_block *n)
+{
+	atomic_notifier_chain_unregister(&idle_notifier, n);
+}
+EXPORT_SYMBOL_GPL(idle_notifier_unregister);
+
 static int __init nohlt_setup(char *__unused)
 {
 	hlt_counter = 1;
@@ -159,6 +175,7 @@ void cpu_idle(void)
 	while (1) {
 		tick_nohz_stop_sched_tick(1);
 		leds_event(led_idle_start);
+		atomic_notifier_call_chain(&idle_notifier, IDLE_START, NULL);
 		while (!need_resched()) {
 #ifdef CONFIG_HOTPLUG_CPU
 			if (cpu_is_offline(smp_processor_id()))
@@ -182,6 +199,7 @@ void cpu_idle(void)
 				local_irq_enable();
 			}
 		}
+		atomic_notifier_call_chain(&idle_notifier, IDLE_END, NULL);
 		leds_event(led_idle_end);
 		tick_nohz_restart_sched_tick();
 		preempt_enable_no_resched();
@@ -21,6 +21,7 @@
 #include <linux/suspend.h>
 #include <linux/regulator/consumer.h>
 #include <linux/gpio.h>
+#include <linux/hrtimer.h>
 #include <asm/system.h>
 
 #include <mach/map.h>
@@ -499,6 +500,7 @@ static int s5pv210_cpufreq_target(struct cpufreq_policy *policy,
 	unsigned int index, reg, arm_volt, int_volt;
 	unsigned int pll_changing = 0;
 	unsigned int bus_speed_changing = 0;
+	ktime_t volt_start;
 
 	mutex_lock(&set_freq_lock);
 
@@ -521,6 +523,7 @@ static int s5pv210_cpufreq_target(struct cpufreq_policy *policy,
 		pr_err("%s:%d denied access to %s as it is disabled"
 			       " temporarily\n", __FILE__, __LINE__, __func__);
 #endif
+		cpufreq_notify_transition_skip(0, s5pv210_cpufreq_getspeed(0));
 		ret = -EINVAL;
 		goto out;
 	}
@@ -538,8 +541,13 @@ static int s5pv210_cpufreq_target(struct cpufreq_policy *policy,
 
 #ifdef CONFIG_DVFS_LIMIT
 	if (g_dvfs_high_lock_token) {
-		if (index > g_dvfs_high_lock_limit)
+		if (index > g_dvfs_high_lock_limit) {
 			index = g_dvfs_high_lock_limit;
+			/* refused only if the clamp leaves us where we are */
+			if (freq_table[index].frequency == s3c_freqs.freqs.old)
+				cpufreq_notify_transition_skip(0,
+						s3c_freqs.freqs.old);
+		}
 	}
 #endif
 
@@ -547,6 +555,7 @@ static int s5pv210_cpufreq_target(struct cpufreq_policy *policy,
 
 	s3c_freqs.freqs.new = arm_clk;
 	s3c_freqs.freqs.cpu = 0;
+	s3c_freqs.freqs.volt_us = 0;
 
 	/*
 	 * Run this function unconditionally until s3c_freqs.freqs.new
@@ -570,10 +579,13 @@ static int s5pv210_cpufreq_target(struct cpufreq_policy *policy,
 		/* Voltage up code: increase ARM first */
 		if (!IS_ERR_OR_NULL(arm_regulator) &&
 				!IS_ERR_OR_NULL(internal_regulator)) {
+			volt_start = ktime_get();
 			regulator_set_voltage(arm_regulator,
 					arm_volt, arm_volt_max);
 			regulator_set_voltage(internal_regulator,
 					int_volt, int_volt_max);
+			s3c_freqs.freqs.volt_us +=
+				ktime_us_delta(ktime_get(), volt_start);
 		}
 	}
 	cpufreq_notify_transition(&s3c_freqs.freqs, CPUFREQ_PRECHANGE);
@@ -731,13 +743,17 @@ static int s5pv210_cpufreq_target(struct cpufreq_policy *policy,
 		/* Voltage down: decrease INT first.*/
 		if (!IS_ERR_OR_NULL(arm_regulator) &&
 				!IS_ERR_OR_NULL(internal_regulator)) {
+			volt_start = ktime_get();
 			regulator_set_voltage(internal_regulator,
 					int_volt, int_volt_max);
 			regulator_set_voltage(arm_regulator,
 					arm_volt, arm_volt_max);
+			s3c_freqs.freqs.volt_us +=
+				ktime_us_delta(ktime_get(), volt_start);
 		}
 	}
 	cpufreq_notify_transition(&s3c_freqs.freqs, CPUFREQ_POSTCHANGE);
+	cpufreq_notify_transition_cost(&s3c_freqs.freqs);
 
 	memcpy(&s3c_freqs.old, &s3c_freqs.new, sizeof(struct s3c_freq));
 	cpufreq_debug_printk(CPUFREQ_DEBUG_DRIVER, KERN_INFO,
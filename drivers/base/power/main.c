@@ -27,6 +27,7 @@
 #include <linux/sched.h>
 #include <linux/async.h>
 #include <linux/timer.h>
+#include <linux/suspend.h>
 
 #include "../base.h"
 #include "power.h"
@@ -436,6 +437,7 @@ static void dpm_show_time(ktime_t starttime, pm_message_t state, char *info)
  */
 static int device_resume_noirq(struct device *dev, pm_message_t state)
 {
+	ktime_t start = suspend_profile_start();
 	int error = 0;
 
 	TRACE_DEVICE(dev);
@@ -461,6 +463,8 @@ static int device_resume_noirq(struct device *dev, pm_message_t state)
 	}
 
 End:
+	suspend_profile_end(SUSPEND_PROFILE_DEV_RESUME_NOIRQ, dev_name(dev),
+			    NULL, start, error);
 	TRACE_RESUME(error);
 	return error;
 }
@@ -522,6 +526,7 @@ static int legacy_resume(struct device *dev, int (*cb)(struct device *dev))
  */
 static int device_resume(struct device *dev, pm_message_t state, bool async)
 {
+	ktime_t start;
 	int error = 0;
 
 	TRACE_DEVICE(dev);
@@ -530,6 +535,7 @@ static int device_resume(struct device *dev, pm_message_t state, bool async)
 	if (dev->parent && dev->parent->power.status >= DPM_OFF)
 		dpm_wait(dev->parent, async);
 	device_lock(dev);
+	start = suspend_profile_start();
 
 	dev->power.status = DPM_RESUMING;
 
@@ -564,6 +570,8 @@ static int device_resume(struct device *dev, pm_message_t state, bool async)
 		}
 	}
  End:
+	suspend_profile_end(SUSPEND_PROFILE_DEV_RESUME, dev_name(dev), NULL,
+			    start, error);
 	device_unlock(dev);
 	complete_all(&dev->power.completion);
 
@@ -793,6 +801,7 @@ static pm_message_t resume_event(pm_message_t sleep_state)
  */
 static int device_suspend_noirq(struct device *dev, pm_message_t state)
 {
+	ktime_t start = suspend_profile_start();
 	int error = 0;
 
 	if (dev->class && dev->class->pm) {
@@ -815,6 +824,8 @@ static int device_suspend_noirq(struct device *dev, pm_message_t state)
 	}
 
 End:
+	suspend_profile_end(SUSPEND_PROFILE_DEV_SUSPEND_NOIRQ, dev_name(dev),
+			    NULL, start, error);
 	return error;
 }
 
@@ -882,6 +893,7 @@ static int async_error;
  */
 static int __device_suspend(struct device *dev, pm_message_t state, bool async)
 {
+	ktime_t start = ktime_set(0, 0);
 	int error = 0;
 
 	dpm_wait_for_children(dev, async);
@@ -890,6 +902,8 @@ static int __device_suspend(struct device *dev, pm_message_t state, bool async)
 	if (async_error)
 		goto End;
 
+	start = suspend_profile_start();
+
 	if (dev->class) {
 		if (dev->class->pm) {
 			pm_dev_dbg(dev, state, "class ");
@@ -925,6 +939,8 @@ static int __device_suspend(struct device *dev, pm_message_t state, bool async)
 		dev->power.status = DPM_OFF;
 
  End:
+	suspend_profile_end(SUSPEND_PROFILE_DEV_SUSPEND, dev_name(dev), NULL,
+			    start, error);
 	device_unlock(dev);
 	complete_all(&dev->power.completion);
 
@@ -368,6 +368,47 @@ void cpufreq_notify_transition(struct cpufreq_freqs *freqs, unsigned int state)
 }
 EXPORT_SYMBOL_GPL(cpufreq_notify_transition);
 
+/**
+ * cpufreq_notify_transition_cost - report the cost of a frequency transition
+ * @freqs: the transition as passed to cpufreq_notify_transition(), with
+ *	volt_us filled in
+ *
+ * Drivers that change the supply voltage outside of the PRECHANGE/POSTCHANGE
+ * window call this once the whole transition has completed, so that the
+ * time spent on the regulator can be accounted to the transition.
+ */
+void cpufreq_notify_transition_cost(struct cpufreq_freqs *freqs)
+{
+	freqs->flags = cpufreq_driver->flags;
+	srcu_notifier_call_chain(&cpufreq_transition_notifier_list,
+			CPUFREQ_TRANSITIONCOST, freqs);
+}
+EXPORT_SYMBOL_GPL(cpufreq_notify_transition_cost);
+
+/**
+ * cpufreq_notify_transition_skip - report a refused frequency transition
+ * @cpu: cpu the request was made for
+ * @cur: frequency the cpu stays at
+ *
+ * Drivers call this when a request to change the frequency was refused,
+ * or clamped by a platform constraint such as a DVFS lock to the frequency
+ * the cpu already runs at.  A clamp to another frequency is a normal
+ * transition.  The notifiers see a transition from @cur to @cur.
+ */
+void cpufreq_notify_transition_skip(unsigned int cpu, unsigned int cur)
+{
+	struct cpufreq_freqs freqs = {
+		.cpu = cpu,
+		.old = cur,
+		.new = cur,
+		.flags = cpufreq_driver->flags,
+	};
+
+	srcu_notifier_call_chain(&cpufreq_transition_notifier_list,
+			CPUFREQ_TRANSITIONSKIP, &freqs);
+}
+EXPORT_SYMBOL_GPL(cpufreq_notify_transition_skip);
+
 
 
 /*********************************************************************
@@ -0,0 +1,758 @@
+/*
+ *  drivers/cpufreq/cpufreq_interactive.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * The 'interactive' governor samples the load of each CPU on a short timer
+ * that is (re)started when the CPU leaves idle, so that a burst of work is
+ * seen after one timer period instead of being diluted over a sampling
+ * period that began while the CPU was idle.  Speed increases are applied
+ * immediately from a realtime thread, speed decreases only after the CPU
+ * has spent min_sample_time at the current speed.
+ *
+ * The load used to pick the next speed is the larger of the last sample
+ * and a prediction from a short history window: a linearly weighted
+ * average of the last history_len samples, corrected by their trend.
+ *
+ * Input events (touch, keys) and writes to boostpulse raise all CPUs to at
+ * least hispeed_freq for boostpulse_duration.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/cpufreq.h>
+#include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/input.h>
+#include <linux/jiffies.h>
+#include <linux/kernel_stat.h>
+#include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/notifier.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/tick.h>
+#include <linux/timer.h>
+#include <asm/idle.h>
+
+#define DEF_TIMER_RATE			(20 * USEC_PER_MSEC)
+#define DEF_MIN_SAMPLE_TIME		(80 * USEC_PER_MSEC)
+#define DEF_GO_HISPEED_LOAD		(85)
+#define DEF_HISTORY_LEN			(4)
+#define DEF_BOOSTPULSE_DURATION		(500 * USEC_PER_MSEC)
+#define MAX_HISTORY_LEN			(8)
+
+static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
+					unsigned int event);
+
+#ifndef CONFIG_CPU_FREQ_DEFAULT_GOV_INTERACTIVE
+static
+#endif
+struct cpufreq_governor cpufreq_gov_interactive = {
+	.name = "interactive",
+	.governor = cpufreq_governor_interactive,
+	.max_transition_latency = 10000000,
+	.owner = THIS_MODULE,
+};
+
+struct cpufreq_interactive_cpuinfo {
+	struct timer_list cpu_timer;
+	int idling;
+	/* the timer was not rearmed while idle at the lowest speed */
+	int timer_idlecancel;
+	u64 time_in_idle;
+	u64 idle_exit_time;
+	u64 freq_change_time;
+	struct cpufreq_policy *policy;
+	struct cpufreq_frequency_table *freq_table;
+	unsigned int target_freq;
+	unsigned int load_hist[MAX_HISTORY_LEN];
+	unsigned int hist_head;
+	unsigned int hist_count;
+	/*
+	 * Only (re)arm cpu_timer with enable_lock held and governor_enabled
+	 * set, so that del_timer_sync() after clearing it leaves no timer.
+	 */
+	spinlock_t enable_lock;
+	int governor_enabled;
+};
+
+static DEFINE_PER_CPU(struct cpufreq_interactive_cpuinfo, cpuinfo);
+
+/* CPUs whose target_freq must be applied by the speed change thread */
+static struct task_struct *speedchange_task;
+static cpumask_t speedchange_cpumask;
+static DEFINE_SPINLOCK(speedchange_cpumask_lock);
+/* serializes speed changes against governor limit changes */
+static DEFINE_MUTEX(set_speed_lock);
+
+/* protects the tunables below against concurrent sysfs writes, and
+ * governor start/stop */
+static DEFINE_MUTEX(interactive_mutex);
+static unsigned int interactive_enable;
+
+/* boost is active until this time, in jiffies */
+static unsigned long boost_until;
+
+static struct interactive_tuners {
+	unsigned int timer_rate;
+	unsigned int min_sample_time;
+	unsigned int hispeed_freq;
+	unsigned int go_hispeed_load;
+	unsigned int history_len;
+	unsigned int input_boost;
+	unsigned int boostpulse_duration;
+} tuners_ins = {
+	.timer_rate = DEF_TIMER_RATE,
+	.min_sample_time = DEF_MIN_SAMPLE_TIME,
+	.go_hispeed_load = DEF_GO_HISPEED_LOAD,
+	.history_len = DEF_HISTORY_LEN,
+	.input_boost = 1,
+	.boostpulse_duration = DEF_BOOSTPULSE_DURATION,
+};
+
+static inline cputime64_t get_cpu_idle_time_jiffy(unsigned int cpu,
+							cputime64_t *wall)
+{
+	cputime64_t idle_time;
+	cputime64_t cur_wall_time;
+	cputime64_t busy_time;
+
+	cur_wall_time = jiffies64_to_cputime64(get_jiffies_64());
+	busy_time = cputime64_add(kstat_cpu(cpu).cpustat.user,
+			kstat_cpu(cpu).cpustat.system);
+
+	busy_time = cputime64_add(busy_time, kstat_cpu(cpu).cpustat.irq);
+	busy_time = cputime64_add(busy_time, kstat_cpu(cpu).cpustat.softirq);
+	busy_time = cputime64_add(busy_time, kstat_cpu(cpu).cpustat.steal);
+	busy_time = cputime64_add(busy_time, kstat_cpu(cpu).cpustat.nice);
+
+	idle_time = cputime64_sub(cur_wall_time, busy_time);
+	if (wall)
+		*wall = (cputime64_t)jiffies_to_usecs(cur_wall_time);
+
+	return (cputime64_t)jiffies_to_usecs(idle_time);
+}
+
+static inline cputime64_t get_cpu_idle_time(unsigned int cpu, cputime64_t *wall)
+{
+	u64 idle_time = get_cpu_idle_time_us(cpu, wall);
+
+	if (idle_time == -1ULL)
+		return get_cpu_idle_time_jiffy(cpu, wall);
+
+	return idle_time;
+}
+
+static inline int boost_active(void)
+{
+	return time_before(jiffies, ACCESS_ONCE(boost_until));
+}
+
+/*
+ * Record @load and predict the load of the next sample from the last
+ * history_len samples: their average weighted 1..n from oldest to newest,
+ * plus the average change per sample over the window.
+ */
+static unsigned int predict_load(struct cpufreq_interactive_cpuinfo *pcpu,
+				 unsigned int load)
+{
+	unsigned int n, i, idx, weight;
+	unsigned int sum = 0, wsum = 0, oldest = load;
+	int pred;
+
+	pcpu->load_hist[pcpu->hist_head] = load;
+	pcpu->hist_head = (pcpu->hist_head + 1) % MAX_HISTORY_LEN;
+	if (pcpu->hist_count < MAX_HISTORY_LEN)
+		pcpu->hist_count++;
+
+	n = min(tuners_ins.history_len, pcpu->hist_count);
+	for (i = 0; i < n; i++) {
+		idx = (pcpu->hist_head + MAX_HISTORY_LEN - 1 - i) %
+			MAX_HISTORY_LEN;
+		weight = n - i;
+		sum += pcpu->load_hist[idx] * weight;
+		wsum += weight;
+		oldest = pcpu->load_hist[idx];
+	}
+
+	pred = sum / wsum;
+	if (n > 1)
+		pred += ((int)load - (int)oldest) / (int)(n - 1);
+
+	return clamp(pred, 0, 100);
+}
+
+static void speedchange_kick(unsigned int cpu)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&speedchange_cpumask_lock, flags);
+	cpumask_set_cpu(cpu, &speedchange_cpumask);
+	spin_unlock_irqrestore(&speedchange_cpumask_lock, flags);
+	wake_up_process(speedchange_task);
+}
+
+static void cpufreq_interactive_timer(unsigned long data)
+{
+	unsigned int cpu = data;
+	struct cpufreq_interactive_cpuinfo *pcpu = &per_cpu(cpuinfo, cpu);
+	struct cpufreq_policy *policy;
+	unsigned int delta_idle, delta_time;
+	unsigned int load, pred, new_freq, index;
+	unsigned long flags;
+	u64 now_idle, now;
+
+	smp_rmb();
+	if (!pcpu->governor_enabled)
+		return;
+	policy = pcpu->policy;
+
+	now_idle = get_cpu_idle_time(cpu, &now);
+	delta_idle = (unsigned int)(now_idle - pcpu->time_in_idle);
+	delta_time = (unsigned int)(now - pcpu->idle_exit_time);
+	pcpu->time_in_idle = now_idle;
+	pcpu->idle_exit_time = now;
+
+	if (!delta_time || delta_idle > delta_time)
+		load = 0;
+	else
+		load = 100 * (delta_time - delta_idle) / delta_time;
+
+	pred = max(load, predict_load(pcpu, load));
+
+	if (pred >= tuners_ins.go_hispeed_load &&
+	    policy->cur < tuners_ins.hispeed_freq)
+		new_freq = tuners_ins.hispeed_freq;
+	else
+		new_freq = policy->max * pred / 100;
+
+	if (boost_active() && new_freq < tuners_ins.hispeed_freq)
+		new_freq = tuners_ins.hispeed_freq;
+
+	if (cpufreq_frequency_table_target(policy, pcpu->freq_table, new_freq,
+					   CPUFREQ_RELATION_L, &index))
+		goto rearm;
+	new_freq = pcpu->freq_table[index].frequency;
+
+	/* Hold the current speed for min_sample_time before lowering it. */
+	if (new_freq < pcpu->target_freq &&
+	    now - pcpu->freq_change_time < tuners_ins.min_sample_time)
+		goto rearm;
+
+	if (new_freq != pcpu->target_freq) {
+		pcpu->target_freq = new_freq;
+		pcpu->freq_change_time = now;
+		speedchange_kick(cpu);
+	}
+
+rearm:
+	spin_lock_irqsave(&pcpu->enable_lock, flags);
+	/*
+	 * No need to keep sampling an idle CPU that already runs at the
+	 * lowest speed; the idle exit path restarts the timer.
+	 */
+	if (pcpu->idling && pcpu->target_freq == policy->min)
+		pcpu->timer_idlecancel = 1;
+	else if (pcpu->governor_enabled)
+		mod_timer_pinned(&pcpu->cpu_timer,
+			jiffies + usecs_to_jiffies(tuners_ins.timer_rate));
+	spin_unlock_irqrestore(&pcpu->enable_lock, flags);
+}
+
+static void cpufreq_interactive_idle_start(void)
+{
+	unsigned int cpu = smp_processor_id();
+	struct cpufreq_interactive_cpuinfo *pcpu = &per_cpu(cpuinfo, cpu);
+	unsigned long flags;
+
+	spin_lock_irqsave(&pcpu->enable_lock, flags);
+	if (!pcpu->governor_enabled)
+		goto out;
+
+	pcpu->idling = 1;
+
+	/*
+	 * Entering idle above the lowest speed: keep a timer pending so the
+	 * speed can be lowered while idle.
+	 */
+	if (pcpu->target_freq != pcpu->policy->min &&
+	    !timer_pending(&pcpu->cpu_timer)) {
+		pcpu->time_in_idle = get_cpu_idle_time(cpu,
+						       &pcpu->idle_exit_time);
+		pcpu->timer_idlecancel = 0;
+		mod_timer_pinned(&pcpu->cpu_timer,
+			  jiffies + usecs_to_jiffies(tuners_ins.timer_rate));
+	}
+out:
+	spin_unlock_irqrestore(&pcpu->enable_lock, flags);
+}
+
+static void cpufreq_interactive_idle_end(void)
+{
+	unsigned int cpu = smp_processor_id();
+	struct cpufreq_interactive_cpuinfo *pcpu = &per_cpu(cpuinfo, cpu);
+	unsigned long flags;
+
+	spin_lock_irqsave(&pcpu->enable_lock, flags);
+	pcpu->idling = 0;
+	if (!pcpu->governor_enabled)
+		goto out;
+
+	/*
+	 * Idle exit: start a fresh sampling window now, so that the load
+	 * from this point on is evaluated one timer period later.  History
+	 * from before a long idle period says nothing about the new burst.
+	 */
+	if (!timer_pending(&pcpu->cpu_timer)) {
+		if (pcpu->timer_idlecancel) {
+			pcpu->hist_count = 0;
+			pcpu->timer_idlecancel = 0;
+		}
+		pcpu->time_in_idle = get_cpu_idle_time(cpu,
+						       &pcpu->idle_exit_time);
+		mod_timer_pinned(&pcpu->cpu_timer,
+			  jiffies + usecs_to_jiffies(tuners_ins.timer_rate));
+	}
+out:
+	spin_unlock_irqrestore(&pcpu->enable_lock, flags);
+}
+
+static int cpufreq_interactive_idle_notifier(struct notifier_block *nb,
+					     unsigned long val, void *data)
+{
+	switch (val) {
+	case IDLE_START:
+		cpufreq_interactive_idle_start();
+		break;
+	case IDLE_END:
+		cpufreq_interactive_idle_end();
+		break;
+	}
+
+	return 0;
+}
+
+static struct notifier_block cpufreq_interactive_idle_nb = {
+	.notifier_call = cpufreq_interactive_idle_notifier,
+};
+
+static int cpufreq_interactive_speedchange_task(void *data)
+{
+	struct cpufreq_interactive_cpuinfo *pcpu;
+	cpumask_t tmp_mask;
+	unsigned long flags;
+	unsigned int cpu, j, max_freq;
+
+	while (1) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		spin_lock_irqsave(&speedchange_cpumask_lock, flags);
+
+		if (cpumask_empty(&speedchange_cpumask)) {
+			spin_unlock_irqrestore(&speedchange_cpumask_lock, flags);
+			schedule();
+
+			if (kthread_should_stop())
+				break;
+
+			spin_lock_irqsave(&speedchange_cpumask_lock, flags);
+		}
+
+		set_current_state(TASK_RUNNING);
+		tmp_mask = speedchange_cpumask;
+		cpumask_clear(&speedchange_cpumask);
+		spin_unlock_irqrestore(&speedchange_cpumask_lock, flags);
+
+		for_each_cpu(cpu, &tmp_mask) {
+			pcpu = &per_cpu(cpuinfo, cpu);
+			smp_rmb();
+			if (!pcpu->governor_enabled)
+				continue;
+
+			/* CPUs sharing a policy run at the fastest request */
+			max_freq = 0;
+			for_each_cpu(j, pcpu->policy->cpus) {
+				struct cpufreq_interactive_cpuinfo *pjcpu =
+					&per_cpu(cpuinfo, j);
+
+				if (pjcpu->target_freq > max_freq)
+					max_freq = pjcpu->target_freq;
+			}
+
+			mutex_lock(&set_speed_lock);
+			if (max_freq != pcpu->policy->cur)
+				__cpufreq_driver_target(pcpu->policy, max_freq,
+							CPUFREQ_RELATION_H);
+			mutex_unlock(&set_speed_lock);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Raise every CPU running this governor to at least hispeed_freq until
+ * boostpulse_duration from now.  Called with speedchange_cpumask_lock held,
+ * possibly from atomic context.
+ */
+static void cpufreq_interactive_boost(void)
+{
+	struct cpufreq_interactive_cpuinfo *pcpu;
+	unsigned int cpu;
+	int kick = 0;
+
+	boost_until = jiffies +
+		usecs_to_jiffies(tuners_ins.boostpulse_duration);
+
+	for_each_online_cpu(cpu) {
+		pcpu = &per_cpu(cpuinfo, cpu);
+		smp_rmb();
+		if (!pcpu->governor_enabled)
+			continue;
+
+		if (pcpu->target_freq < tuners_ins.hispeed_freq) {
+			pcpu->target_freq = tuners_ins.hispeed_freq;
+			cpumask_set_cpu(cpu, &speedchange_cpumask);
+			kick = 1;
+		}
+	}
+
+	if (kick)
+		wake_up_process(speedchange_task);
+}
+
+/************************** input boost ************************/
+
+static void interactive_input_event(struct input_handle *handle,
+				    unsigned int type, unsigned int code,
+				    int value)
+{
+	unsigned long flags;
+
+	if (!tuners_ins.input_boost || boost_active())
+		return;
+
+	spin_lock_irqsave(&speedchange_cpumask_lock, flags);
+	cpufreq_interactive_boost();
+	spin_unlock_irqrestore(&speedchange_cpumask_lock, flags);
+}
+
+static int interactive_input_connect(struct input_handler *handler,
+				     struct input_dev *dev,
+				     const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int error;
+
+	handle = kzalloc(sizeof(struct input_handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "cpufreq_interactive";
+
+	error = input_register_handle(handle);
+	if (error)
+		goto err_register;
+
+	error = input_open_device(handle);
+	if (error)
+		goto err_open;
+
+	return 0;
+
+err_open:
+	input_unregister_handle(handle);
+err_register:
+	kfree(handle);
+	return error;
+}
+
+static void interactive_input_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id interactive_input_ids[] = {
+	{
+		/* touchscreens */
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+		.absbit = { [BIT_WORD(ABS_MT_POSITION_X)] =
+			    BIT_MASK(ABS_MT_POSITION_X) |
+			    BIT_MASK(ABS_MT_POSITION_Y) },
+	},
+	{
+		/* single touch touchscreens and touchpads */
+		.flags = INPUT_DEVICE_ID_MATCH_KEYBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.keybit = { [BIT_WORD(BTN_TOUCH)] = BIT_MASK(BTN_TOUCH) },
+		.absbit = { [BIT_WORD(ABS_X)] =
+			    BIT_MASK(ABS_X) | BIT_MASK(ABS_Y) },
+	},
+	{
+		/* keypads and buttons */
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+	},
+	{ },
+};
+
+static struct input_handler interactive_input_handler = {
+	.event		= interactive_input_event,
+	.connect	= interactive_input_connect,
+	.disconnect	= interactive_input_disconnect,
+	.name		= "cpufreq_interactive",
+	.id_table	= interactive_input_ids,
+};
+
+/************************** sysfs interface ************************/
+
+#define show_one(file_name, object)					\
+static ssize_t show_##file_name						\
+(struct kobject *kobj, struct attribute *attr, char *buf)		\
+{									\
+	return sprintf(buf, "%u\n", tuners_ins.object);			\
+}
+show_one(timer_rate, timer_rate);
+show_one(min_sample_time, min_sample_time);
+show_one(hispeed_freq, hispeed_freq);
+show_one(go_hispeed_load, go_hispeed_load);
+show_one(history_len, history_len);
+show_one(input_boost, input_boost);
+show_one(boostpulse_duration, boostpulse_duration);
+
+#define store_one(file_name, object, min, max)				\
+static ssize_t store_##file_name					\
+(struct kobject *a, struct attribute *b, const char *buf, size_t count)	\
+{									\
+	unsigned int input;						\
+	int ret;							\
+									\
+	ret = sscanf(buf, "%u", &input);				\
+	if (ret != 1 || input < (min) || input > (max))			\
+		return -EINVAL;						\
+									\
+	mutex_lock(&interactive_mutex);					\
+	tuners_ins.object = input;					\
+	mutex_unlock(&interactive_mutex);				\
+									\
+	return count;							\
+}
+store_one(timer_rate, timer_rate, USEC_PER_MSEC, USEC_PER_SEC);
+store_one(min_sample_time, min_sample_time, 0, 10 * USEC_PER_SEC);
+store_one(hispeed_freq, hispeed_freq, 0, UINT_MAX);
+store_one(go_hispeed_load, go_hispeed_load, 1, 100);
+store_one(history_len, history_len, 1, MAX_HISTORY_LEN);
+store_one(input_boost, input_boost, 0, 1);
+store_one(boostpulse_duration, boostpulse_duration, 0, 10 * USEC_PER_SEC);
+
+static ssize_t show_boostpulse(struct kobject *kobj, struct attribute *attr,
+			       char *buf)
+{
+	return sprintf(buf, "%d\n", boost_active());
+}
+
+static ssize_t store_boostpulse(struct kobject *a, struct attribute *b,
+				const char *buf, size_t count)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&speedchange_cpumask_lock, flags);
+	cpufreq_interactive_boost();
+	spin_unlock_irqrestore(&speedchange_cpumask_lock, flags);
+
+	return count;
+}
+
+define_one_global_rw(timer_rate);
+define_one_global_rw(min_sample_time);
+define_one_global_rw(hispeed_freq);
+define_one_global_rw(go_hispeed_load);
+define_one_global_rw(history_len);
+define_one_global_rw(input_boost);
+define_one_global_rw(boostpulse_duration);
+define_one_global_rw(boostpulse);
+
+static struct attribute *interactive_attributes[] = {
+	&timer_rate.attr,
+	&min_sample_time.attr,
+	&hispeed_freq.attr,
+	&go_hispeed_load.attr,
+	&history_len.attr,
+	&input_boost.attr,
+	&boostpulse_duration.attr,
+	&boostpulse.attr,
+	NULL
+};
+
+static struct attribute_group interactive_attr_group = {
+	.attrs = interactive_attributes,
+	.name = "interactive",
+};
+
+/************************** sysfs end ************************/
+
+static void cpufreq_interactive_disable(unsigned int cpu)
+{
+	struct cpufreq_interactive_cpuinfo *pcpu = &per_cpu(cpuinfo, cpu);
+	unsigned long flags;
+
+	spin_lock_irqsave(&pcpu->enable_lock, flags);
+	pcpu->governor_enabled = 0;
+	spin_unlock_irqrestore(&pcpu->enable_lock, flags);
+
+	/* nobody rearms the timer any more, a running handler included */
+	del_timer_sync(&pcpu->cpu_timer);
+}
+
+static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
+					unsigned int event)
+{
+	struct cpufreq_interactive_cpuinfo *pcpu;
+	unsigned long flags;
+	unsigned int j;
+	int rc;
+
+	switch (event) {
+	case CPUFREQ_GOV_START:
+		if (!cpu_online(policy->cpu) || !policy->cur)
+			return -EINVAL;
+
+		mutex_lock(&interactive_mutex);
+
+		for_each_cpu(j, policy->cpus) {
+			pcpu = &per_cpu(cpuinfo, j);
+			pcpu->freq_table = cpufreq_frequency_get_table(j);
+			if (!pcpu->freq_table)
+				continue;
+			pcpu->policy = policy;
+			pcpu->target_freq = policy->cur;
+			pcpu->time_in_idle = get_cpu_idle_time(j,
+						&pcpu->idle_exit_time);
+			pcpu->freq_change_time = pcpu->idle_exit_time;
+			pcpu->hist_count = 0;
+			pcpu->timer_idlecancel = 0;
+			pcpu->idling = 0;
+
+			/*
+			 * The idle notifier may arm the timer as soon as
+			 * governor_enabled is visible; the lock keeps it from
+			 * doing so between the pending check and add_timer_on.
+			 */
+			spin_lock_irqsave(&pcpu->enable_lock, flags);
+			pcpu->governor_enabled = 1;
+			if (!timer_pending(&pcpu->cpu_timer)) {
+				pcpu->cpu_timer.expires = jiffies +
+					usecs_to_jiffies(tuners_ins.timer_rate);
+				add_timer_on(&pcpu->cpu_timer, j);
+			}
+			spin_unlock_irqrestore(&pcpu->enable_lock, flags);
+		}
+
+		if (!tuners_ins.hispeed_freq)
+			tuners_ins.hispeed_freq = policy->max;
+
+		if (++interactive_enable == 1) {
+			rc = sysfs_create_group(cpufreq_global_kobject,
+						&interactive_attr_group);
+			if (rc) {
+				for_each_cpu(j, policy->cpus)
+					cpufreq_interactive_disable(j);
+				--interactive_enable;
+				mutex_unlock(&interactive_mutex);
+				return rc;
+			}
+			rc = input_register_handler(&interactive_input_handler);
+			if (rc)
+				pr_warning("%s: failed to register input "
+					   "handler: %d\n", __func__, rc);
+		}
+
+		mutex_unlock(&interactive_mutex);
+		break;
+
+	case CPUFREQ_GOV_STOP:
+		mutex_lock(&interactive_mutex);
+
+		for_each_cpu(j, policy->cpus)
+			cpufreq_interactive_disable(j);
+
+		if (--interactive_enable == 0) {
+			input_unregister_handler(&interactive_input_handler);
+			sysfs_remove_group(cpufreq_global_kobject,
+					   &interactive_attr_group);
+		}
+
+		mutex_unlock(&interactive_mutex);
+		break;
+
+	case CPUFREQ_GOV_LIMITS:
+		mutex_lock(&set_speed_lock);
+		if (policy->max < policy->cur)
+			__cpufreq_driver_target(policy,
+					policy->max, CPUFREQ_RELATION_H);
+		else if (policy->min > policy->cur)
+			__cpufreq_driver_target(policy,
+					policy->min, CPUFREQ_RELATION_L);
+		mutex_unlock(&set_speed_lock);
+		break;
+	}
+	return 0;
+}
+
+static int __init cpufreq_interactive_init(void)
+{
+	struct sched_param param = { .sched_priority = MAX_RT_PRIO - 1 };
+	struct cpufreq_interactive_cpuinfo *pcpu;
+	unsigned int i;
+	int rc;
+
+	for_each_possible_cpu(i) {
+		pcpu = &per_cpu(cpuinfo, i);
+		init_timer(&pcpu->cpu_timer);
+		pcpu->cpu_timer.function = cpufreq_interactive_timer;
+		pcpu->cpu_timer.data = i;
+		spin_lock_init(&pcpu->enable_lock);
+	}
+
+	speedchange_task = kthread_create(cpufreq_interactive_speedchange_task,
+					  NULL, "kinteractive");
+	if (IS_ERR(speedchange_task))
+		return PTR_ERR(speedchange_task);
+
+	sched_setscheduler_nocheck(speedchange_task, SCHED_FIFO, &param);
+	get_task_struct(speedchange_task);
+
+	/* kthread_create() leaves the task sleeping; wake it once */
+	wake_up_process(speedchange_task);
+
+	idle_notifier_register(&cpufreq_interactive_idle_nb);
+
+	rc = cpufreq_register_governor(&cpufreq_gov_interactive);
+	if (rc) {
+		idle_notifier_unregister(&cpufreq_interactive_idle_nb);
+		kthread_stop(speedchange_task);
+		put_task_struct(speedchange_task);
+		return rc;
+	}
+
+	return 0;
+}
+
+#ifdef CONFIG_CPU_FREQ_DEFAULT_GOV_INTERACTIVE
+fs_initcall(cpufreq_interactive_init);
+#else
+module_init(cpufreq_interactive_init);
+#endif
+
+MODULE_DESCRIPTION("'cpufreq_interactive' - A cpufreq governor for "
+	"latency sensitive workloads");
+MODULE_LICENSE("GPL");
@@ -20,10 +20,25 @@
 #include <linux/kobject.h>
 #include <linux/spinlock.h>
 #include <linux/notifier.h>
+#include <linux/hrtimer.h>
 #include <asm/cputime.h>
 
 static spinlock_t cpufreq_stats_lock;
 
+/* bucket n counts transitions of [2^(n-1), 2^n) usecs, the last the rest */
+#define TRANS_HIST_BUCKETS	16
+
+/* cost of the transitions between one pair of frequencies */
+struct cpufreq_trans_cost {
+	unsigned int count;
+	unsigned int max_us;
+	u64 total_us;
+	unsigned int volt_count;
+	unsigned int volt_max_us;
+	u64 volt_total_us;
+	unsigned int hist[TRANS_HIST_BUCKETS];
+};
+
 #define CPUFREQ_STATDEVICE_ATTR(_name, _mode, _show) \
 static struct freq_attr _attr_##_name = {\
 	.attr = {.name = __stringify(_name), .mode = _mode, }, \
@@ -39,9 +54,12 @@ struct cpufreq_stats {
 	unsigned int last_index;
 	cputime64_t *time_in_state;
 	unsigned int *freq_table;
+	unsigned int *skip_table;
 #ifdef CONFIG_CPU_FREQ_STAT_DETAILS
 	unsigned int *trans_table;
 #endif
+	struct cpufreq_trans_cost *cost_table;
+	ktime_t prechange_time;
 };
 
 static DEFINE_PER_CPU(struct cpufreq_stats *, cpufreq_stats_table);
@@ -140,12 +158,114 @@ static ssize_t show_trans_table(struct cpufreq_policy *policy, char *buf)
 CPUFREQ_STATDEVICE_ATTR(trans_table, 0444, show_trans_table);
 #endif
 
+static ssize_t show_trans_latency(struct cpufreq_policy *policy, char *buf)
+{
+	ssize_t len = 0;
+	int i, j;
+	struct cpufreq_trans_cost *cost;
+	struct cpufreq_stats *stat = per_cpu(cpufreq_stats_table, policy->cpu);
+	if (!stat)
+		return 0;
+	len += snprintf(buf + len, PAGE_SIZE - len, "     From        To "
+			"   Count   Avg_us   Max_us Volt_avg Volt_max\n");
+	spin_lock(&cpufreq_stats_lock);
+	for (i = 0; i < stat->state_num; i++) {
+		for (j = 0; j < stat->state_num; j++) {
+			u64 avg = 0, volt_avg = 0;
+
+			cost = &stat->cost_table[i * stat->max_state + j];
+			if (!cost->count && !cost->volt_count)
+				continue;
+			if (len >= PAGE_SIZE)
+				break;
+			if (cost->count) {
+				avg = cost->total_us;
+				do_div(avg, cost->count);
+			}
+			if (cost->volt_count) {
+				volt_avg = cost->volt_total_us;
+				do_div(volt_avg, cost->volt_count);
+			}
+			len += snprintf(buf + len, PAGE_SIZE - len,
+				"%9u %9u %8u %8llu %8u %8llu %8u\n",
+				stat->freq_table[i], stat->freq_table[j],
+				cost->count, (unsigned long long)avg,
+				cost->max_us, (unsigned long long)volt_avg,
+				cost->volt_max_us);
+		}
+	}
+	spin_unlock(&cpufreq_stats_lock);
+	if (len >= PAGE_SIZE)
+		return PAGE_SIZE;
+	return len;
+}
+
+static ssize_t show_trans_latency_hist(struct cpufreq_policy *policy,
+		char *buf)
+{
+	ssize_t len = 0;
+	int i, j, b;
+	struct cpufreq_trans_cost *cost;
+	struct cpufreq_stats *stat = per_cpu(cpufreq_stats_table, policy->cpu);
+	if (!stat)
+		return 0;
+	spin_lock(&cpufreq_stats_lock);
+	for (i = 0; i < stat->state_num; i++) {
+		for (j = 0; j < stat->state_num; j++) {
+			cost = &stat->cost_table[i * stat->max_state + j];
+			if (!cost->count)
+				continue;
+			if (len >= PAGE_SIZE)
+				break;
+			len += snprintf(buf + len, PAGE_SIZE - len, "%9u %9u:",
+				stat->freq_table[i], stat->freq_table[j]);
+			for (b = 0; b < TRANS_HIST_BUCKETS; b++) {
+				if (!cost->hist[b])
+					continue;
+				if (b == TRANS_HIST_BUCKETS - 1)
+					len += snprintf(buf + len,
+						PAGE_SIZE - len, " >=%u:%u",
+						1U << (b - 1), cost->hist[b]);
+				else
+					len += snprintf(buf + len,
+						PAGE_SIZE - len, " <%u:%u",
+						1U << b, cost->hist[b]);
+			}
+			len += snprintf(buf + len, PAGE_SIZE - len, "\n");
+		}
+	}
+	spin_unlock(&cpufreq_stats_lock);
+	if (len >= PAGE_SIZE)
+		return PAGE_SIZE;
+	return len;
+}
+
+static ssize_t show_trans_skipped(struct cpufreq_policy *policy, char *buf)
+{
+	ssize_t len = 0;
+	int i;
+	struct cpufreq_stats *stat = per_cpu(cpufreq_stats_table, policy->cpu);
+	if (!stat)
+		return 0;
+	for (i = 0; i < stat->state_num; i++) {
+		len += sprintf(buf + len, "%u %u\n", stat->freq_table[i],
+			stat->skip_table[i]);
+	}
+	return len;
+}
+
 CPUFREQ_STATDEVICE_ATTR(total_trans, 0444, show_total_trans);
 CPUFREQ_STATDEVICE_ATTR(time_in_state, 0444, show_time_in_state);
+CPUFREQ_STATDEVICE_ATTR(trans_latency, 0444, show_trans_latency);
+CPUFREQ_STATDEVICE_ATTR(trans_latency_hist, 0444, show_trans_latency_hist);
+CPUFREQ_STATDEVICE_ATTR(trans_skipped, 0444, show_trans_skipped);
 
 static struct attribute *default_attrs[] = {
 	&_attr_total_trans.attr,
 	&_attr_time_in_state.attr,
+	&_attr_trans_latency.attr,
+	&_attr_trans_latency_hist.attr,
+	&_attr_trans_skipped.attr,
 #ifdef CONFIG_CPU_FREQ_STAT_DETAILS
 	&_attr_trans_table.attr,
 #endif
@@ -172,6 +292,7 @@ static void cpufreq_stats_free_table(unsigned int cpu)
 	if (policy && policy->cpu == cpu)
 		sysfs_remove_group(&policy->kobj, &stats_attr_group);
 	if (stat) {
+		kfree(stat->cost_table);
 		kfree(stat->time_in_state);
 		kfree(stat);
 	}
@@ -214,7 +335,7 @@ static int cpufreq_stats_create_table(struct cpufreq_policy *policy,
 		count++;
 	}
 
-	alloc_size = count * sizeof(int) + count * sizeof(cputime64_t);
+	alloc_size = 2 * count * sizeof(int) + count * sizeof(cputime64_t);
 
 #ifdef CONFIG_CPU_FREQ_STAT_DETAILS
 	alloc_size += count * count * sizeof(int);
@@ -226,10 +347,18 @@ static int cpufreq_stats_create_table(struct cpufreq_policy *policy,
 		goto error_out;
 	}
 	stat->freq_table = (unsigned int *)(stat->time_in_state + count);
+	stat->skip_table = stat->freq_table + count;
 
 #ifdef CONFIG_CPU_FREQ_STAT_DETAILS
-	stat->trans_table = stat->freq_table + count;
+	stat->trans_table = stat->skip_table + count;
 #endif
+	stat->cost_table = kzalloc(count * count *
+			sizeof(struct cpufreq_trans_cost), GFP_KERNEL);
+	if (!stat->cost_table) {
+		kfree(stat->time_in_state);
+		ret = -ENOMEM;
+		goto error_out;
+	}
 	j = 0;
 	for (i = 0; table[i].frequency != CPUFREQ_TABLE_END; i++) {
 		unsigned int freq = table[i].frequency;
@@ -271,20 +400,64 @@ static int cpufreq_stat_notifier_policy(struct notifier_block *nb,
 	return 0;
 }
 
+static int cpufreq_stats_account_volt(struct cpufreq_stats *stat,
+		struct cpufreq_freqs *freq)
+{
+	struct cpufreq_trans_cost *cost;
+	int old_index, new_index;
+
+	old_index = freq_table_get_index(stat, freq->old);
+	new_index = freq_table_get_index(stat, freq->new);
+	if (old_index == -1 || new_index == -1 || old_index == new_index)
+		return 0;
+
+	spin_lock(&cpufreq_stats_lock);
+	cost = &stat->cost_table[old_index * stat->max_state + new_index];
+	cost->volt_count++;
+	cost->volt_total_us += freq->volt_us;
+	if (freq->volt_us > cost->volt_max_us)
+		cost->volt_max_us = freq->volt_us;
+	spin_unlock(&cpufreq_stats_lock);
+	return 0;
+}
+
 static int cpufreq_stat_notifier_trans(struct notifier_block *nb,
 		unsigned long val, void *data)
 {
 	struct cpufreq_freqs *freq = data;
 	struct cpufreq_stats *stat;
+	struct cpufreq_trans_cost *cost;
 	int old_index, new_index;
-
-	if (val != CPUFREQ_POSTCHANGE)
-		return 0;
+	ktime_t prechange_time;
+	unsigned int usecs;
 
 	stat = per_cpu(cpufreq_stats_table, freq->cpu);
 	if (!stat)
 		return 0;
 
+	switch (val) {
+	case CPUFREQ_PRECHANGE:
+		stat->prechange_time = ktime_get();
+		return 0;
+	case CPUFREQ_TRANSITIONCOST:
+		return cpufreq_stats_account_volt(stat, freq);
+	case CPUFREQ_TRANSITIONSKIP:
+		old_index = freq_table_get_index(stat, freq->old);
+		if (old_index == -1)
+			return 0;
+		spin_lock(&cpufreq_stats_lock);
+		stat->skip_table[old_index]++;
+		spin_unlock(&cpufreq_stats_lock);
+		return 0;
+	case CPUFREQ_POSTCHANGE:
+		break;
+	default:
+		return 0;
+	}
+
+	prechange_time = stat->prechange_time;
+	stat->prechange_time = ktime_set(0, 0);
+
 	old_index = stat->last_index;
 	new_index = freq_table_get_index(stat, freq->new);
 
@@ -295,12 +468,25 @@ static int cpufreq_stat_notifier_trans(struct notifier_block *nb,
 	if (old_index == -1 || new_index == -1)
 		return 0;
 
+	usecs = 0;
+	if (prechange_time.tv64)
+		usecs = ktime_us_delta(ktime_get(), prechange_time);
+
 	spin_lock(&cpufreq_stats_lock);
 	stat->last_index = new_index;
 #ifdef CONFIG_CPU_FREQ_STAT_DETAILS
 	stat->trans_table[old_index * stat->max_state + new_index]++;
 #endif
 	stat->total_trans++;
+	if (prechange_time.tv64) {
+		cost = &stat->cost_table[old_index * stat->max_state +
+					 new_index];
+		cost->count++;
+		cost->total_us += usecs;
+		if (usecs > cost->max_us)
+			cost->max_us = usecs;
+		cost->hist[min(fls(usecs), TRANS_HIST_BUCKETS - 1)]++;
+	}
 	spin_unlock(&cpufreq_stats_lock);
 	return 0;
 }
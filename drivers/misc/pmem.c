@@ -19,17 +19,22 @@
 #include <linux/file.h>
 #include <linux/mm.h>
 #include <linux/list.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
 #include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <linux/android_pmem.h>
 #include <linux/mempolicy.h>
 #include <linux/sched.h>
+#include <linux/dma-mapping.h>
 #include <asm/io.h>
 #include <asm/uaccess.h>
 #include <asm/cacheflush.h>
 
 #define PMEM_MAX_DEVICES 10
-#define PMEM_MAX_ORDER 128
 #define PMEM_MIN_ALLOC PAGE_SIZE
+/* most an allocation may move by compaction before it gives up, in pages */
+#define PMEM_COMPACT_MAX_PAGES ((4 * 1024 * 1024) / PMEM_MIN_ALLOC)
 
 #define PMEM_DEBUG 1
 
@@ -48,6 +53,8 @@
  */
 #define PMEM_FLAGS_SUBMAP 0x1 << 3
 #define PMEM_FLAGS_UNSUBMAP 0x1 << 4
+/* indicates this allocation is mapped uncached in a cached region */
+#define PMEM_FLAGS_UNCACHED 0x1 << 5
 
 
 struct pmem_data {
@@ -79,9 +86,16 @@ struct pmem_data {
 #endif
 };
 
-struct pmem_bits {
-	unsigned allocated:1;		/* 1 if allocated, 0 if free */
-	unsigned order:7;		/* size of the region in pmem space */
+/* a contiguous run of pages in pmem space, either allocated or free */
+struct pmem_block {
+	struct rb_node addr_node;	/* in pmem_info.blocks, by index */
+	struct rb_node size_node;	/* in pmem_info.free_blocks if free */
+	unsigned long index;		/* first page of the block */
+	unsigned long pages;		/* length of the block in pages */
+	unsigned free:1;		/* 1 if free, 0 if allocated */
+	unsigned phys_exposed:1;	/* physical address given to user */
+	int pin_count;			/* get_pmem_file references */
+	int map_count;			/* vmas mapping the block */
 };
 
 struct pmem_region_node {
@@ -113,9 +127,15 @@ struct pmem_info {
 	unsigned long garbage_pfn;
 	/* index of the garbage page in the pmem space */
 	int garbage_index;
-	/* the bitmap for the region indicating which entries are allocated
-	 * and which are free */
-	struct pmem_bits *bitmap;
+	/* every block in the region sorted by address, and the free ones
+	 * sorted by size for best fit allocation */
+	struct rb_root blocks;
+	struct rb_root free_blocks;
+	unsigned long free_pages;
+	/* allocator statistics for the debugfs fragmentation report */
+	unsigned long alloc_failures;
+	unsigned long compactions;
+	unsigned long compacted_pages;
 	/* indicates the region should not be managed with an allocator */
 	unsigned no_allocator;
 	/* indicates maps of this region should be cached, if a mix of
@@ -131,10 +151,10 @@ struct pmem_info {
 	 * needed */
 	struct semaphore data_list_sem;
 	struct list_head data_list;
-	/* pmem_sem protects the bitmap array
-	 * a write lock should be held when modifying entries in bitmap
-	 * a read lock should be held when reading data from bits or
-	 * dereferencing a pointer into bitmap
+	/* bitmap_sem protects the block trees and the blocks in them
+	 * a write lock should be held when modifying blocks
+	 * a read lock should be held when reading data from blocks or
+	 * dereferencing a pointer to a block
 	 *
 	 * pmem_data->sem protects the pmem data of a particular file
 	 * Many of the function that require the pmem_data->sem have a non-
@@ -152,18 +172,11 @@ struct pmem_info {
 static struct pmem_info pmem[PMEM_MAX_DEVICES];
 static int id_count;
 
-#define PMEM_IS_FREE(id, index) !(pmem[id].bitmap[index].allocated)
-#define PMEM_ORDER(id, index) pmem[id].bitmap[index].order
-#define PMEM_BUDDY_INDEX(id, index) (index ^ (1 << PMEM_ORDER(id, index)))
-#define PMEM_NEXT_INDEX(id, index) (index + (1 << PMEM_ORDER(id, index)))
-#define PMEM_OFFSET(index) (index * PMEM_MIN_ALLOC)
+#define PMEM_OFFSET(index) ((index) * PMEM_MIN_ALLOC)
 #define PMEM_START_ADDR(id, index) (PMEM_OFFSET(index) + pmem[id].base)
-#define PMEM_LEN(id, index) ((1 << PMEM_ORDER(id, index)) * PMEM_MIN_ALLOC)
-#define PMEM_END_ADDR(id, index) (PMEM_START_ADDR(id, index) + \
-	PMEM_LEN(id, index))
-#define PMEM_START_VADDR(id, index) (PMEM_OFFSET(id, index) + pmem[id].vbase)
-#define PMEM_END_VADDR(id, index) (PMEM_START_VADDR(id, index) + \
-	PMEM_LEN(id, index))
+#define PMEM_START_VADDR(id, index) (PMEM_OFFSET(index) + pmem[id].vbase)
+#define PMEM_BLOCK_MOVABLE(block) (!(block)->free && \
+	!(block)->pin_count && !(block)->map_count && !(block)->phys_exposed)
 #define PMEM_REVOKED(data) (data->flags & PMEM_FLAGS_REVOKED)
 #define PMEM_IS_PAGE_ALIGNED(addr) (!((addr) & (~PAGE_MASK)))
 #define PMEM_IS_SUBMAP(data) ((data->flags & PMEM_FLAGS_SUBMAP) && \
@@ -232,33 +245,120 @@ static int is_master_owner(struct file *file)
 	return ret;
 }
 
+static struct pmem_block *pmem_block_find(int id, unsigned long index)
+{
+	/* caller should hold a lock on pmem_sem! */
+	struct rb_node *n = pmem[id].blocks.rb_node;
+
+	while (n) {
+		struct pmem_block *block;
+
+		block = rb_entry(n, struct pmem_block, addr_node);
+		if (index < block->index)
+			n = n->rb_left;
+		else if (index > block->index)
+			n = n->rb_right;
+		else
+			return block;
+	}
+	return NULL;
+}
+
+static void pmem_block_insert(int id, struct pmem_block *block)
+{
+	struct rb_node **p = &pmem[id].blocks.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*p) {
+		struct pmem_block *entry;
+
+		parent = *p;
+		entry = rb_entry(parent, struct pmem_block, addr_node);
+		if (block->index < entry->index)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&block->addr_node, parent, p);
+	rb_insert_color(&block->addr_node, &pmem[id].blocks);
+}
+
+static void pmem_free_block_insert(int id, struct pmem_block *block)
+{
+	struct rb_node **p = &pmem[id].free_blocks.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*p) {
+		struct pmem_block *entry;
+
+		parent = *p;
+		entry = rb_entry(parent, struct pmem_block, size_node);
+		if (block->pages < entry->pages ||
+		    (block->pages == entry->pages &&
+		     block->index < entry->index))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&block->size_node, parent, p);
+	rb_insert_color(&block->size_node, &pmem[id].free_blocks);
+}
+
+static struct pmem_block *pmem_block_next(struct pmem_block *block)
+{
+	struct rb_node *n = rb_next(&block->addr_node);
+
+	return n ? rb_entry(n, struct pmem_block, addr_node) : NULL;
+}
+
+static struct pmem_block *pmem_block_prev(struct pmem_block *block)
+{
+	struct rb_node *n = rb_prev(&block->addr_node);
+
+	return n ? rb_entry(n, struct pmem_block, addr_node) : NULL;
+}
+
+/* merge a free block with its free neighbours and put it in the free tree */
+static void pmem_free_block_merge(int id, struct pmem_block *block)
+{
+	struct pmem_block *next = pmem_block_next(block);
+	struct pmem_block *prev = pmem_block_prev(block);
+
+	if (next && next->free) {
+		rb_erase(&next->size_node, &pmem[id].free_blocks);
+		rb_erase(&next->addr_node, &pmem[id].blocks);
+		block->pages += next->pages;
+		kfree(next);
+	}
+	if (prev && prev->free) {
+		rb_erase(&prev->size_node, &pmem[id].free_blocks);
+		rb_erase(&block->addr_node, &pmem[id].blocks);
+		prev->pages += block->pages;
+		kfree(block);
+		block = prev;
+	}
+	pmem_free_block_insert(id, block);
+}
+
 static int pmem_free(int id, int index)
 {
 	/* caller should hold the write lock on pmem_sem! */
-	int buddy, curr = index;
+	struct pmem_block *block;
 	DLOG("index %d\n", index);
 
 	if (pmem[id].no_allocator) {
 		pmem[id].allocated = 0;
 		return 0;
 	}
-	/* clean up the bitmap, merging any buddies */
-	pmem[id].bitmap[curr].allocated = 0;
-	/* find a slots buddy Buddy# = Slot# ^ (1 << order)
-	 * if the buddy is also free merge them
-	 * repeat until the buddy is not free or end of the bitmap is reached
-	 */
-	do {
-		buddy = PMEM_BUDDY_INDEX(id, curr);
-		if (PMEM_IS_FREE(id, buddy) &&
-				PMEM_ORDER(id, buddy) == PMEM_ORDER(id, curr)) {
-			PMEM_ORDER(id, buddy)++;
-			PMEM_ORDER(id, curr)++;
-			curr = min(buddy, curr);
-		} else {
-			break;
-		}
-	} while (curr < pmem[id].num_entries);
+	block = pmem_block_find(id, index);
+	if (unlikely(!block || block->free)) {
+		printk(KERN_ERR "pmem: freeing unallocated index %d\n", index);
+		return -1;
+	}
+	block->free = 1;
+	block->phys_exposed = 0;
+	pmem[id].free_pages += block->pages;
+	pmem_free_block_merge(id, block);
 
 	return 0;
 }
@@ -289,16 +389,17 @@ static int pmem_release(struct inode *inode, struct file *file)
 				up_read(&sub_data->sem);
 		}
 	}
-	list_del(&data->list);
 	up(&pmem[id].data_list_sem);
 
-
+	/* stay on data_list until the allocation is freed, so compaction
+	 * cannot move it without updating (or trylocking) this file too */
 	down_write(&data->sem);
 
 	/* if its not a conencted file and it has an allocation, free it */
 	if (!(PMEM_FLAGS_CONNECTED & data->flags) && has_allocation(file)) {
 		down_write(&pmem[id].bitmap_sem);
 		ret = pmem_free(id, data->index);
+		data->index = -1;
 		up_write(&pmem[id].bitmap_sem);
 	}
 
@@ -320,6 +421,11 @@ static int pmem_release(struct inode *inode, struct file *file)
 	BUG_ON(!list_empty(&data->region_list));
 
 	up_write(&data->sem);
+
+	down(&pmem[id].data_list_sem);
+	list_del(&data->list);
+	up(&pmem[id].data_list_sem);
+
 	kfree(data);
 	if (pmem[id].release)
 		ret = pmem[id].release(inode, file);
@@ -364,26 +470,145 @@ static int pmem_open(struct inode *inode, struct file *file)
 	return ret;
 }
 
-static unsigned long pmem_order(unsigned long len)
+/* smallest free block of at least 'pages' pages, lowest address on ties */
+static struct pmem_block *pmem_best_fit(int id, unsigned long pages)
 {
-	int i;
+	struct rb_node *n = pmem[id].free_blocks.rb_node;
+	struct pmem_block *best_fit = NULL;
+
+	while (n) {
+		struct pmem_block *block;
+
+		block = rb_entry(n, struct pmem_block, size_node);
+		if (block->pages >= pages) {
+			best_fit = block;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+	return best_fit;
+}
 
-	len = (len + PMEM_MIN_ALLOC - 1)/PMEM_MIN_ALLOC;
-	len--;
-	for (i = 0; i < sizeof(len)*8; i++)
-		if (len >> i == 0)
+/* try to write lock every file using the allocation at 'index' */
+static int pmem_lock_block_users(int id, unsigned long index)
+{
+	struct pmem_data *data, *locked;
+	int users = 0;
+
+	list_for_each_entry(data, &pmem[id].data_list, list) {
+		if (data->index != index)
+			continue;
+		if (!down_write_trylock(&data->sem))
+			goto fail;
+		users++;
+	}
+	/* the owner stays on data_list until the block is freed, so no
+	 * users should not happen; leave such a block alone */
+	return users ? 0 : -1;
+fail:
+	list_for_each_entry(locked, &pmem[id].data_list, list) {
+		if (locked == data)
 			break;
-	return i;
+		if (locked->index == index)
+			up_write(&locked->sem);
+	}
+	return -1;
+}
+
+static void pmem_move_block_users(int id, unsigned long from,
+				  unsigned long to)
+{
+	struct pmem_data *data;
+
+	list_for_each_entry(data, &pmem[id].data_list, list) {
+		if (data->index != from)
+			continue;
+		data->index = to;
+		up_write(&data->sem);
+	}
+}
+
+/*
+ * pmem_compact - slide movable allocations down into the free space below
+ * them so the free space coalesces towards the end of the region.
+ *
+ * An allocation is movable if it is not mapped, not referenced through
+ * get_pmem_file and its physical address was never handed to user space.
+ * Files using it are only trylocked since the caller may hold the sem of
+ * the file being allocated for, so busy allocations are left in place.
+ *
+ * Stops as soon as a free block of 'want' pages exists, or once 'budget'
+ * pages were moved; pass zero for either to compact the whole region.
+ */
+static void pmem_compact(int id, unsigned long want, unsigned long budget)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	struct pmem_block *free, *block;
+	unsigned long moved = 0;
+	struct rb_node *n;
+
+	if (want && pmem[id].free_pages < want)
+		return;
+	if (down_trylock(&pmem[id].data_list_sem))
+		return;
+	pmem[id].compactions++;
+	for (n = rb_first(&pmem[id].blocks); n; n = rb_next(n)) {
+		unsigned long from;
+
+		free = rb_entry(n, struct pmem_block, addr_node);
+		if (!free->free)
+			continue;
+		if (want && free->pages >= want)
+			break;
+		block = pmem_block_next(free);
+		if (block && PMEM_BLOCK_MOVABLE(block) && budget &&
+		    moved + block->pages > budget)
+			break;
+		/* neighbouring free blocks are always merged */
+		if (!block || !PMEM_BLOCK_MOVABLE(block) ||
+		    pmem_lock_block_users(id, block->index)) {
+			n = block ? &block->addr_node : NULL;
+			if (!n)
+				break;
+			continue;
+		}
+
+		from = block->index;
+		memmove((void __force *)PMEM_START_VADDR(id, free->index),
+			(void __force *)PMEM_START_VADDR(id, from),
+			block->pages * PMEM_MIN_ALLOC);
+		if (pmem[id].cached)
+			dmac_flush_range((void __force *)
+					 PMEM_START_VADDR(id, free->index),
+					 (void __force *)
+					 PMEM_START_VADDR(id, free->index +
+							  block->pages));
+
+		rb_erase(&free->size_node, &pmem[id].free_blocks);
+		rb_erase(&free->addr_node, &pmem[id].blocks);
+		rb_erase(&block->addr_node, &pmem[id].blocks);
+		block->index = free->index;
+		free->index = block->index + block->pages;
+		pmem_block_insert(id, block);
+		pmem_block_insert(id, free);
+		pmem_move_block_users(id, from, block->index);
+		pmem[id].compacted_pages += block->pages;
+		moved += block->pages;
+
+		pmem_free_block_merge(id, free);
+		/* continue from the (possibly merged) free block */
+		n = &block->addr_node;
+	}
+	up(&pmem[id].data_list_sem);
 }
 
 static int pmem_allocate(int id, unsigned long len)
 {
 	/* caller should hold the write lock on pmem_sem! */
-	/* return the corresponding pdata[] entry */
-	int curr = 0;
-	int end = pmem[id].num_entries;
-	int best_fit = -1;
-	unsigned long order = pmem_order(len);
+	/* return the index of the first page of the allocation */
+	struct pmem_block *best_fit, *rest;
+	unsigned long pages = (len + PMEM_MIN_ALLOC - 1) / PMEM_MIN_ALLOC;
 
 	if (pmem[id].no_allocator) {
 		DLOG("no allocator");
@@ -393,60 +618,80 @@ static int pmem_allocate(int id, unsigned long len)
 		return len;
 	}
 
-	if (order > PMEM_MAX_ORDER)
+	if (!pages || pages > pmem[id].num_entries)
 		return -1;
-	DLOG("order %lx\n", order);
+	DLOG("pages %lu\n", pages);
 
-	/* look through the bitmap:
-	 * 	if you find a free slot of the correct order use it
-	 * 	otherwise, use the best fit (smallest with size > order) slot
-	 */
-	while (curr < end) {
-		if (PMEM_IS_FREE(id, curr)) {
-			if (PMEM_ORDER(id, curr) == (unsigned char)order) {
-				/* set the not free bit and clear others */
-				best_fit = curr;
-				break;
-			}
-			if (PMEM_ORDER(id, curr) > (unsigned char)order &&
-			    (best_fit < 0 ||
-			     PMEM_ORDER(id, curr) < PMEM_ORDER(id, best_fit)))
-				best_fit = curr;
-		}
-		curr = PMEM_NEXT_INDEX(id, curr);
+	best_fit = pmem_best_fit(id, pages);
+	if (!best_fit && pmem[id].free_pages >= pages) {
+		pmem_compact(id, pages, PMEM_COMPACT_MAX_PAGES);
+		best_fit = pmem_best_fit(id, pages);
 	}
-
-	/* if best_fit < 0, there are no suitable slots,
-	 * return an error
-	 */
-	if (best_fit < 0) {
+	if (!best_fit) {
+		pmem[id].alloc_failures++;
 		printk("pmem: no space left to allocate!\n");
 		return -1;
 	}
 
-	/* now partition the best fit:
-	 * 	split the slot into 2 buddies of order - 1
-	 * 	repeat until the slot is of the correct order
-	 */
-	while (PMEM_ORDER(id, best_fit) > (unsigned char)order) {
-		int buddy;
-		PMEM_ORDER(id, best_fit) -= 1;
-		buddy = PMEM_BUDDY_INDEX(id, best_fit);
-		PMEM_ORDER(id, buddy) = PMEM_ORDER(id, best_fit);
+	/* split off the tail of the best fit, if we can't the caller just
+	 * gets a bit more than it asked for */
+	rb_erase(&best_fit->size_node, &pmem[id].free_blocks);
+	if (best_fit->pages > pages) {
+		rest = kzalloc(sizeof(struct pmem_block), GFP_KERNEL);
+		if (rest) {
+			rest->index = best_fit->index + pages;
+			rest->pages = best_fit->pages - pages;
+			rest->free = 1;
+			best_fit->pages = pages;
+			pmem_block_insert(id, rest);
+			pmem_free_block_insert(id, rest);
+		}
 	}
-	pmem[id].bitmap[best_fit].allocated = 1;
-	return best_fit;
+	best_fit->free = 0;
+	best_fit->pin_count = 0;
+	best_fit->map_count = 0;
+	pmem[id].free_pages -= best_fit->pages;
+	return best_fit->index;
+}
+
+/*
+ * adjust the pin or map count of a file's allocation, or note that its
+ * physical address was exposed (pin == 0 and map == 0)
+ */
+static void pmem_block_get(int id, struct pmem_data *data, int pin, int map)
+{
+	struct pmem_block *block;
+
+	if (pmem[id].no_allocator || data->index < 0)
+		return;
+	down_write(&pmem[id].bitmap_sem);
+	block = pmem_block_find(id, data->index);
+	if (block && !block->free) {
+		block->pin_count += pin;
+		block->map_count += map;
+		if (!pin && !map)
+			block->phys_exposed = 1;
+	}
+	up_write(&pmem[id].bitmap_sem);
+}
+
+static int pmem_is_cached(struct file *file)
+{
+	struct pmem_data *data = (struct pmem_data *)file->private_data;
+
+	if ((file->f_flags & O_SYNC) || (data->flags & PMEM_FLAGS_UNCACHED))
+		return 0;
+	return pmem[get_id(file)].cached;
 }
 
 static pgprot_t phys_mem_access_prot(struct file *file, pgprot_t vma_prot)
 {
-	int id = get_id(file);
 #ifdef pgprot_noncached
-	if (pmem[id].cached == 0 || file->f_flags & O_SYNC)
+	if (!pmem_is_cached(file))
 		return pgprot_noncached(vma_prot);
 #endif
 #ifdef pgprot_ext_buffered
-	else if (pmem[id].buffered)
+	else if (pmem[get_id(file)].buffered)
 		return pgprot_ext_buffered(vma_prot);
 #endif
 	return vma_prot;
@@ -468,10 +713,18 @@ static void *pmem_start_vaddr(int id, struct pmem_data *data)
 
 static unsigned long pmem_len(int id, struct pmem_data *data)
 {
+	struct pmem_block *block;
+	unsigned long len = 0;
+
 	if (pmem[id].no_allocator)
 		return data->index;
-	else
-		return PMEM_LEN(id, data->index);
+
+	down_read(&pmem[id].bitmap_sem);
+	block = pmem_block_find(id, data->index);
+	if (block)
+		len = block->pages * PMEM_MIN_ALLOC;
+	up_read(&pmem[id].bitmap_sem);
+	return len;
 }
 
 static int pmem_map_garbage(int id, struct vm_area_struct *vma,
@@ -543,6 +796,7 @@ static void pmem_vma_open(struct vm_area_struct *vma)
 	down_write(&data->sem);
 	/* remap the garbage pages, forkers don't get access to the data */
 	pmem_unmap_pfn_range(id, vma, data, 0, vma->vm_start - vma->vm_end);
+	pmem_block_get(id, data, 0, 1);
 	up_write(&data->sem);
 }
 
@@ -560,6 +814,7 @@ static void pmem_vma_close(struct vm_area_struct *vma)
 		return;
 	}
 	down_write(&data->sem);
+	pmem_block_get(get_id(file), data, 0, -1);
 	if (data->vma == vma) {
 		data->vma = NULL;
 		if ((data->flags & PMEM_FLAGS_CONNECTED) &&
@@ -669,6 +924,7 @@ static int pmem_mmap(struct file *file, struct vm_area_struct *vma)
 		data->flags |= PMEM_FLAGS_MASTERMAP;
 		data->pid = current->pid;
 	}
+	pmem_block_get(id, data, 0, 1);
 	vma->vm_ops = &vm_ops;
 error:
 	up_write(&data->sem);
@@ -722,6 +978,8 @@ int get_pmem_addr(struct file *file, unsigned long *start,
 	id = get_id(file);
 
 	down_read(&data->sem);
+	/* kernel users hold on to the physical address, don't move it */
+	pmem_block_get(id, data, 1, 0);
 	*start = pmem_start_addr(id, data);
 	*len = pmem_len(id, data);
 	*vstart = (unsigned long)pmem_start_vaddr(id, data);
@@ -766,6 +1024,9 @@ void put_pmem_file(struct file *file)
 		return;
 	id = get_id(file);
 	data = (struct pmem_data *)file->private_data;
+	down_read(&data->sem);
+	pmem_block_get(id, data, -1, 0);
+	up_read(&data->sem);
 #if PMEM_DEBUG
 	down_write(&data->sem);
 	if (data->ref == 0) {
@@ -794,14 +1055,23 @@ void flush_pmem_file(struct file *file, unsigned long offset, unsigned long len)
 
 	id = get_id(file);
 	data = (struct pmem_data *)file->private_data;
-	if (!pmem[id].cached || file->f_flags & O_SYNC)
+	if (!pmem_is_cached(file))
 		return;
 
 	down_read(&data->sem);
 	vaddr = pmem_start_vaddr(id, data);
-	/* if this isn't a submmapped file, flush the whole thing */
+	/* if this isn't a submmapped file, flush just the requested range, or
+	 * the whole thing if the range is empty or out of bounds */
 	if (unlikely(!(data->flags & PMEM_FLAGS_CONNECTED))) {
-		dmac_flush_range(vaddr, vaddr + pmem_len(id, data));
+		unsigned long alloc_len = pmem_len(id, data);
+
+		if (!len || offset >= alloc_len || len > alloc_len - offset) {
+			offset = 0;
+			len = alloc_len;
+		}
+		dmac_flush_range(vaddr + offset, vaddr + offset + len);
+		outer_flush_range(pmem_start_addr(id, data) + offset,
+				  pmem_start_addr(id, data) + offset + len);
 		goto end;
 	}
 	/* otherwise, flush the region of the file we are drawing */
@@ -813,6 +1083,11 @@ void flush_pmem_file(struct file *file, unsigned long offset, unsigned long len)
 			flush_start = vaddr + region_node->region.offset;
 			flush_end = flush_start + region_node->region.len;
 			dmac_flush_range(flush_start, flush_end);
+			outer_flush_range(pmem_start_addr(id, data) +
+					  region_node->region.offset,
+					  pmem_start_addr(id, data) +
+					  region_node->region.offset +
+					  region_node->region.len);
 			break;
 		}
 	}
@@ -820,6 +1095,75 @@ end:
 	up_read(&data->sem);
 }
 
+/*
+ * pmem_cache_maint - clean and/or invalidate part of the caller's cached
+ * mapping of a file. The caller's mapping only locates the range in the
+ * allocation: the inner caches are maintained through the region's own
+ * kernel mapping, which has the same attributes, and the outer cache by
+ * physical address, as flush_pmem_file() does. Parts of the user mapping
+ * may have been unmapped, so it is never touched.
+ */
+static int pmem_cache_maint(struct file *file, unsigned int cmd,
+			    struct pmem_addr *addr)
+{
+	struct pmem_data *data = (struct pmem_data *)file->private_data;
+	struct mm_struct *mm = current->mm;
+	struct vm_area_struct *vma;
+	unsigned long alloc_len, start, offset, paddr;
+	int id = get_id(file);
+	void *vaddr;
+	int ret = 0;
+
+	if (!has_allocation(file))
+		return -EINVAL;
+	/* nothing to do for uncached mappings */
+	if (!pmem_is_cached(file))
+		return 0;
+
+	down_read(&data->sem);
+	alloc_len = pmem_len(id, data);
+	start = addr->vaddr + addr->offset;
+
+	down_read(&mm->mmap_sem);
+	vma = find_vma(mm, start);
+	if (!vma || vma->vm_file != file || start < vma->vm_start) {
+		ret = -EINVAL;
+		goto err_mm;
+	}
+	/* pmem_mmap() only maps a file from its start, so the offset into
+	 * the allocation is the offset into the vma */
+	offset = start - vma->vm_start;
+	if (!addr->length)
+		addr->length = vma->vm_end - start;
+	if (offset >= alloc_len || addr->length > alloc_len - offset ||
+	    addr->length > vma->vm_end - start) {
+		ret = -EINVAL;
+		goto err_mm;
+	}
+	vaddr = pmem_start_vaddr(id, data) + offset;
+	paddr = pmem_start_addr(id, data) + offset;
+
+	switch (cmd) {
+	case PMEM_CLEAN_CACHES:
+		dmac_map_area(vaddr, addr->length, DMA_TO_DEVICE);
+		outer_clean_range(paddr, paddr + addr->length);
+		break;
+	case PMEM_INV_CACHES:
+		outer_inv_range(paddr, paddr + addr->length);
+		dmac_unmap_area(vaddr, addr->length, DMA_FROM_DEVICE);
+		break;
+	case PMEM_CLEAN_INV_CACHES:
+		dmac_flush_range(vaddr, vaddr + addr->length);
+		outer_flush_range(paddr, paddr + addr->length);
+		break;
+	}
+
+err_mm:
+	up_read(&mm->mmap_sem);
+	up_read(&data->sem);
+	return ret;
+}
+
 static int pmem_connect(unsigned long connect, struct file *file)
 {
 	struct pmem_data *data = (struct pmem_data *)file->private_data;
@@ -1060,6 +1404,7 @@ static void pmem_get_size(struct pmem_region *region, struct file *file)
 		region->len = 0;
 		return;
 	} else {
+		pmem_block_get(id, data, 0, 0);
 		region->offset = pmem_start_addr(id, data);
 		region->len = pmem_len(id, data);
 	}
@@ -1082,6 +1427,7 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 				region.len = 0;
 			} else {
 				data = (struct pmem_data *)file->private_data;
+				pmem_block_get(id, data, 0, 0);
 				region.offset = pmem_start_addr(id, data);
 				region.len = pmem_len(id, data);
 			}
@@ -1139,7 +1485,9 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			if (has_allocation(file))
 				return -EINVAL;
 			data = (struct pmem_data *)file->private_data;
+			down_write(&pmem[id].bitmap_sem);
 			data->index = pmem_allocate(id, arg);
+			up_write(&pmem[id].bitmap_sem);
 			break;
 		}
 	case PMEM_CONNECT:
@@ -1156,6 +1504,36 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			flush_pmem_file(file, region.offset, region.len);
 			break;
 		}
+	case PMEM_CLEAN_INV_CACHES:
+	case PMEM_CLEAN_CACHES:
+	case PMEM_INV_CACHES:
+		{
+			struct pmem_addr addr;
+			if (copy_from_user(&addr, (void __user *)arg,
+					   sizeof(struct pmem_addr)))
+				return -EFAULT;
+			return pmem_cache_maint(file, cmd, &addr);
+		}
+	case PMEM_SET_CACHED:
+		{
+			int ret = 0;
+			data = (struct pmem_data *)file->private_data;
+			down_write(&data->sem);
+			/* only cached regions have cached mappings to give,
+			 * and the policy is fixed once the file is mapped */
+			if (!pmem[id].cached || (file->f_flags & O_SYNC))
+				ret = -EINVAL;
+			else if ((data->flags & (PMEM_FLAGS_MASTERMAP |
+						 PMEM_FLAGS_SUBMAP |
+						 PMEM_FLAGS_UNSUBMAP)))
+				ret = -EBUSY;
+			else if (arg)
+				data->flags &= ~PMEM_FLAGS_UNCACHED;
+			else
+				data->flags |= PMEM_FLAGS_UNCACHED;
+			up_write(&data->sem);
+			return ret;
+		}
 	default:
 		if (pmem[id].ioctl)
 			return pmem[id].ioctl(file, cmd, arg);
@@ -1214,6 +1592,85 @@ static struct file_operations debug_fops = {
 	.read = debug_read,
 	.open = debug_open,
 };
+
+static int debug_frag_show(struct seq_file *m, void *unused)
+{
+	int id = (int)m->private;
+	unsigned long hist[BITS_PER_LONG] = { 0 };
+	unsigned long nr_free = 0, nr_used = 0, nr_movable = 0;
+	unsigned long largest = 0;
+	struct pmem_block *block;
+	struct rb_node *n;
+	int i;
+
+	down_read(&pmem[id].bitmap_sem);
+	for (n = rb_first(&pmem[id].blocks); n; n = rb_next(n)) {
+		block = rb_entry(n, struct pmem_block, addr_node);
+		if (!block->free) {
+			nr_used++;
+			if (PMEM_BLOCK_MOVABLE(block))
+				nr_movable++;
+			continue;
+		}
+		nr_free++;
+		hist[fls_long(block->pages) - 1]++;
+		largest = max(largest, block->pages);
+	}
+
+	seq_printf(m, "pages: %lu total, %lu free, largest free %lu\n",
+		   pmem[id].num_entries, pmem[id].free_pages, largest);
+	seq_printf(m, "blocks: %lu allocated (%lu movable), %lu free\n",
+		   nr_used, nr_movable, nr_free);
+	seq_printf(m, "fragmentation: %lu%%\n", pmem[id].free_pages ?
+		   100 - largest * 100 / pmem[id].free_pages : 0);
+	seq_printf(m, "alloc failures: %lu\n", pmem[id].alloc_failures);
+	seq_printf(m, "compactions: %lu, %lu pages moved\n",
+		   pmem[id].compactions, pmem[id].compacted_pages);
+	seq_printf(m, "free blocks by size (pages):\n");
+	for (i = 0; i < BITS_PER_LONG; i++)
+		if (hist[i])
+			seq_printf(m, "  %lu-%lu: %lu\n", 1UL << i,
+				   (2UL << i) - 1, hist[i]);
+	seq_printf(m, "map (index pages state):\n");
+	for (n = rb_first(&pmem[id].blocks); n; n = rb_next(n)) {
+		block = rb_entry(n, struct pmem_block, addr_node);
+		seq_printf(m, "  %lu %lu %s", block->index, block->pages,
+			   block->free ? "free" : "used");
+		if (!block->free)
+			seq_printf(m, " pin %d map %d%s", block->pin_count,
+				   block->map_count,
+				   block->phys_exposed ? " phys" : "");
+		seq_printf(m, "\n");
+	}
+	up_read(&pmem[id].bitmap_sem);
+	return 0;
+}
+
+static int debug_frag_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, debug_frag_show, inode->i_private);
+}
+
+/* any write compacts the region */
+static ssize_t debug_frag_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	int id = (int)m->private;
+
+	down_write(&pmem[id].bitmap_sem);
+	pmem_compact(id, 0, 0);
+	up_write(&pmem[id].bitmap_sem);
+	return count;
+}
+
+static struct file_operations debug_frag_fops = {
+	.open = debug_frag_open,
+	.read = seq_read,
+	.write = debug_frag_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 #endif
 
 #if 0
@@ -1228,7 +1685,7 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	       int (*release)(struct inode *, struct file *))
 {
 	int err = 0;
-	int i, index = 0;
+	struct pmem_block *block;
 	int id = id_count;
 	id_count++;
 
@@ -1254,20 +1711,17 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	}
 	pmem[id].num_entries = pmem[id].size / PMEM_MIN_ALLOC;
 
-	pmem[id].bitmap = kmalloc(pmem[id].num_entries *
-				  sizeof(struct pmem_bits), GFP_KERNEL);
-	if (!pmem[id].bitmap)
+	/* the whole region starts out as a single free block */
+	pmem[id].blocks = RB_ROOT;
+	pmem[id].free_blocks = RB_ROOT;
+	block = kzalloc(sizeof(struct pmem_block), GFP_KERNEL);
+	if (!block)
 		goto err_no_mem_for_metadata;
-
-	memset(pmem[id].bitmap, 0, sizeof(struct pmem_bits) *
-					  pmem[id].num_entries);
-
-	for (i = sizeof(pmem[id].num_entries) * 8 - 1; i >= 0; i--) {
-		if ((pmem[id].num_entries) &  1<<i) {
-			PMEM_ORDER(id, index) = i;
-			index = PMEM_NEXT_INDEX(id, index);
-		}
-	}
+	block->pages = pmem[id].num_entries;
+	block->free = 1;
+	pmem_block_insert(id, block);
+	pmem_free_block_insert(id, block);
+	pmem[id].free_pages = block->pages;
 
 	if (pmem[id].cached)
 		pmem[id].vbase = ioremap_cached(pmem[id].base,
@@ -1290,10 +1744,17 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 #if PMEM_DEBUG
 	debugfs_create_file(pdata->name, S_IFREG | S_IRUGO, NULL, (void *)id,
 			    &debug_fops);
+	if (!pmem[id].no_allocator) {
+		char name[64];
+
+		snprintf(name, sizeof(name), "%s_frag", pdata->name);
+		debugfs_create_file(name, S_IFREG | S_IRUGO | S_IWUSR, NULL,
+				    (void *)id, &debug_frag_fops);
+	}
 #endif
 	return 0;
 error_cant_remap:
-	kfree(pmem[id].bitmap);
+	kfree(block);
 err_no_mem_for_metadata:
 	misc_deregister(&pmem[id].dev);
 err_cant_register_device:
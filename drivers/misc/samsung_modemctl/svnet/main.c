@@ -283,6 +283,7 @@ static ssize_t store_debug(struct device *d,
 
 	switch (buf[0]) {
 	case 'R':
+	case 'L':
 		sipc_debug(svnet_dev->si, buf);
 		break;
 	default:
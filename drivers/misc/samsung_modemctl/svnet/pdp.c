@@ -32,16 +32,134 @@ extern int vnet_start_xmit(struct sk_buff *skb, struct net_device *ndev);
 
 static int vnet_open(struct net_device *ndev)
 {
+	struct pdp_priv *priv = netdev_priv(ndev);
+
+	/* pdp_rx() may have queued packets after vnet_stop() purged */
+	skb_queue_purge(&priv->rxq);
+	skb_queue_purge(&priv->napi_q);
+	napi_enable(&priv->napi);
 	netif_start_queue(ndev);
 	return 0;
 }
 
 static int vnet_stop(struct net_device *ndev)
 {
+	struct pdp_priv *priv = netdev_priv(ndev);
+
 	netif_stop_queue(ndev);
+	napi_disable(&priv->napi);
+	skb_queue_purge(&priv->rxq);
+	skb_queue_purge(&priv->napi_q);
 	return 0;
 }
 
+/*
+ * Received packets are de-framed by the read work while it holds the
+ * onedram semaphore and queued on rxq. The stack is fed from here in
+ * softirq context, after the semaphore has been given back.
+ */
+static int vnet_poll(struct napi_struct *napi, int budget)
+{
+	struct pdp_priv *priv = container_of(napi, struct pdp_priv, napi);
+	struct sk_buff *skb;
+	int work = 0;
+
+	while (work < budget) {
+		skb = __skb_dequeue(&priv->napi_q);
+		if (!skb) {
+			/* take everything queued so far in one go */
+			spin_lock_irq(&priv->rxq.lock);
+			skb_queue_splice_tail_init(&priv->rxq, &priv->napi_q);
+			spin_unlock_irq(&priv->rxq.lock);
+
+			skb = __skb_dequeue(&priv->napi_q);
+			if (!skb)
+				break;
+		}
+
+		napi_gro_receive(napi, skb);
+		work++;
+	}
+
+	if (work < budget) {
+		napi_complete(napi);
+		/* a packet may have been queued before napi_complete() */
+		if (!skb_queue_empty(&priv->rxq))
+			napi_schedule(napi);
+	}
+
+	return work;
+}
+
+struct sk_buff *pdp_alloc_rx_skb(struct net_device *ndev, unsigned int len)
+{
+	struct pdp_priv *priv = netdev_priv(ndev);
+	struct sk_buff *skb = NULL;
+
+	if (len <= PDP_RX_BUF_SIZE)
+		skb = skb_dequeue(&priv->recycle);
+
+	if (skb)
+		skb->dev = ndev;
+	else
+		skb = netdev_alloc_skb(ndev, len);
+
+	return skb;
+}
+
+/* Called for tx buffers that have been copied out to onedram */
+void pdp_recycle_skb(struct net_device *ndev, struct sk_buff *skb)
+{
+	struct pdp_priv *priv = netdev_priv(ndev);
+
+	if (skb_queue_len(&priv->recycle) < PDP_RECYCLE_MAX &&
+			skb_recycle_check(skb, PDP_RX_BUF_SIZE)) {
+		skb_queue_tail(&priv->recycle, skb);
+		return;
+	}
+
+	dev_kfree_skb_any(skb);
+}
+
+void pdp_rx(struct net_device *ndev, struct sk_buff *skb)
+{
+	struct pdp_priv *priv = netdev_priv(ndev);
+
+	if (!netif_running(ndev) ||
+			skb_queue_len(&priv->rxq) >= netdev_max_backlog) {
+		ndev->stats.rx_dropped++;
+		kfree_skb(skb);
+		return;
+	}
+
+	/*
+	 * GRO only merges packets whose 14 bytes at the mac header match,
+	 * so put the same all-zero pseudo link header in front of every
+	 * packet. Both rx buffer sources leave NET_SKB_PAD of headroom.
+	 */
+	memset(skb_push(skb, ETH_HLEN), 0, ETH_HLEN);
+	skb_reset_mac_header(skb);
+	__skb_pull(skb, ETH_HLEN);
+
+	skb_queue_tail(&priv->rxq, skb);
+
+	if (skb_queue_len(&priv->rxq) >= PDP_RX_KICK)
+		pdp_rx_schedule(ndev);
+}
+
+/* Process context: the poll loop runs on local_bh_enable() */
+void pdp_rx_schedule(struct net_device *ndev)
+{
+	struct pdp_priv *priv = netdev_priv(ndev);
+
+	if (skb_queue_empty(&priv->rxq))
+		return;
+
+	local_bh_disable();
+	napi_schedule(&priv->napi);
+	local_bh_enable();
+}
+
 static void vnet_tx_timeout(struct net_device *ndev)
 {
 	ndev->trans_start = jiffies;
@@ -68,6 +186,7 @@ static void vnet_setup(struct net_device *ndev)
 	ndev->tx_queue_len = 1000;
 	ndev->mtu = ETH_DATA_LEN;
 	ndev->watchdog_timeo = 5 * HZ;
+	ndev->features |= NETIF_F_GRO;
 }
 
 struct net_device* create_pdp(int channel, struct net_device *parent)
@@ -88,6 +207,10 @@ struct net_device* create_pdp(int channel, struct net_device *parent)
 	priv = netdev_priv(ndev);
 	priv->channel = channel;
 	priv->parent = parent;
+	skb_queue_head_init(&priv->rxq);
+	skb_queue_head_init(&priv->napi_q);
+	skb_queue_head_init(&priv->recycle);
+	netif_napi_add(ndev, &priv->napi, vnet_poll, PDP_NAPI_WEIGHT);
 
 	r = register_netdev(ndev);
 	if (r) {
@@ -100,10 +223,18 @@ struct net_device* create_pdp(int channel, struct net_device *parent)
 
 void destroy_pdp(struct net_device **ndev)
 {
+	struct pdp_priv *priv;
+
 	if (!ndev || !*ndev)
 		return;
 
+	priv = netdev_priv(*ndev);
+
 	unregister_netdev(*ndev);
+	/* pdp_rx() may have raced with vnet_stop() */
+	skb_queue_purge(&priv->rxq);
+	skb_queue_purge(&priv->napi_q);
+	skb_queue_purge(&priv->recycle);
 	free_netdev(*ndev);
 	*ndev = NULL;
 }
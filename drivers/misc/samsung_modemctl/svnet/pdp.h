@@ -22,13 +22,32 @@
 #define __PACKET_DATA_PROTOCOL_H__
 
 #include <linux/netdevice.h>
+#include <linux/skbuff.h>
+
+#define PDP_NAPI_WEIGHT 64
+/* kick the poll loop early when this many packets are waiting */
+#define PDP_RX_KICK (PDP_NAPI_WEIGHT * 4)
+/* tx buffers kept for reuse as rx buffers */
+#define PDP_RECYCLE_MAX 64
+#define PDP_RX_BUF_SIZE ETH_DATA_LEN
 
 struct pdp_priv {
 	int channel;
 	struct net_device *parent;
+
+	struct napi_struct napi;
+	struct sk_buff_head rxq; /* de-framed, waiting for the poll loop */
+	struct sk_buff_head napi_q; /* owned by the poll loop */
+	struct sk_buff_head recycle;
 };
 
 extern struct net_device* create_pdp(int channel, struct net_device *parent);
 extern void destroy_pdp(struct net_device **);
 
+extern struct sk_buff *pdp_alloc_rx_skb(struct net_device *ndev,
+		unsigned int len);
+extern void pdp_recycle_skb(struct net_device *ndev, struct sk_buff *skb);
+extern void pdp_rx(struct net_device *ndev, struct sk_buff *skb);
+extern void pdp_rx_schedule(struct net_device *ndev);
+
 #endif /* __PACKET_DATA_PROTOCOL_H__ */
@@ -31,7 +31,14 @@
 
 #include <linux/circ_buf.h>
 #include <linux/workqueue.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <linux/tcp.h>
 #include <asm/errno.h>
+#include <net/checksum.h>
+#include <net/ip.h>
 
 #include <net/sock.h>
 #include <linux/if_ether.h>
@@ -950,7 +957,10 @@ int sipc_write(struct sipc *si, struct sk_buff_head *sbh)
 			break;
 
 		_update_stat(ndev, len);
-		dev_kfree_skb_any(skb);
+		if (skb->protocol != __constant_htons(ETH_P_PHONET))
+			pdp_recycle_skb(ndev, skb);
+		else
+			dev_kfree_skb_any(skb);
 
 		skb = skb_dequeue(sbh);
 	}
@@ -1008,6 +1018,33 @@ extern int __read(struct ringbuf *rb, unsigned char *buf, unsigned int size)
 	return len;
 }
 
+/* __read() that also returns the checksum of the data copied */
+static int __read_csum(struct ringbuf *rb, unsigned char *buf,
+		unsigned int size, __wsum *csum)
+{
+	int c;
+	int len = 0;
+
+	*csum = 0;
+
+	while(1) {
+		c = CIRC_CNT_TO_END(rb->rb_in_head, rb->rb_in_tail, rb->rb_size);
+		if(size < c)
+			c = size;
+		if(c <= 0)
+			break;
+		*csum = csum_block_add(*csum,
+				csum_partial_copy_nocheck(rb->in_base + rb->rb_in_tail,
+					buf, c, 0), len);
+		rb->rb_in_tail = (rb->rb_in_tail + c) & (rb->rb_size - 1);
+		buf += c;
+		size -= c;
+		len += c;
+	}
+
+	return len;
+}
+
 static inline void _get_raw_hdr(struct raw_hdr *h, int *res,
 		unsigned int *len, int *control)
 {
@@ -1200,7 +1237,6 @@ static int _read_pdp(struct ringbuf *rb, int len,
 {
 	int r;
 	struct sk_buff *skb;
-	char *p;
 	int read_len = len + sizeof(hdlc_end);
 	struct net_device *ndev;
 
@@ -1216,14 +1252,18 @@ static int _read_pdp(struct ringbuf *rb, int len,
 		return r;
 	}
 
-	skb = netdev_alloc_skb(ndev, read_len);
+	skb = pdp_alloc_rx_skb(ndev, len);
 	if (unlikely(!skb)) {
 		mutex_unlock(&pdp_mutex);
 		return -ENOMEM;
 	}
 
-	p = skb_put(skb, len);
-	r = __read(rb, p, read_len);
+	/*
+	 * Checksum while copying, so the stack does not have to read the
+	 * packet again to verify it and GRO can merge TCP segments.
+	 */
+	r = __read_csum(rb, skb_put(skb, len), len, &skb->csum);
+	r += __read(rb, NULL, sizeof(hdlc_end));
 	if (r != read_len) {
 		mutex_unlock(&pdp_mutex);
 		kfree_skb(skb);
@@ -1232,21 +1272,29 @@ static int _read_pdp(struct ringbuf *rb, int len,
 	ndev->stats.rx_packets++;
 	ndev->stats.rx_bytes += skb->len;
 
-	mutex_unlock(&pdp_mutex);
+	skb->protocol = __constant_htons(ETH_P_IP);
+	skb->ip_summed = CHECKSUM_COMPLETE;
 
-	read_len = r;
+	_dbg("%s: pdp packet %p len %d\n", __func__, skb, skb->len);
 
-	skb->protocol = __constant_htons(ETH_P_IP);
+	/* delivered by the poll loop once the semaphore is released */
+	pdp_rx(ndev, skb);
 
-	skb_reset_mac_header(skb);
+	mutex_unlock(&pdp_mutex);
 
-	_dbg("%s: pdp packet %p len %d\n", __func__, skb, skb->len);
+	return r;
+}
 
-	r = netif_rx_ni(skb);
-	if (r != NET_RX_SUCCESS)
-		dev_err(&ndev->dev, "pdp rx error: %d\n", r);
+static void _schedule_pdp_rx(void)
+{
+	int i;
 
-	return read_len;
+	mutex_lock(&pdp_mutex);
+	for (i=0;i<sizeof(pdp_devs)/sizeof(pdp_devs[0]);i++) {
+		if (pdp_devs[i])
+			pdp_rx_schedule(pdp_devs[i]);
+	}
+	mutex_unlock(&pdp_mutex);
 }
 
 static int _read_raw(struct sipc *si, int inbuf, struct ringbuf *rb)
@@ -1621,6 +1669,8 @@ int sipc_read(struct sipc *si, u32 mailbox, int *cond)
 	if (res)
 		onedram_write_mailbox(MB_DATA(res));
 
+	_schedule_pdp_rx();
+
 	*cond =	skb_queue_len(&si->rfs_rx);
 
 	return r;
@@ -1697,6 +1747,13 @@ static inline ssize_t _debug_show_pdp(struct sipc *si, char *buf)
 	return p - buf;
 }
 
+static struct {
+	unsigned int packets;
+	unsigned int len;
+	int tcp;
+	u64 ns;
+} lb_stat;
+
 ssize_t sipc_debug_show(struct sipc *si, char *buf)
 {
 	char *p = buf;
@@ -1712,6 +1769,19 @@ ssize_t sipc_debug_show(struct sipc *si, char *buf)
 	p += sprintf(p, "R0\tcopy FMT out to in\n");
 	p += sprintf(p, "R1\tcopy RAW out to in\n");
 	p += sprintf(p, "R2\tcopy RFS out to in\n");
+	p += sprintf(p, "L<ch> <count> <len> [t]\tloopback rx on pdp<ch-1>,"
+			" t for TCP\n");
+
+	if (lb_stat.packets) {
+		u64 us = div_u64(lb_stat.ns, NSEC_PER_USEC);
+		u64 pps = div64_u64((u64)lb_stat.packets * NSEC_PER_SEC,
+				lb_stat.ns ? lb_stat.ns : 1);
+
+		p += sprintf(p, "\nLoopback: %u %s packets of %u bytes in %llu us,"
+				" %llu pps\n", lb_stat.packets,
+				lb_stat.tcp ? "TCP" : "UDP", lb_stat.len,
+				(unsigned long long)us, (unsigned long long)pps);
+	}
 
 	return p - buf;
 }
@@ -1735,6 +1805,184 @@ static void test_copy_buf(struct sipc *si, int idx)
 		si->queue(MB_DATA(mb_data[idx].mask_send), si->queue_data);
 }
 
+/*
+ * UDP packets are all the same. TCP packets are consecutive segments of
+ * one flow, which GRO merges, so they need the IP id and sequence number
+ * of packet <n>.
+ */
+static void _lb_fill_pkt(u8 *pkt, unsigned int len, unsigned int n, int tcp)
+{
+	struct iphdr *iph = (struct iphdr *)pkt;
+	unsigned int plen = len - sizeof(*iph);
+
+	memset(pkt, 0, len);
+
+	iph->version = 4;
+	iph->ihl = 5;
+	iph->tot_len = htons(len);
+	iph->ttl = 64;
+	iph->saddr = htonl(0xc0000201); /* 192.0.2.1 */
+	iph->daddr = 0; /* martian, dropped by the stack after routing */
+
+	if (tcp) {
+		struct tcphdr *th = (struct tcphdr *)(iph + 1);
+
+		iph->id = htons(n);
+		iph->frag_off = htons(IP_DF);
+		iph->protocol = IPPROTO_TCP;
+
+		th->source = htons(9);
+		th->dest = htons(9);
+		th->seq = htonl(1 + n * (plen - sizeof(*th)));
+		th->ack_seq = htonl(1);
+		th->doff = sizeof(*th) / 4;
+		th->ack = 1;
+		th->window = htons(65535);
+		th->check = csum_tcpudp_magic(iph->saddr, iph->daddr, plen,
+				IPPROTO_TCP, csum_partial(th, plen, 0));
+	} else {
+		struct udphdr *uh = (struct udphdr *)(iph + 1);
+
+		iph->protocol = IPPROTO_UDP;
+
+		uh->source = htons(9);
+		uh->dest = htons(9);
+		uh->len = htons(plen);
+	}
+
+	iph->check = ip_fast_csum((u8 *)iph, iph->ihl);
+}
+
+static int _pdp_rx_pending(void)
+{
+	int i;
+	int r = 0;
+
+	mutex_lock(&pdp_mutex);
+	for (i=0;i<sizeof(pdp_devs)/sizeof(pdp_devs[0]);i++) {
+		struct pdp_priv *priv;
+
+		if (!pdp_devs[i])
+			continue;
+
+		priv = netdev_priv(pdp_devs[i]);
+		if (!skb_queue_empty(&priv->rxq) ||
+				!skb_queue_empty(&priv->napi_q))
+			r = 1;
+	}
+	mutex_unlock(&pdp_mutex);
+
+	return r;
+}
+
+/*
+ * Loopback receive benchmark, no modem needed: frames <count> IP
+ * packets of <len> bytes for PDP channel <ch> into a fake RAW ring in
+ * RAM and times the normal path from _read_raw() until the poll loop
+ * has handed every packet to the stack. A trailing 't' sends TCP
+ * segments of a single flow instead of UDP, to see what GRO buys. The
+ * pdp device has to be up, otherwise the packets are counted as
+ * rx_dropped.
+ */
+static int test_loopback(struct sipc *si, const char *buf)
+{
+	int r = 0;
+	int ch;
+	char proto = 'u';
+	int tcp;
+	unsigned int count, len, frame, n, done;
+	struct ringbuf_cont cont;
+	struct ringbuf_info info;
+	struct ringbuf rb;
+	struct raw_hdr h;
+	u8 *pkt;
+	ktime_t t;
+	u64 ns = 0;
+
+	if (sscanf(buf, "%d %u %u %c", &ch, &count, &len, &proto) < 3)
+		return -EINVAL;
+
+	tcp = (proto == 't');
+
+	if (ch < 1 || ch > PDP_MAX || !count ||
+			len < sizeof(struct iphdr) + sizeof(struct tcphdr) ||
+			len > ETH_DATA_LEN)
+		return -EINVAL;
+
+	mutex_lock(&pdp_mutex);
+	if (!pdp_devs[ch - 1])
+		r = -ENODEV;
+	mutex_unlock(&pdp_mutex);
+	if (r)
+		return r;
+
+	pkt = kmalloc(len, GFP_KERNEL);
+	if (!pkt)
+		return -ENOMEM;
+
+	memset(&info, 0, sizeof(info));
+	info.size = RAW_SZ;
+	info.read = _read_raw;
+
+	rb.info = &info;
+	rb.cont = &cont;
+	rb.in_base = rb.out_base = vmalloc(RAW_SZ);
+	if (!rb.in_base) {
+		kfree(pkt);
+		return -ENOMEM;
+	}
+
+	_lb_fill_pkt(pkt, len, 0, tcp);
+	_set_raw_hdr(&h, PN_PDP(ch), len + sizeof(h), 0);
+	frame = sizeof(hdlc_start) + sizeof(h) + len + sizeof(hdlc_end);
+
+	done = 0;
+	while (done < count) {
+		memset(&cont, 0, sizeof(cont));
+
+		/* fill the ring as the modem would, then time draining it */
+		for (n = 0; done + n < count &&
+				CIRC_SPACE(cont.out_head, cont.out_tail,
+					RAW_SZ) >= frame; n++) {
+			if (tcp)
+				_lb_fill_pkt(pkt, len, done + n, tcp);
+			__write(&rb, (u8 *)hdlc_start, sizeof(hdlc_start));
+			__write(&rb, (u8 *)&h, sizeof(h));
+			__write(&rb, pkt, len);
+			__write(&rb, (u8 *)hdlc_end, sizeof(hdlc_end));
+		}
+		cont.in_head = cont.out_head;
+
+		t = ktime_get();
+
+		r = _read_raw(si, n * frame, &rb);
+		do {
+			_schedule_pdp_rx();
+			cond_resched();
+		} while (_pdp_rx_pending());
+
+		ns += ktime_to_ns(ktime_sub(ktime_get(), t));
+
+		if (r < 0)
+			break;
+
+		done += n;
+	}
+
+	vfree(rb.in_base);
+	kfree(pkt);
+
+	lb_stat.packets = done;
+	lb_stat.len = len;
+	lb_stat.tcp = tcp;
+	lb_stat.ns = ns;
+
+	dev_info(&si->svndev->dev, "loopback: %u packets in %llu ns\n",
+			done, (unsigned long long)ns);
+
+	return r;
+}
+
 int sipc_debug(struct sipc *si, const char *buf)
 {
 	int r;
@@ -1742,6 +1990,10 @@ int sipc_debug(struct sipc *si, const char *buf)
 	if (!si || !buf)
 		return -EINVAL;
 
+	/* works on its own ring, no need for the semaphore */
+	if (buf[0] == 'L')
+		return test_loopback(si, buf + 1);
+
 	r = _get_auth();
 	if (r)
 		return r;
@@ -37,6 +37,8 @@ enum {
 enum {
 	FLAT_BINDER_FLAG_PRIORITY_MASK = 0xff,
 	FLAT_BINDER_FLAG_ACCEPTS_FDS = 0x100,
+	/* synchronous calls from real-time callers run at their priority */
+	FLAT_BINDER_FLAG_INHERIT_RT = 0x800,
 };
 
 /*
@@ -147,6 +149,23 @@ struct binder_transaction_data {
 	} data;
 };
 
+/*
+ * One piece of the data of a BC_TRANSACTION_SG or BC_REPLY_SG. The
+ * pieces are copied one after the other straight into the target's
+ * buffer, so the receiver sees a single data block of data_size bytes.
+ */
+struct binder_buffer_vec {
+	const void	*base;
+	size_t		len;
+};
+
+struct binder_transaction_data_sg {
+	/* data.ptr.buffer is ignored, offsets refer to the gathered data */
+	struct binder_transaction_data	transaction_data;
+	const struct binder_buffer_vec	__user *data_vec;
+	size_t				data_vec_count;
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +343,16 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 64, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 65, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, with the data
+	 * gathered from data_vec instead of data.ptr.buffer.
+	 *
+	 * Numbered well above the other commands: upstream uses 17 and 18
+	 * for scatter-gather commands with a different layout.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
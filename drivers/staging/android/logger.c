@@ -24,7 +24,11 @@
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/time.h>
+#include <linux/pagemap.h>
+#include <linux/io.h>
+#include <linux/mm.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -93,23 +97,44 @@ static struct struct_marks_ver_mark marks_ver_mark = {
 };
 
 static char klog_buf[256];
+static DEFINE_SPINLOCK(klog_lock);
 
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Positions in the log (w_pos, c_pos, head and the readers' r_pos) are free
+ * running byte counts that only ever grow; logger_offset() turns them into
+ * an offset into the buffer. Because the size is a power of two they stay
+ * consistent when they wrap.
+ *
+ * Writers never sleep on the log. A writer takes 'lock' only to reserve its
+ * entry: it moves w_pos forward, pulls 'head' past the entries it is about
+ * to overwrite and stores the entry header. It then copies the payload with
+ * the lock dropped, and publishes the entry by moving c_pos forward. Entries
+ * are published in the order they were reserved, so everything before c_pos
+ * is complete.
+ *
+ * Readers only read below c_pos. A reader whose r_pos fell more than 'size'
+ * behind w_pos has been lapped: its next entry is, or may be while it is
+ * being copied, overwritten. It then starts over at 'head'. 'mutex'
+ * serializes the readers and protects the 'readers' list.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
+	struct mutex		mutex;	/* mutex protecting readers */
+	spinlock_t		lock;	/* lock protecting reservations */
+	unsigned long		w_pos;	/* end of the last reserved entry */
+	unsigned long		c_pos;	/* end of the last complete entry */
+	unsigned long		head;	/* new readers start here */
+	unsigned long		seq;	/* number of entries written */
 	size_t			size;	/* size of the log */
+	struct logger_mmap_header *mmap_header; /* mirror for mmap readers */
 };
 
 /*
@@ -121,7 +146,7 @@ struct logger_log {
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	unsigned long		r_pos;	/* current read head position */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
@@ -152,12 +177,14 @@ static inline struct logger_log *file_get_log(struct file *file)
 
 /*
  * get_entry_len - Grabs the length of the payload of the next entry starting
- * from 'off'.
+ * from 'pos'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock, or check reader_lapped() after using the
+ * result.
  */
-static __u32 get_entry_len(struct logger_log *log, size_t off)
+static __u32 get_entry_len(struct logger_log *log, unsigned long pos)
 {
+	size_t off = logger_offset(pos);
 	__u16 val;
 
 	switch (log->size - off) {
@@ -172,17 +199,46 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 	return sizeof(struct logger_entry) + val;
 }
 
+/*
+ * reader_lapped - has the writer reserved space over the reader's next
+ * entry?
+ *
+ * Call after reading from the log, with a read barrier in between, to learn
+ * whether what was read is intact.
+ */
+static inline int reader_lapped(struct logger_log *log,
+				struct logger_reader *reader)
+{
+	return ACCESS_ONCE(log->w_pos) - reader->r_pos > log->size;
+}
+
+/*
+ * fix_up_reader - moves a lapped reader forward to the oldest entry in the
+ * log.
+ *
+ * Caller needs to hold log->mutex.
+ */
+static void fix_up_reader(struct logger_log *log, struct logger_reader *reader)
+{
+	spin_lock(&log->lock);
+	if (log->w_pos - reader->r_pos > log->size)
+		reader->r_pos = log->head;
+	spin_unlock(&log->lock);
+}
+
 /*
  * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
  * user-space buffer 'buf'. Returns 'count' on success.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->mutex. The reader is not advanced, the caller has to
+ * check reader_lapped() first.
  */
 static ssize_t do_read_log_to_user(struct logger_log *log,
 				   struct logger_reader *reader,
 				   char __user *buf,
 				   size_t count)
 {
+	size_t off = logger_offset(reader->r_pos);
 	size_t len;
 
 	/*
@@ -190,8 +246,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the current read head offset up to 'count' bytes or to the end of
 	 * the log, whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -202,8 +258,6 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
@@ -232,7 +286,7 @@ start:
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
 		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
+		ret = (ACCESS_ONCE(log->c_pos) == reader->r_pos);
 		mutex_unlock(&log->mutex);
 		if (!ret)
 			break;
@@ -256,21 +310,37 @@ start:
 
 	mutex_lock(&log->mutex);
 
+retry:
+	fix_up_reader(log, reader);
+
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
+	if (unlikely(ACCESS_ONCE(log->c_pos) == reader->r_pos)) {
 		mutex_unlock(&log->mutex);
 		goto start;
 	}
+	smp_rmb();	/* c_pos before the entry */
 
 	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
+	ret = get_entry_len(log, reader->r_pos);
 	if (count < ret) {
+		smp_rmb();
+		if (reader_lapped(log, reader))
+			goto retry;
 		ret = -EINVAL;
 		goto out;
 	}
 
 	/* get exactly one entry from the log */
 	ret = do_read_log_to_user(log, reader, buf, ret);
+	if (ret < 0)
+		goto out;
+
+	/* a writer overwrote the entry while we copied it, start over */
+	smp_rmb();
+	if (reader_lapped(log, reader))
+		goto retry;
+
+	reader->r_pos += ret;
 
 out:
 	mutex_unlock(&log->mutex);
@@ -279,119 +349,81 @@ out:
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
- *
- * Caller must hold log->mutex.
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at 'pos'
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static void do_write_log(struct logger_log *log, unsigned long pos,
+			 const void *buf, size_t count)
 {
-	size_t count = 0;
-
-	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
-
-	return off;
-}
-
-/*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
- */
-static inline int clock_interval(size_t a, size_t b, size_t c)
-{
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
-	}
-
-	return 0;
-}
-
-/*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
- *
- * The caller needs to hold log->mutex.
- */
-static void fix_up_readers(struct logger_log *log, size_t len)
-{
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
+	size_t off = logger_offset(pos);
+	size_t len;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	if (count != len)
+		memcpy(log->buffer, buf + len, count - len);
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
- *
- * The caller needs to hold log->mutex.
+ * do_clear_log - zeroes 'count' bytes of 'log' at 'pos'
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_clear_log(struct logger_log *log, unsigned long pos,
+			 size_t count)
 {
+	size_t off = logger_offset(pos);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	memset(log->buffer + off, 0, len);
 
 	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log->w_off + count);
-
+		memset(log->buffer, 0, count - len);
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * do_write_log_user - writes 'count' bytes from the user-space buffer 'buf'
+ * to the log 'log' at 'pos'
  *
- * The caller needs to hold log->mutex.
+ * The caller has reserved the space and runs with page faults disabled; the
+ * user buffer should have been faulted in beforehand.
  *
  * Returns 'count' on success, negative error code on failure.
  */
 static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+				      unsigned long pos,
+				      const void __user *buf, size_t count,
+				      int *klog)
 {
+	size_t off = logger_offset(pos);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	len = min(count, log->size - off);
+	if (__copy_from_user_inatomic(log->buffer + off, buf, len))
 		return -EFAULT;
 
 	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
+		if (__copy_from_user_inatomic(log->buffer, buf + len,
+					      count - len))
 			return -EFAULT;
 
 #if 1
 /* [LINUSYS] added by khoonk for calculating boot-time  on 20070508  */
-	memset(klog_buf,0,255);
-
-	if(strncmp(log->buffer  + log->w_off,  "!@", 2) == 0) {
+	if(strncmp(log->buffer  + off,  "!@", 2) == 0) {
+		spin_lock(&klog_lock);
+		memset(klog_buf,0,255);
 		if (count < 255)
-			memcpy(klog_buf,log->buffer  + log->w_off, count);			
+			memcpy(klog_buf,log->buffer  + off, count);
 		else
-			memcpy(klog_buf,log->buffer  + log->w_off, 255);			
+			memcpy(klog_buf,log->buffer  + off, 255);
 
 		klog_buf[255]=0;
+		spin_unlock(&klog_lock);
+		*klog = 1;
 
 /* In case when shutdown process is started, disable watching reset upload */
 #ifdef CONFIG_TARGET_LOCALE_KOR
 #ifdef CONFIG_KERNEL_DEBUG_SEC
-    	if(strncmp(log->buffer + log->w_off, "!@ Notifying thread to start radio shutdown", 30) == 0) {
+    	if(strncmp(log->buffer + off, "!@ Notifying thread to start radio shutdown", 30) == 0) {
     		printk("Disable Reset Upload \n");
             kernel_sec_clear_upload_magic_number();
     	}
@@ -401,24 +433,76 @@ static ssize_t do_write_log_from_user(struct logger_log *log,
 /* [LINUSYS] added by khoonk for calculating boot-time  on 20070508  */
 #endif
 
-	log->w_off = logger_offset(log->w_off + count);
-
 	return count;
 }
 
 /*
- * logger_aio_write - our write method, implementing support for write(),
- * writev(), and aio_write(). Writes are our fast path, and we try to optimize
- * them above all else.
+ * reserve_log - reserves 'len' bytes for a new entry and stores its header
+ *
+ * Pulls the start head forward past the entries that the new one overwrites.
+ * Every header is stored before the lock is dropped, so the walk always
+ * lands on entry boundaries. Returns the position of the new entry.
  */
-ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
-			 unsigned long nr_segs, loff_t ppos)
+static unsigned long reserve_log(struct logger_log *log,
+				 struct logger_entry *header, size_t len)
+{
+	unsigned long pos;
+
+	spin_lock(&log->lock);
+	pos = log->w_pos;
+	while (pos + len - log->head > log->size)
+		log->head += get_entry_len(log, log->head);
+	log->w_pos = pos + len;
+	log->mmap_header->head = log->head;
+	log->mmap_header->w_pos = log->w_pos;
+
+	/* readers must see the new w_pos before the overwritten data */
+	smp_wmb();
+
+	do_write_log(log, pos, header, sizeof(struct logger_entry));
+	spin_unlock(&log->lock);
+
+	return pos;
+}
+
+/*
+ * commit_log - makes the entry reserved at 'pos' visible to readers
+ *
+ * Entries are published in reservation order. Writers copy with preemption
+ * disabled, so an earlier writer is never far from done.
+ */
+static void commit_log(struct logger_log *log, unsigned long pos, size_t len)
+{
+	while (ACCESS_ONCE(log->c_pos) != pos)
+		cpu_relax();
+
+	/* the entry and the previous writer's seq before our update */
+	smp_mb();
+	log->mmap_header->seq = ++log->seq;
+	log->c_pos = pos + len;
+	log->mmap_header->c_pos = log->c_pos;
+}
+
+/*
+ * do_write_entry - writes one entry with a payload of up to 'count' bytes
+ * gathered from 'iov'. Readers are not woken up, '*committed' tells the
+ * caller whether an entry was made visible to them.
+ *
+ * Returns the number of payload bytes stored. A fault part way through
+ * still commits the entry, with the rest of the payload cleared, and
+ * returns the bytes stored before the fault, or -EFAULT if there were none.
+ */
+static ssize_t do_write_entry(struct logger_log *log, const struct iovec *iov,
+			      unsigned long nr_segs, size_t count,
+			      int *committed)
 {
-	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
+	unsigned long pos;
+	unsigned long seg;
+	int klog = 0;
 	ssize_t ret = 0;
+	size_t len;
 
 	now = current_kernel_time();
 
@@ -426,60 +510,173 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	header.tid = current->pid;
 	header.sec = now.tv_sec;
 	header.nsec = now.tv_nsec;
-	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
+	header.len = min_t(size_t, count, LOGGER_ENTRY_MAX_PAYLOAD);
+	header.__pad = 0;
+
+	*committed = 0;
 
 	/* null writes succeed, return zero */
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
 	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
+	 * Fault the payload in now, the copy into the log is done with page
+	 * faults disabled. The payload is smaller than a page, so no segment
+	 * spans more than two pages.
 	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	for (seg = 0; seg < nr_segs && ret < header.len; seg++) {
+		len = min_t(size_t, iov[seg].iov_len, header.len - ret);
+		if (!access_ok(VERIFY_READ, iov[seg].iov_base, len) ||
+		    fault_in_pages_readable(iov[seg].iov_base, len))
+			return -EFAULT;
+		ret += len;
+	}
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	preempt_disable();
+	pos = reserve_log(log, &header, sizeof(struct logger_entry) +
+			  header.len);
 
-	while (nr_segs-- > 0) {
-		size_t len;
+	pagefault_disable();
+	for (seg = 0, ret = 0; seg < nr_segs; seg++) {
 		ssize_t nr;
 
 		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
+		len = min_t(size_t, iov[seg].iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, pos +
+					    sizeof(struct logger_entry) + ret,
+					    iov[seg].iov_base, len, &klog);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+			/*
+			 * The entry is already reserved and cannot be taken
+			 * back, so what is left of it is cleared instead.
+			 */
+			do_clear_log(log, pos + sizeof(struct logger_entry) +
+				     ret, header.len - ret);
+			if (!ret)
+				ret = nr;
+			break;
 		}
 
-		iov++;
 		ret += nr;
 	}
+	pagefault_enable();
 
-	mutex_unlock(&log->mutex);
-
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	commit_log(log, pos, sizeof(struct logger_entry) + header.len);
+	preempt_enable();
+	*committed = 1;
 
 #if 1
 /* [LINUSYS] added by khoonk for calculating boot-time  on 20070508  */
-    if(strncmp(klog_buf, "!@", 2) == 0)
-	{
-		printk("%s\n",klog_buf);
-	}		
+	if (klog) {
+		spin_lock(&klog_lock);
+		if(strncmp(klog_buf, "!@", 2) == 0)
+			printk("%s\n",klog_buf);
+		spin_unlock(&klog_lock);
+	}
 /* [LINUSYS] added by khoonk for calculating boot-time  on 20070508  */
-#endif	
+#endif
 
 	return ret;
 }
 
+/*
+ * logger_aio_write - our write method, implementing support for write(),
+ * writev(), and aio_write(). Writes are our fast path, and we try to optimize
+ * them above all else.
+ */
+ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
+			 unsigned long nr_segs, loff_t ppos)
+{
+	struct logger_log *log = file_get_log(iocb->ki_filp);
+	int committed;
+	ssize_t ret;
+
+	ret = do_write_entry(log, iov, nr_segs, iocb->ki_left, &committed);
+
+	/* wake up any blocked readers */
+	if (committed)
+		wake_up_interruptible(&log->wq);
+
+	return ret;
+}
+
+/*
+ * logger_write_batch - writes each payload of a struct logger_batch as an
+ * entry of its own, waking the readers only once.
+ *
+ * Returns the number of entries written, or an error if not even the first
+ * one could be written.
+ */
+static long logger_write_batch(struct logger_log *log,
+			       struct logger_batch __user *ubatch)
+{
+	struct logger_batch batch;
+	struct logger_batch_entry entry;
+	struct iovec iov;
+	ssize_t nr = 0;
+	long ret = 0;
+	int committed, wake = 0;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	if (batch.count > LOGGER_BATCH_MAX)
+		return -EINVAL;
+
+	for (; ret < batch.count; ret++) {
+		if (copy_from_user(&entry, &batch.entries[ret],
+				   sizeof(entry))) {
+			nr = -EFAULT;
+			break;
+		}
+		iov.iov_base = (void __user *)entry.payload;
+		iov.iov_len = entry.len;
+		nr = do_write_entry(log, &iov, 1, entry.len, &committed);
+		wake |= committed;
+		if (nr < 0)
+			break;
+	}
+
+	if (wake)
+		wake_up_interruptible(&log->wq);
+
+	return ret ? ret : nr;
+}
+
+#ifndef MODULE
+/*
+ * logger_mmap - maps the header page followed by the log read-only
+ *
+ * The log has to be mapped whole, from offset zero. Only built in: the
+ * static log buffers are then in the kernel's linear mapping, in a module
+ * they would be vmalloc memory that virt_to_phys() cannot translate.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE + log->size)
+		return -EINVAL;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	ret = remap_pfn_range(vma, vma->vm_start,
+			      virt_to_phys(log->mmap_header) >> PAGE_SHIFT,
+			      PAGE_SIZE, vma->vm_page_prot);
+	if (ret)
+		return ret;
+
+	return remap_pfn_range(vma, vma->vm_start + PAGE_SIZE,
+			       virt_to_phys(log->buffer) >> PAGE_SHIFT,
+			       log->size, vma->vm_page_prot);
+}
+#endif
+
 static struct logger_log *get_log_from_minor(int);
 
 /*
@@ -511,7 +708,9 @@ static int logger_open(struct inode *inode, struct file *file)
 		INIT_LIST_HEAD(&reader->list);
 
 		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
+		spin_lock(&log->lock);
+		reader->r_pos = log->head;
+		spin_unlock(&log->lock);
 		list_add_tail(&reader->list, &log->readers);
 		mutex_unlock(&log->mutex);
 
@@ -531,7 +730,11 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		mutex_lock(&log->mutex);
 		list_del(&reader->list);
+		mutex_unlock(&log->mutex);
 		kfree(reader);
 	}
 
@@ -562,7 +765,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	if (ACCESS_ONCE(log->c_pos) != reader->r_pos)
 		ret |= POLLIN | POLLRDNORM;
 	mutex_unlock(&log->mutex);
 
@@ -575,6 +778,13 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	struct logger_reader *reader;
 	long ret = -ENOTTY;
 
+	/* writers never take log->mutex */
+	if (cmd == LOGGER_WRITE_BATCH) {
+		if (!(file->f_mode & FMODE_WRITE))
+			return -EBADF;
+		return logger_write_batch(log, (void __user *)arg);
+	}
+
 	mutex_lock(&log->mutex);
 
 	switch (cmd) {
@@ -587,10 +797,8 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		fix_up_reader(log, reader);
+		ret = ACCESS_ONCE(log->c_pos) - reader->r_pos;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -598,19 +806,28 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
-			ret = get_entry_len(log, reader->r_off);
-		else
-			ret = 0;
+		do {
+			fix_up_reader(log, reader);
+			if (ACCESS_ONCE(log->c_pos) == reader->r_pos) {
+				ret = 0;
+				break;
+			}
+			smp_rmb();
+			ret = get_entry_len(log, reader->r_pos);
+			smp_rmb();
+		} while (reader_lapped(log, reader));
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
+		spin_lock(&log->lock);
+		log->head = log->c_pos;
+		log->mmap_header->head = log->head;
+		spin_unlock(&log->lock);
 		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+			reader->r_pos = log->head;
 		ret = 0;
 		break;
 	}
@@ -625,6 +842,9 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+#ifndef MODULE
+	.mmap = logger_mmap,
+#endif
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -637,7 +857,7 @@ static const struct file_operations logger_fops = {
  * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
 	.misc = { \
@@ -649,7 +869,9 @@ static struct logger_log VAR = { \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
+	.w_pos = 0, \
+	.c_pos = 0, \
 	.head = 0, \
 	.size = SIZE, \
 };
@@ -676,6 +898,13 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	log->mmap_header = (void *)get_zeroed_page(GFP_KERNEL);
+	if (!log->mmap_header)
+		return -ENOMEM;
+	log->mmap_header->version = LOGGER_MMAP_VERSION;
+	log->mmap_header->header_size = sizeof(struct logger_mmap_header);
+	log->mmap_header->size = log->size;
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
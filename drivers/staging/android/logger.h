@@ -39,11 +39,56 @@ struct logger_entry {
 #define LOGGER_ENTRY_MAX_PAYLOAD	\
 	(LOGGER_ENTRY_MAX_LEN - sizeof(struct logger_entry))
 
+/*
+ * LOGGER_WRITE_BATCH writes every payload of a struct logger_batch as an
+ * entry of its own, like one write() each, and returns how many were
+ * written.
+ */
+struct logger_batch_entry {
+	const void	*payload;	/* priority, tag and message */
+	__u32		len;		/* length of the payload */
+};
+
+struct logger_batch {
+	const struct logger_batch_entry	*entries;
+	__u32				count;
+};
+
+#define LOGGER_BATCH_MAX		1024
+
+/*
+ * When the driver is built in, a log opened for reading can be mapped
+ * read-only (mmap() fails with ENODEV otherwise): the first page holds
+ * a struct logger_mmap_header, the log itself follows from PAGE_SIZE on.
+ *
+ * Positions are free running byte counts modulo 2^32, the entry at
+ * position p starts at byte (p & (size - 1)) of the log. Entries below
+ * c_pos are complete. A reader copies entries out from its position up to
+ * c_pos (read c_pos before the entries) and then rereads w_pos: if w_pos
+ * is now more than size bytes past a copied entry, that entry was
+ * overwritten while being copied and the reader restarts at head. seq
+ * counts the entries written so far. An entry whose payload faulted part
+ * way through the write is still complete, with the rest of the payload
+ * zeroed, as read() returns it.
+ */
+struct logger_mmap_header {
+	__u32		version;	/* LOGGER_MMAP_VERSION */
+	__u32		header_size;	/* sizeof(struct logger_mmap_header) */
+	__u32		size;		/* size of the log, a power of two */
+	__u32		head;		/* position of the oldest entry */
+	__u32		w_pos;		/* end of the last reserved entry */
+	__u32		c_pos;		/* end of the last complete entry */
+	__u32		seq;		/* number of entries written */
+};
+
+#define LOGGER_MMAP_VERSION		1
+
 #define __LOGGERIO	0xAE
 
 #define LOGGER_GET_LOG_BUF_SIZE		_IO(__LOGGERIO, 1) /* size of log */
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_WRITE_BATCH		_IOW(__LOGGERIO, 5, struct logger_batch)
 
 #endif /* _LINUX_LOGGER_H */
@@ -16,6 +16,21 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * The number of processes examined per shrinker call is reported in
+ * /sys/module/lowmemorykiller/parameters/scan_calls, scan_tasks (total) and
+ * scan_max. With CONFIG_ANDROID_LMK_ADJ_RBTREE only processes at or above the
+ * kill threshold are looked at instead of every process in the system.
+ *
+ * Writing 1 to /sys/module/lowmemorykiller/parameters/pressure_mode also
+ * derives the kill threshold from reclaim efficiency (pages reclaimed per page
+ * scanned) and the number of direct reclaim stalls, sampled every
+ * pressure_window_ms. The resulting level (0 none, 1 low, 2 medium, 3
+ * critical) is reported in the pollable pressure_level file, and processes
+ * with an oom_adj of pressure_adj[level] or higher may be killed, at most one
+ * every kill_interval_ms. Levels are entered at the pressure_levels
+ * percentages and left pressure_hyst percent below them. The static minfree
+ * thresholds stay in effect as a safety net.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +50,11 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/rbtree.h>
+#include <linux/swap.h>
+#include <linux/sysfs.h>
+#include <linux/vmstat.h>
+#include <linux/workqueue.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -54,6 +74,43 @@ static int lowmem_minfree_size = 4;
 
 static struct task_struct *lowmem_deathpending;
 
+/* scan cost, exported read-only so it can be compared across configs */
+static unsigned int lowmem_scan_calls;
+static unsigned int lowmem_scan_tasks;
+static unsigned int lowmem_scan_max;
+
+enum lowmem_pressure_levels {
+	LOWMEM_PRESSURE_NONE,
+	LOWMEM_PRESSURE_LOW,
+	LOWMEM_PRESSURE_MEDIUM,
+	LOWMEM_PRESSURE_CRITICAL,
+	LOWMEM_PRESSURE_NR_LEVELS
+};
+
+static uint32_t lowmem_pressure_mode;
+static uint32_t lowmem_pressure_window_ms = 100;
+static uint32_t lowmem_kill_interval_ms = 200;
+static int lowmem_pressure_levels[LOWMEM_PRESSURE_CRITICAL] = {
+	60,
+	80,
+	95,
+};
+static int lowmem_pressure_levels_size = LOWMEM_PRESSURE_CRITICAL;
+static int lowmem_pressure_hyst = 10;
+static uint32_t lowmem_pressure_stalls = 8;
+static int lowmem_pressure_adj[LOWMEM_PRESSURE_NR_LEVELS] = {
+	OOM_ADJUST_MAX + 1,
+	OOM_ADJUST_MAX + 1,
+	12,
+	6,
+};
+static int lowmem_pressure_adj_size = LOWMEM_PRESSURE_NR_LEVELS;
+
+static int lowmem_pressure;
+static int lowmem_pressure_level;
+static unsigned long lowmem_last_kill;
+static struct sysfs_dirent *lowmem_pressure_sd;
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -78,16 +135,175 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
+#ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
+/*
+ * Thread group leaders sorted by signal->oom_adj. Insertions, removals
+ * and oom_adj updates are done with tasklist_lock held for writing, so
+ * holding it for reading is enough to walk the tree and dereference the
+ * tasks and their signal structs.
+ */
+static struct rb_root lowmem_adj_tree = RB_ROOT;
+
+void lowmem_adj_tree_add(struct task_struct *task)
+{
+	struct rb_node **link = &lowmem_adj_tree.rb_node;
+	struct rb_node *parent = NULL;
+	int oom_adj = task->signal->oom_adj;
+
+	while (*link) {
+		struct task_struct *entry;
+
+		parent = *link;
+		entry = rb_entry(parent, struct task_struct, adj_node);
+		if (oom_adj < entry->signal->oom_adj)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&task->adj_node, parent, link);
+	rb_insert_color(&task->adj_node, &lowmem_adj_tree);
+}
+
+void lowmem_adj_tree_del(struct task_struct *task)
+{
+	rb_erase(&task->adj_node, &lowmem_adj_tree);
+}
+
+void lowmem_adj_tree_replace(struct task_struct *old, struct task_struct *new)
+{
+	rb_replace_node(&old->adj_node, &new->adj_node, &lowmem_adj_tree);
+}
+
+/* highest oom_adj first, stopping below min_adj */
+#define for_each_lowmem_candidate(p, n, min_adj)			\
+	for (n = rb_last(&lowmem_adj_tree);				\
+	     n && (p = rb_entry(n, struct task_struct, adj_node),	\
+		   p->signal->oom_adj >= (min_adj));			\
+	     n = rb_prev(n))
+#endif
+
+#ifdef CONFIG_VM_EVENT_COUNTERS
+static void lowmem_pressure_sample(unsigned long *scanned,
+				   unsigned long *reclaimed,
+				   unsigned long *stalls)
+{
+	static unsigned long events[NR_VM_EVENT_ITEMS];
+	int i;
+
+	all_vm_events(events);
+	*scanned = 0;
+	*reclaimed = 0;
+	for (i = 0; i < MAX_NR_ZONES; i++) {
+		*scanned += events[PGSCAN_KSWAPD_NORMAL - ZONE_NORMAL + i];
+		*scanned += events[PGSCAN_DIRECT_NORMAL - ZONE_NORMAL + i];
+		*reclaimed += events[PGSTEAL_NORMAL - ZONE_NORMAL + i];
+	}
+	*stalls = events[ALLOCSTALL];
+}
+#else
+static void lowmem_pressure_sample(unsigned long *scanned,
+				   unsigned long *reclaimed,
+				   unsigned long *stalls)
+{
+	*scanned = 0;
+	*reclaimed = 0;
+	*stalls = 0;
+}
+#endif
+
+static void lowmem_pressure_work_func(struct work_struct *work);
+static DECLARE_DELAYED_WORK(lowmem_pressure_work, lowmem_pressure_work_func);
+static DEFINE_MUTEX(lowmem_pressure_lock);
+
+static void lowmem_pressure_work_func(struct work_struct *work)
+{
+	static unsigned long last_scanned, last_reclaimed, last_stalls;
+	static bool primed;
+	unsigned long scanned, reclaimed, stalls;
+	bool active = true;
+	int pressure = 0;
+	int level;
+	int n;
+
+	mutex_lock(&lowmem_pressure_lock);
+	lowmem_pressure_sample(&scanned, &reclaimed, &stalls);
+	if (!primed) {
+		primed = true;
+		goto out;
+	}
+	active = scanned != last_scanned;
+
+	n = lowmem_pressure_levels_size;
+	if (n > LOWMEM_PRESSURE_CRITICAL)
+		n = LOWMEM_PRESSURE_CRITICAL;
+
+	if (scanned - last_scanned >= SWAP_CLUSTER_MAX) {
+		unsigned long scan = scanned - last_scanned;
+		unsigned long steal = reclaimed - last_reclaimed;
+
+		if (steal < scan)
+			pressure = (scan - steal) * 100 / scan;
+	}
+
+	/* go up as far as the current sample says, come down one step */
+	level = lowmem_pressure_level;
+	while (level < n && pressure >= lowmem_pressure_levels[level])
+		level++;
+	if (stalls - last_stalls >= lowmem_pressure_stalls)
+		level = LOWMEM_PRESSURE_CRITICAL;
+	else if (level == lowmem_pressure_level && level > 0 &&
+		 (level > n || pressure < lowmem_pressure_levels[level - 1] -
+		  lowmem_pressure_hyst))
+		level--;
+
+	lowmem_pressure = pressure;
+	if (level != lowmem_pressure_level) {
+		lowmem_print(3, "lowmem pressure %d, stalls %lu, level %d -> %d\n",
+			     pressure, stalls - last_stalls,
+			     lowmem_pressure_level, level);
+		lowmem_pressure_level = level;
+		if (lowmem_pressure_sd)
+			sysfs_notify_dirent(lowmem_pressure_sd);
+	}
+out:
+	last_scanned = scanned;
+	last_reclaimed = reclaimed;
+	last_stalls = stalls;
+	/* keep sampling while reclaim runs and until the level has decayed */
+	if (lowmem_pressure_mode && (active || lowmem_pressure_level))
+		schedule_delayed_work(&lowmem_pressure_work,
+				msecs_to_jiffies(lowmem_pressure_window_ms));
+	else
+		primed = false;
+	mutex_unlock(&lowmem_pressure_lock);
+}
+
+static int lowmem_pressure_min_adj(void)
+{
+	int level = lowmem_pressure_level;
+
+	if (!delayed_work_pending(&lowmem_pressure_work))
+		schedule_delayed_work(&lowmem_pressure_work,
+				msecs_to_jiffies(lowmem_pressure_window_ms));
+	if (level >= lowmem_pressure_adj_size)
+		return OOM_ADJUST_MAX + 1;
+	return lowmem_pressure_adj[level];
+}
+
 static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 {
 	struct task_struct *p;
 	struct task_struct *selected = NULL;
+#ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
+	struct rb_node *n;
+#endif
 	int rem = 0;
 	int tasksize;
 	int i;
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
 	int selected_oom_adj;
+	unsigned int scanned = 0;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES);
@@ -113,6 +329,16 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 			break;
 		}
 	}
+	if (lowmem_pressure_mode && nr_to_scan > 0) {
+		int pressure_adj = lowmem_pressure_min_adj();
+
+		if (pressure_adj < min_adj)
+			min_adj = pressure_adj;
+		if (min_adj != OOM_ADJUST_MAX + 1 &&
+		    time_before(jiffies, lowmem_last_kill +
+				msecs_to_jiffies(lowmem_kill_interval_ms)))
+			min_adj = OOM_ADJUST_MAX + 1;
+	}
 	if (nr_to_scan > 0)
 		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d\n",
 			     nr_to_scan, gfp_mask, other_free, other_file,
@@ -129,11 +355,21 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	selected_oom_adj = min_adj;
 
 	read_lock(&tasklist_lock);
+#ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
+	for_each_lowmem_candidate(p, n, min_adj) {
+#else
 	for_each_process(p) {
+#endif
 		struct mm_struct *mm;
 		struct signal_struct *sig;
 		int oom_adj;
 
+		scanned++;
+#ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
+		/* sorted: nothing further down can beat the selection */
+		if (selected && p->signal->oom_adj < selected_oom_adj)
+			break;
+#endif
 		task_lock(p);
 		mm = p->mm;
 		sig = p->signal;
@@ -168,13 +404,18 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 			     selected->pid, selected->comm,
 			     selected_oom_adj, selected_tasksize);
 		lowmem_deathpending = selected;
+		lowmem_last_kill = jiffies;
 		task_free_register(&task_nb);
 		force_sig(SIGKILL, selected);
 		rem -= selected_tasksize;
 	} else
 		rem = -1;
-	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
-		     nr_to_scan, gfp_mask, rem);
+	lowmem_scan_calls++;
+	lowmem_scan_tasks += scanned;
+	if (scanned > lowmem_scan_max)
+		lowmem_scan_max = scanned;
+	lowmem_print(4, "lowmem_shrink %d, %x, scanned %u, return %d\n",
+		     nr_to_scan, gfp_mask, scanned, rem);
 	read_unlock(&tasklist_lock);
 	return rem;
 }
@@ -186,6 +427,20 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	struct kobject *kobj;
+
+	kobj = kset_find_obj(module_kset, KBUILD_MODNAME);
+	if (kobj) {
+		struct sysfs_dirent *sd;
+
+		sd = sysfs_get_dirent(kobj->sd, NULL, "parameters");
+		if (sd) {
+			lowmem_pressure_sd = sysfs_get_dirent(sd, NULL,
+							      "pressure_level");
+			sysfs_put(sd);
+		}
+		kobject_put(kobj);
+	}
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
@@ -193,6 +448,9 @@ static int __init lowmem_init(void)
 static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
+	cancel_delayed_work_sync(&lowmem_pressure_work);
+	if (lowmem_pressure_sd)
+		sysfs_put(lowmem_pressure_sd);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -201,6 +459,25 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(scan_calls, lowmem_scan_calls, uint, S_IRUGO);
+module_param_named(scan_tasks, lowmem_scan_tasks, uint, S_IRUGO);
+module_param_named(scan_max, lowmem_scan_max, uint, S_IRUGO);
+module_param_named(pressure_mode, lowmem_pressure_mode, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_window_ms, lowmem_pressure_window_ms, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(kill_interval_ms, lowmem_kill_interval_ms, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_array_named(pressure_levels, lowmem_pressure_levels, int,
+			 &lowmem_pressure_levels_size, S_IRUGO | S_IWUSR);
+module_param_named(pressure_hyst, lowmem_pressure_hyst, int,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_stalls, lowmem_pressure_stalls, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_array_named(pressure_adj, lowmem_pressure_adj, int,
+			 &lowmem_pressure_adj_size, S_IRUGO | S_IWUSR);
+module_param_named(pressure, lowmem_pressure, int, S_IRUGO);
+module_param_named(pressure_level, lowmem_pressure_level, int, S_IRUGO);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
@@ -23,8 +23,10 @@
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/math64.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/crypto.h>
 #include <linux/string.h>
 #include <linux/swap.h>
 #include <linux/swapops.h>
@@ -38,6 +40,13 @@ static struct ramzswap *devices;
 
 /* Module params (documentation at end) */
 static unsigned int num_devices;
+static char *compressor = "lzo";
+static int dedup = 1;
+static unsigned int wb_interval = 30;
+static unsigned int wb_idle_age = 4;
+static unsigned int wb_batch = 32;
+
+static struct workqueue_struct *ramzswap_wq;
 
 static int rzs_test_flag(struct ramzswap *rzs, u32 index,
 			enum rzs_pageflags flag)
@@ -126,7 +135,7 @@ static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
 	size_t succ_writes, mem_used;
 	unsigned int good_compress_perc = 0, no_compress_perc = 0;
 
-	mem_used = xv_get_total_size_bytes(rzs->mem_pool)
+	mem_used = zs_get_total_size_bytes(rzs->mem_pool)
 			+ (rs->pages_expand << PAGE_SHIFT);
 	succ_writes = rzs_stat64_read(rzs, &rs->num_writes) -
 			rzs_stat64_read(rzs, &rs->failed_writes);
@@ -158,13 +167,106 @@ static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
 #endif /* CONFIG_RAMZSWAP_STATS */
 }
 
-static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
+static void ramzswap_ioctl_get_stats2(struct ramzswap *rzs,
+			struct ramzswap_ioctl_stats2 *s)
+{
+#if defined(CONFIG_RAMZSWAP_STATS)
+	struct ramzswap_stats *rs = &rzs->stats;
+	struct zs_pool_stats zs;
+
+	s->pages_backed = rs->pages_backed;
+	s->pages_idle = rs->pages_idle;
+	s->bd_reads = rzs_stat64_read(rzs, &rs->bd_reads);
+	s->bd_writes = rzs_stat64_read(rzs, &rs->bd_writes);
+	s->bd_failed_writes = rzs_stat64_read(rzs, &rs->bd_failed_writes);
+
+	zs_get_stats(rzs->mem_pool, &zs);
+	if (zs.pages)
+		s->frag_pct = 100 - div64_u64(zs.obj_bytes * 100,
+				(zs.pages << PAGE_SHIFT) + zs.handle_bytes);
+	s->handle_bytes = zs.handle_bytes;
+	s->compactions = zs.compactions;
+	s->objs_migrated = zs.objs_migrated;
+	s->pages_compacted = zs.pages_compacted;
+#endif
+}
+
+/*
+ * Take and drop references to a compressed object. The reference count
+ * lives in the object's header and is protected by rzs->lock. The last
+ * put frees the object.
+ */
+static void ramzswap_get_object(struct ramzswap *rzs, unsigned long handle)
+{
+	struct zobj_header *zheader;
+
+	zheader = zs_map_object(rzs->mem_pool, handle);
+	zheader->refcount++;
+	zs_unmap_object(rzs->mem_pool, handle);
+}
+
+static void ramzswap_put_object(struct ramzswap *rzs, unsigned long handle)
 {
 	u32 clen;
-	void *obj;
+	struct zobj_header *zheader;
+	int shared;
+
+	zheader = zs_map_object(rzs->mem_pool, handle);
+	shared = --zheader->refcount;
+	clen = zheader->size;
+	zs_unmap_object(rzs->mem_pool, handle);
+
+	if (shared)
+		return;
 
+	zs_free(rzs->mem_pool, handle);
+	rzs->stats.compr_size -= clen;
+	if (clen <= PAGE_SIZE / 2)
+		rzs_stat_dec(&rzs->stats.good_compress);
+}
+
+/*
+ * Backing device slots. Caller must hold rzs->lock.
+ */
+static int ramzswap_alloc_bslot(struct ramzswap *rzs, unsigned long *bslot)
+{
+	unsigned long slot;
+
+	slot = find_next_zero_bit(rzs->bd_bitmap, rzs->bd_nr_slots,
+				rzs->bd_next);
+	if (slot >= rzs->bd_nr_slots)
+		slot = find_first_zero_bit(rzs->bd_bitmap, rzs->bd_nr_slots);
+	if (slot >= rzs->bd_nr_slots)
+		return 0;
+
+	__set_bit(slot, rzs->bd_bitmap);
+	rzs->bd_next = slot + 1;
+	*bslot = slot;
+
+	return 1;
+}
+
+static void ramzswap_free_bslot(struct ramzswap *rzs, unsigned long bslot)
+{
+	__clear_bit(bslot, rzs->bd_bitmap);
+}
+
+/*
+ * Release whatever a table entry holds. Caller must hold rzs->lock
+ * (or otherwise own the device, as on reset).
+ */
+static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
+{
 	struct page *page = rzs->table[index].page;
-	u32 offset = rzs->table[index].offset;
+
+	rzs->table[index].idle = 0;
+
+	if (unlikely(rzs_test_flag(rzs, index, RZS_BACKED))) {
+		ramzswap_free_bslot(rzs, rzs->table[index].bslot);
+		rzs_clear_flag(rzs, index, RZS_BACKED);
+		rzs_stat_dec(&rzs->stats.pages_backed);
+		goto clear;
+	}
 
 	if (unlikely(!page)) {
 		/*
@@ -179,27 +281,50 @@ static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
 	}
 
 	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))) {
-		clen = PAGE_SIZE;
-		__free_page(page);
+		/* Writeback may hold another reference */
+		put_page(page);
 		rzs_clear_flag(rzs, index, RZS_UNCOMPRESSED);
 		rzs_stat_dec(&rzs->stats.pages_expand);
-		goto out;
+		rzs->stats.compr_size -= PAGE_SIZE;
+	} else {
+		ramzswap_put_object(rzs, rzs->table[index].handle);
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(rzs->mem_pool, page, offset);
-	if (clen <= PAGE_SIZE / 2)
-		rzs_stat_dec(&rzs->stats.good_compress);
-
-out:
-	rzs->stats.compr_size -= clen;
 	rzs_stat_dec(&rzs->stats.pages_stored);
 
+clear:
 	rzs->table[index].page = NULL;
-	rzs->table[index].offset = 0;
+}
+
+static int ramzswap_decompress(struct ramzswap *rzs, struct page *page,
+			unsigned long handle)
+{
+	int ret;
+	unsigned int clen = PAGE_SIZE;
+	struct ramzswap_comp *comp;
+	struct zobj_header *zheader;
+	unsigned char *user_mem;
+
+	/* Some compressors keep decompression state in the tfm */
+	comp = per_cpu_ptr(rzs->comp, raw_smp_processor_id());
+	mutex_lock(&comp->lock);
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	zheader = zs_map_object(rzs->mem_pool, handle);
+
+	ret = crypto_comp_decompress(comp->tfm,
+		(unsigned char *)(zheader + 1), zheader->size,
+		user_mem, &clen);
+
+	zs_unmap_object(rzs->mem_pool, handle);
+	kunmap_atomic(user_mem, KM_USER0);
+
+	mutex_unlock(&comp->lock);
+
+	if (!ret && clen != PAGE_SIZE)
+		ret = -EIO;
+
+	return ret;
 }
 
 static int handle_zero_page(struct bio *bio)
@@ -218,18 +343,16 @@ static int handle_zero_page(struct bio *bio)
 	return 0;
 }
 
-static int handle_uncompressed_page(struct ramzswap *rzs, struct bio *bio)
+static int handle_uncompressed_page(struct ramzswap *rzs, struct bio *bio,
+			struct page *cpage)
 {
-	u32 index;
 	struct page *page;
 	unsigned char *user_mem, *cmem;
 
 	page = bio->bi_io_vec[0].bv_page;
-	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+	cmem = kmap_atomic(cpage, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
@@ -242,6 +365,21 @@ static int handle_uncompressed_page(struct ramzswap *rzs, struct bio *bio)
 	return 0;
 }
 
+/*
+ * Page has been written back. Remap the bio to the backing device and
+ * let the block layer resubmit it there.
+ */
+static int handle_backed_page(struct ramzswap *rzs, struct bio *bio,
+			unsigned long bslot)
+{
+	rzs_stat64_inc(rzs, &rzs->stats.bd_reads);
+
+	bio->bi_bdev = rzs->backing_bdev;
+	bio->bi_sector = (sector_t)bslot << SECTORS_PER_PAGE_SHIFT;
+
+	return 1;
+}
+
 /*
  * Called when request page is not present in ramzswap.
  * This is an attempt to read before any previous write
@@ -261,47 +399,69 @@ static int handle_ramzswap_fault(struct ramzswap *rzs, struct bio *bio)
 	return 0;
 }
 
+/*
+ * Reads only take rzs->lock to look up the entry and pin its object, so
+ * that background writeback cannot free it under us. Decompression runs
+ * without the lock.
+ */
 static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 {
 	int ret;
 	u32 index;
-	size_t clen;
-	struct page *page;
-	struct zobj_header *zheader;
-	unsigned char *user_mem, *cmem;
+	int uncompressed;
+	unsigned long bslot, handle;
+	struct page *page, *cpage;
 
 	rzs_stat64_inc(rzs, &rzs->stats.num_reads);
 
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
-	if (rzs_test_flag(rzs, index, RZS_ZERO))
+	spin_lock(&rzs->lock);
+
+	if (rzs_test_flag(rzs, index, RZS_ZERO)) {
+		spin_unlock(&rzs->lock);
 		return handle_zero_page(bio);
+	}
+
+	if (unlikely(rzs_test_flag(rzs, index, RZS_BACKED))) {
+		bslot = rzs->table[index].bslot;
+		spin_unlock(&rzs->lock);
+		return handle_backed_page(rzs, bio, bslot);
+	}
 
 	/* Requested page is not present in compressed area */
-	if (!rzs->table[index].page)
+	cpage = rzs->table[index].page;
+	if (!cpage) {
+		spin_unlock(&rzs->lock);
 		return handle_ramzswap_fault(rzs, bio);
+	}
 
-	/* Page is stored uncompressed since it's incompressible */
-	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
-		return handle_uncompressed_page(rzs, bio);
+	rzs->table[index].idle = 0;
+	handle = rzs->table[index].handle;
+	uncompressed = rzs_test_flag(rzs, index, RZS_UNCOMPRESSED);
+	if (unlikely(uncompressed))
+		get_page(cpage);
+	else
+		ramzswap_get_object(rzs, handle);
 
-	user_mem = kmap_atomic(page, KM_USER0);
-	clen = PAGE_SIZE;
+	spin_unlock(&rzs->lock);
 
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+	/* Page is stored uncompressed since it's incompressible */
+	if (unlikely(uncompressed)) {
+		ret = handle_uncompressed_page(rzs, bio, cpage);
+		put_page(cpage);
+		return ret;
+	}
 
-	ret = lzo1x_decompress_safe(
-		cmem + sizeof(*zheader),
-		xv_get_object_size(cmem) - sizeof(*zheader),
-		user_mem, &clen);
+	ret = ramzswap_decompress(rzs, page, handle);
 
-	kunmap_atomic(user_mem, KM_USER0);
-	kunmap_atomic(cmem, KM_USER1);
+	spin_lock(&rzs->lock);
+	ramzswap_put_object(rzs, handle);
+	spin_unlock(&rzs->lock);
 
 	/* should NEVER happen */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n",
 			ret, index);
 		rzs_stat64_inc(rzs, &rzs->stats.failed_reads);
@@ -319,43 +479,93 @@ out:
 	return 0;
 }
 
+/*
+ * Look for a stored object with the same compressed contents. The dedup
+ * table is only a hint: the slot it names may have been freed or reused
+ * since, so the object found there is compared in full. On a match a
+ * reference is taken and the object's handle returned.
+ * Caller must hold rzs->lock.
+ */
+static int ramzswap_find_dup(struct ramzswap *rzs, u32 hash,
+			const unsigned char *src, unsigned int clen,
+			unsigned long *handle)
+{
+	u32 index;
+	struct zobj_header *zheader;
+	int found = 0;
+
+	index = rzs->dedup_table[hash & rzs->dedup_mask];
+	if (!index--)
+		return 0;
+
+	if (!rzs->table[index].page ||
+			rzs_test_flag(rzs, index, RZS_UNCOMPRESSED) ||
+			rzs_test_flag(rzs, index, RZS_BACKED))
+		return 0;
+
+	zheader = zs_map_object(rzs->mem_pool, rzs->table[index].handle);
+
+	if (zheader->size == clen && !memcmp(zheader + 1, src, clen)) {
+		zheader->refcount++;
+		*handle = rzs->table[index].handle;
+		found = 1;
+	}
+
+	zs_unmap_object(rzs->mem_pool, rzs->table[index].handle);
+
+	return found;
+}
+
+/*
+ * Compression happens in this CPU's buffers with only their mutex held,
+ * and zs_malloc() does its own locking, so concurrent writers only meet
+ * on rzs->lock for the short table update at the end.
+ */
 static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 {
 	int ret;
-	u32 offset, index;
-	size_t clen;
+	u32 index, hash = 0;
+	unsigned int clen;
+	unsigned long handle = 0;
 	struct zobj_header *zheader;
-	struct page *page, *page_store;
+	struct ramzswap_comp *comp;
+	struct page *page, *page_store = NULL;
 	unsigned char *user_mem, *cmem, *src;
+	int uncompressed = 0;
 
 	rzs_stat64_inc(rzs, &rzs->stats.num_writes);
 
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
-	src = rzs->compress_buffer;
+	comp = per_cpu_ptr(rzs->comp, raw_smp_processor_id());
+	mutex_lock(&comp->lock);
 
-	mutex_lock(&rzs->lock);
+	src = comp->buffer;
 
 	user_mem = kmap_atomic(page, KM_USER0);
 	if (page_zero_filled(user_mem)) {
 		kunmap_atomic(user_mem, KM_USER0);
-		mutex_unlock(&rzs->lock);
+		mutex_unlock(&comp->lock);
+
+		spin_lock(&rzs->lock);
+		ramzswap_free_page(rzs, index);
 		rzs_stat_inc(&rzs->stats.pages_zero);
 		rzs_set_flag(rzs, index, RZS_ZERO);
+		spin_unlock(&rzs->lock);
 
 		set_bit(BIO_UPTODATE, &bio->bi_flags);
 		bio_endio(bio, 0);
 		return 0;
 	}
 
-	ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-				rzs->compress_workmem);
+	clen = 2 * PAGE_SIZE;
+	ret = crypto_comp_compress(comp->tfm, user_mem, PAGE_SIZE, src, &clen);
 
 	kunmap_atomic(user_mem, KM_USER0);
 
-	if (unlikely(ret != LZO_E_OK)) {
-		mutex_unlock(&rzs->lock);
+	if (unlikely(ret)) {
+		mutex_unlock(&comp->lock);
 		pr_err("Compression failed! err=%d\n", ret);
 		rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
 		goto out;
@@ -367,62 +577,86 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 	 * errors which has side effect of hanging the system.
 	 */
 	if (unlikely(clen > max_zpage_size)) {
+		/* The compressed copy is not needed, release the buffers */
+		mutex_unlock(&comp->lock);
+
 		clen = PAGE_SIZE;
 		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 		if (unlikely(!page_store)) {
-			mutex_unlock(&rzs->lock);
 			pr_info("Error allocating memory for incompressible "
 				"page: %u\n", index);
 			rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
 			goto out;
 		}
 
-		offset = 0;
-		rzs_set_flag(rzs, index, RZS_UNCOMPRESSED);
-		rzs_stat_inc(&rzs->stats.pages_expand);
-		rzs->table[index].page = page_store;
+		uncompressed = 1;
 		src = kmap_atomic(page, KM_USER0);
-		goto memstore;
+		cmem = kmap_atomic(page_store, KM_USER1);
+		memcpy(cmem, src, clen);
+		kunmap_atomic(cmem, KM_USER1);
+		kunmap_atomic(src, KM_USER0);
+		goto publish;
 	}
 
-	if (xv_malloc(rzs->mem_pool, clen + sizeof(*zheader),
-			&rzs->table[index].page, &offset,
-			GFP_NOIO | __GFP_HIGHMEM)) {
-		mutex_unlock(&rzs->lock);
+	/* Same contents already stored? Then just share that object. */
+	if (rzs->dedup_table) {
+		hash = jhash(src, clen, 0);
+
+		spin_lock(&rzs->lock);
+		if (ramzswap_find_dup(rzs, hash, src, clen, &handle)) {
+			ramzswap_free_page(rzs, index);
+			rzs->table[index].handle = handle;
+			rzs_stat_inc(&rzs->stats.pages_stored);
+			spin_unlock(&rzs->lock);
+			mutex_unlock(&comp->lock);
+
+			set_bit(BIO_UPTODATE, &bio->bi_flags);
+			bio_endio(bio, 0);
+			return 0;
+		}
+		spin_unlock(&rzs->lock);
+	}
+
+	handle = zs_malloc(rzs->mem_pool, clen + sizeof(*zheader),
+			GFP_NOIO | __GFP_HIGHMEM);
+	if (!handle) {
+		mutex_unlock(&comp->lock);
 		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
+			"page: %u, size=%u\n", index, clen);
 		rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
 		goto out;
 	}
 
-memstore:
-	rzs->table[index].offset = offset;
+	zheader = zs_map_object(rzs->mem_pool, handle);
+	zheader->size = clen;
+	zheader->refcount = 1;
+	memcpy(zheader + 1, src, clen);
+	zs_unmap_object(rzs->mem_pool, handle);
 
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+	mutex_unlock(&comp->lock);
 
-#if 0
-	/* Back-reference needed for memory defragmentation */
-	if (!rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
-	}
-#endif
+publish:
+	/* Publish the new object and update stats */
+	spin_lock(&rzs->lock);
 
-	memcpy(cmem, src, clen);
+	ramzswap_free_page(rzs, index);
 
-	kunmap_atomic(cmem, KM_USER1);
-	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
-		kunmap_atomic(src, KM_USER0);
+	if (unlikely(uncompressed)) {
+		rzs->table[index].page = page_store;
+		rzs_set_flag(rzs, index, RZS_UNCOMPRESSED);
+		rzs_stat_inc(&rzs->stats.pages_expand);
+	} else {
+		rzs->table[index].handle = handle;
+		if (rzs->dedup_table)
+			rzs->dedup_table[hash & rzs->dedup_mask] = index + 1;
+	}
 
-	/* Update stats */
 	rzs->stats.compr_size += clen;
 	rzs_stat_inc(&rzs->stats.pages_stored);
 	if (clen <= PAGE_SIZE / 2)
 		rzs_stat_inc(&rzs->stats.good_compress);
 
-	mutex_unlock(&rzs->lock);
+	spin_unlock(&rzs->lock);
 
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
@@ -484,49 +718,343 @@ static int ramzswap_make_request(struct request_queue *queue, struct bio *bio)
 	return ret;
 }
 
-static void reset_device(struct ramzswap *rzs)
+/*
+ * Backing device writeback.
+ *
+ * A delayed work item walks the table every wb_interval seconds. Each
+ * pass ages resident pages; reads reset the age. Incompressible pages
+ * that survived one pass and compressed pages idle for wb_idle_age
+ * passes are written to the backing device in batches of wb_batch and
+ * their memory is freed. Reads of such pages are remapped to the
+ * backing device.
+ *
+ * The objects being written are pinned with a reference, so a page that
+ * is rewritten or freed in the meantime is simply not switched over
+ * once the I/O has completed.
+ */
+static void ramzswap_wb_end_io(struct bio *bio, int err)
 {
-	size_t index;
+	struct ramzswap_wb_item *item = bio->bi_private;
 
-	/* Do not accept any new I/O request */
-	rzs->init_done = 0;
+	if (err || !test_bit(BIO_UPTODATE, &bio->bi_flags))
+		item->error = err ? err : -EIO;
 
-	/* Free various per-device buffers */
-	kfree(rzs->compress_workmem);
-	free_pages((unsigned long)rzs->compress_buffer, 1);
+	if (atomic_dec_and_test(&item->batch->pending))
+		complete(&item->batch->done);
+
+	bio_put(bio);
+}
+
+static int ramzswap_wb_submit(struct ramzswap *rzs,
+			struct ramzswap_wb_item *item)
+{
+	struct bio *bio;
+
+	if (item->uncompressed) {
+		item->io_page = item->page;
+	} else {
+		item->io_page = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+		if (!item->io_page)
+			return -ENOMEM;
+
+		if (ramzswap_decompress(rzs, item->io_page, item->handle))
+			return -EIO;
+	}
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = rzs->backing_bdev;
+	bio->bi_sector = (sector_t)item->bslot << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = ramzswap_wb_end_io;
+	bio->bi_private = item;
+	if (!bio_add_page(bio, item->io_page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
 
-	rzs->compress_workmem = NULL;
-	rzs->compress_buffer = NULL;
+	atomic_inc(&item->batch->pending);
+	submit_bio(WRITE, bio);
 
-	/* Free all pages that are still in this ramzswap device */
-	for (index = 0; index < rzs->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
+	return 0;
+}
 
-		page = rzs->table[index].page;
-		offset = rzs->table[index].offset;
+static void ramzswap_wb_flush(struct ramzswap *rzs, int nr_items)
+{
+	int i;
+	struct ramzswap_wb_batch batch;
+	struct ramzswap_wb_item *item;
+
+	/* Bias pending so that the batch cannot complete while submitting */
+	atomic_set(&batch.pending, 1);
+	init_completion(&batch.done);
+
+	for (i = 0; i < nr_items; i++) {
+		item = &rzs->wb_items[i];
+		item->batch = &batch;
+		item->io_page = NULL;
+		item->error = ramzswap_wb_submit(rzs, item);
+	}
 
-		if (!page)
-			continue;
+	if (!atomic_dec_and_test(&batch.pending))
+		wait_for_completion(&batch.done);
+
+	spin_lock(&rzs->lock);
+	for (i = 0; i < nr_items; i++) {
+		u32 index;
+
+		item = &rzs->wb_items[i];
+		index = item->index;
+
+		/* Only switch over if the page was not rewritten or freed */
+		if (!item->error &&
+				rzs->table[index].handle == item->handle &&
+				!rzs_test_flag(rzs, index, RZS_BACKED) &&
+				!rzs_test_flag(rzs, index, RZS_ZERO) &&
+				!!rzs_test_flag(rzs, index, RZS_UNCOMPRESSED) ==
+					item->uncompressed) {
+			ramzswap_free_page(rzs, index);
+			rzs->table[index].bslot = item->bslot;
+			rzs_set_flag(rzs, index, RZS_BACKED);
+			rzs_stat_inc(&rzs->stats.pages_backed);
+			rzs_stat64_inc(rzs, &rzs->stats.bd_writes);
+		} else {
+			ramzswap_free_bslot(rzs, item->bslot);
+			if (item->error)
+				rzs_stat64_inc(rzs,
+					&rzs->stats.bd_failed_writes);
+		}
 
-		if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
-			__free_page(page);
+		if (item->uncompressed)
+			put_page(item->page);
 		else
-			xv_free(rzs->mem_pool, page, offset);
+			ramzswap_put_object(rzs, item->handle);
+	}
+	spin_unlock(&rzs->lock);
+
+	for (i = 0; i < nr_items; i++) {
+		item = &rzs->wb_items[i];
+		if (!item->uncompressed && item->io_page)
+			__free_page(item->io_page);
+	}
+}
+
+/* Table entries scanned per lock hold */
+#define RZS_WB_SCAN_CHUNK	256
+
+static void ramzswap_writeback_work(struct work_struct *work)
+{
+	struct ramzswap *rzs = container_of(to_delayed_work(work),
+					struct ramzswap, wb_work);
+	size_t index, end, num_pages;
+	u32 nr_idle = 0;
+	int nr_items = 0;
+
+	num_pages = rzs->disksize >> PAGE_SHIFT;
+
+	/* Index 0 holds the swap header and is never written back */
+	for (index = 1; index < num_pages; ) {
+		end = min_t(size_t, index + RZS_WB_SCAN_CHUNK, num_pages);
+
+		spin_lock(&rzs->lock);
+		for (; index < end; index++) {
+			struct ramzswap_wb_item *item;
+			struct table *t = &rzs->table[index];
+			int uncompressed;
+
+			if (!t->page || rzs_test_flag(rzs, index, RZS_BACKED) ||
+					rzs_test_flag(rzs, index, RZS_ZERO))
+				continue;
+
+			if (t->idle != (u8)~0)
+				t->idle++;
+			if (wb_idle_age && t->idle >= wb_idle_age)
+				nr_idle++;
+
+			uncompressed = rzs_test_flag(rzs, index,
+						RZS_UNCOMPRESSED);
+			if (!(uncompressed && t->idle >= 2) &&
+					!(wb_idle_age && t->idle >= wb_idle_age))
+				continue;
+
+			item = &rzs->wb_items[nr_items];
+			if (!ramzswap_alloc_bslot(rzs, &item->bslot))
+				continue;
+
+			item->index = index;
+			item->handle = t->handle;
+			item->uncompressed = uncompressed;
+			if (uncompressed)
+				get_page(t->page);
+			else
+				ramzswap_get_object(rzs, t->handle);
+			if (++nr_items == wb_batch) {
+				index++;
+				break;
+			}
+		}
+		spin_unlock(&rzs->lock);
+
+		if (nr_items == wb_batch) {
+			ramzswap_wb_flush(rzs, nr_items);
+			nr_items = 0;
+		}
+
+		cond_resched();
 	}
 
+	if (nr_items)
+		ramzswap_wb_flush(rzs, nr_items);
+
+#if defined(CONFIG_RAMZSWAP_STATS)
+	rzs->stats.pages_idle = nr_idle;
+#endif
+
+	queue_delayed_work(ramzswap_wq, &rzs->wb_work,
+			max(wb_interval, 1U) * HZ);
+}
+
+static void free_comp_buffers(struct ramzswap *rzs)
+{
+	int cpu;
+
+	if (!rzs->comp)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct ramzswap_comp *comp = per_cpu_ptr(rzs->comp, cpu);
+
+		if (comp->tfm)
+			crypto_free_comp(comp->tfm);
+		free_pages((unsigned long)comp->buffer, 1);
+	}
+
+	free_percpu(rzs->comp);
+	rzs->comp = NULL;
+}
+
+static int alloc_comp_buffers(struct ramzswap *rzs)
+{
+	int cpu;
+
+	rzs->comp = alloc_percpu(struct ramzswap_comp);
+	if (!rzs->comp)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct ramzswap_comp *comp = per_cpu_ptr(rzs->comp, cpu);
+
+		mutex_init(&comp->lock);
+
+		comp->tfm = crypto_alloc_comp(rzs->compressor, 0, 0);
+		if (IS_ERR(comp->tfm)) {
+			pr_err("Error allocating %s compressor!\n",
+				rzs->compressor);
+			comp->tfm = NULL;
+			return -ENOMEM;
+		}
+
+		comp->buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
+		if (!comp->buffer) {
+			pr_err("Error allocating compressor buffer space\n");
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static void reset_device(struct ramzswap *rzs)
+{
+	size_t index;
+
+	/* Do not accept any new I/O request */
+	rzs->init_done = 0;
+
+	cancel_delayed_work_sync(&rzs->wb_work);
+
+	/* Free various per-device buffers */
+	free_comp_buffers(rzs);
+
+	/*
+	 * Free all pages that are still in this ramzswap device.
+	 * Objects may be shared, so go through the refcounting.
+	 */
+	for (index = 0; rzs->table && index < rzs->disksize >> PAGE_SHIFT;
+			index++)
+		ramzswap_free_page(rzs, index);
+
 	vfree(rzs->table);
 	rzs->table = NULL;
 
-	xv_destroy_pool(rzs->mem_pool);
+	vfree(rzs->dedup_table);
+	rzs->dedup_table = NULL;
+
+	zs_destroy_pool(rzs->mem_pool);
 	rzs->mem_pool = NULL;
 
+	if (rzs->backing_bdev)
+		close_bdev_exclusive(rzs->backing_bdev,
+					FMODE_READ | FMODE_WRITE);
+	rzs->backing_bdev = NULL;
+
+	vfree(rzs->bd_bitmap);
+	rzs->bd_bitmap = NULL;
+	rzs->bd_nr_slots = 0;
+	rzs->bd_next = 0;
+
+	kfree(rzs->wb_items);
+	rzs->wb_items = NULL;
+	rzs->backing_name[0] = '\0';
+
 	/* Reset stats */
 	memset(&rzs->stats, 0, sizeof(rzs->stats));
 
 	rzs->disksize = 0;
 }
 
+static int setup_backing_device(struct ramzswap *rzs)
+{
+	size_t bitmap_size;
+	struct block_device *bdev;
+
+	bdev = open_bdev_exclusive(rzs->backing_name,
+				FMODE_READ | FMODE_WRITE, rzs);
+	if (IS_ERR(bdev)) {
+		pr_err("Error opening backing device %s\n", rzs->backing_name);
+		return PTR_ERR(bdev);
+	}
+	rzs->backing_bdev = bdev;
+
+	rzs->bd_nr_slots = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (!rzs->bd_nr_slots) {
+		pr_err("Backing device %s is too small\n", rzs->backing_name);
+		return -EINVAL;
+	}
+
+	bitmap_size = BITS_TO_LONGS(rzs->bd_nr_slots) * sizeof(long);
+	rzs->bd_bitmap = vmalloc(bitmap_size);
+	if (!rzs->bd_bitmap) {
+		pr_err("Error allocating backing device bitmap\n");
+		return -ENOMEM;
+	}
+	memset(rzs->bd_bitmap, 0, bitmap_size);
+
+	if (!wb_batch)
+		wb_batch = 1;
+	rzs->wb_items = kcalloc(wb_batch, sizeof(*rzs->wb_items),
+				GFP_KERNEL);
+	if (!rzs->wb_items) {
+		pr_err("Error allocating writeback batch\n");
+		return -ENOMEM;
+	}
+
+	pr_info("Backing device %s: %lu pages\n", rzs->backing_name,
+		rzs->bd_nr_slots);
+	return 0;
+}
+
 static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 {
 	int ret;
@@ -541,19 +1069,9 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 
 	ramzswap_set_disksize(rzs, totalram_pages << PAGE_SHIFT);
 
-	rzs->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!rzs->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	rzs->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!rzs->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = alloc_comp_buffers(rzs);
+	if (ret)
 		goto fail;
-	}
 
 	num_pages = rzs->disksize >> PAGE_SHIFT;
 	rzs->table = vmalloc(num_pages * sizeof(*rzs->table));
@@ -566,6 +1084,19 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 	}
 	memset(rzs->table, 0, num_pages * sizeof(*rzs->table));
 
+	if (dedup) {
+		size_t nr_buckets = roundup_pow_of_two(num_pages / 8 + 1);
+
+		rzs->dedup_table = vmalloc(nr_buckets * sizeof(u32));
+		if (rzs->dedup_table) {
+			memset(rzs->dedup_table, 0, nr_buckets * sizeof(u32));
+			rzs->dedup_mask = nr_buckets - 1;
+		} else {
+			pr_info("Error allocating dedup table, "
+				"continuing without dedup\n");
+		}
+	}
+
 	page = alloc_page(__GFP_ZERO);
 	if (!page) {
 		pr_err("Error allocating swap header page\n");
@@ -584,15 +1115,25 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 	/* ramzswap devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, rzs->disk->queue);
 
-	rzs->mem_pool = xv_create_pool();
+	rzs->mem_pool = zs_create_pool();
 	if (!rzs->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
 
+	if (rzs->backing_name[0]) {
+		ret = setup_backing_device(rzs);
+		if (ret)
+			goto fail;
+	}
+
 	rzs->init_done = 1;
 
+	if (rzs->backing_bdev)
+		queue_delayed_work(ramzswap_wq, &rzs->wb_work,
+				max(wb_interval, 1U) * HZ);
+
 	pr_debug("Initialization done!\n");
 	return 0;
 
@@ -634,6 +1175,44 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 		pr_info("Disk size set to %zu kB\n", disksize_kb);
 		break;
 
+	case RZSIO_SET_COMPRESSOR:
+	{
+		char name[RZS_MAX_COMPRESSOR_NAME];
+
+		if (rzs->init_done) {
+			ret = -EBUSY;
+			goto out;
+		}
+		if (copy_from_user(name, (void *)arg, sizeof(name))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		name[sizeof(name) - 1] = '\0';
+		if (!crypto_has_comp(name, 0, 0)) {
+			pr_info("Compressor %s not available\n", name);
+			ret = -EINVAL;
+			goto out;
+		}
+		strlcpy(rzs->compressor, name, sizeof(rzs->compressor));
+		pr_info("Compressor set to %s\n", rzs->compressor);
+		break;
+	}
+
+	case RZSIO_SET_BACKING_DEV:
+		if (rzs->init_done) {
+			ret = -EBUSY;
+			goto out;
+		}
+		if (copy_from_user(rzs->backing_name, (void *)arg,
+					sizeof(rzs->backing_name))) {
+			rzs->backing_name[0] = '\0';
+			ret = -EFAULT;
+			goto out;
+		}
+		rzs->backing_name[sizeof(rzs->backing_name) - 1] = '\0';
+		pr_info("Backing device set to %s\n", rzs->backing_name);
+		break;
+
 	case RZSIO_GET_STATS:
 	{
 		struct ramzswap_ioctl_stats *stats;
@@ -655,6 +1234,40 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 		kfree(stats);
 		break;
 	}
+
+	case RZSIO_GET_STATS2:
+	{
+		struct ramzswap_ioctl_stats2 *stats;
+		u32 size;
+
+		if (!rzs->init_done) {
+			ret = -ENOTTY;
+			goto out;
+		}
+		if (get_user(size, (u32 __user *)arg)) {
+			ret = -EFAULT;
+			goto out;
+		}
+		if (size < sizeof(stats->size)) {
+			ret = -EINVAL;
+			goto out;
+		}
+		stats = kzalloc(sizeof(*stats), GFP_KERNEL);
+		if (!stats) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		ramzswap_ioctl_get_stats2(rzs, stats);
+		stats->size = min_t(u32, size, sizeof(*stats));
+		if (copy_to_user((void *)arg, stats, stats->size)) {
+			kfree(stats);
+			ret = -EFAULT;
+			goto out;
+		}
+		kfree(stats);
+		break;
+	}
+
 	case RZSIO_INIT:
 		ret = ramzswap_ioctl_init_device(rzs);
 		break;
@@ -687,7 +1300,11 @@ void ramzswap_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct ramzswap *rzs;
 
 	rzs = bdev->bd_disk->private_data;
+
+	spin_lock(&rzs->lock);
 	ramzswap_free_page(rzs, index);
+	spin_unlock(&rzs->lock);
+
 	rzs_stat64_inc(rzs, &rzs->stats.notify_free);
 
 	return;
@@ -703,9 +1320,12 @@ static int create_device(struct ramzswap *rzs, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&rzs->lock);
+	spin_lock_init(&rzs->lock);
 	spin_lock_init(&rzs->stat64_lock);
 
+	strlcpy(rzs->compressor, compressor, sizeof(rzs->compressor));
+	INIT_DELAYED_WORK(&rzs->wb_work, ramzswap_writeback_work);
+
 	rzs->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!rzs->queue) {
 		pr_err("Error allocating disk queue for device %d\n",
@@ -770,11 +1390,17 @@ static int __init ramzswap_init(void)
 		goto out;
 	}
 
+	ramzswap_wq = create_singlethread_workqueue("ramzswap_wb");
+	if (!ramzswap_wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	ramzswap_major = register_blkdev(0, "ramzswap");
 	if (ramzswap_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto destroy_wq;
 	}
 
 	if (!num_devices) {
@@ -803,6 +1429,8 @@ free_devices:
 		destroy_device(&devices[--dev_id]);
 unregister:
 	unregister_blkdev(ramzswap_major, "ramzswap");
+destroy_wq:
+	destroy_workqueue(ramzswap_wq);
 out:
 	return ret;
 }
@@ -823,11 +1451,23 @@ static void __exit ramzswap_exit(void)
 	unregister_blkdev(ramzswap_major, "ramzswap");
 
 	kfree(devices);
+	destroy_workqueue(ramzswap_wq);
 	pr_debug("Cleanup done!\n");
 }
 
 module_param(num_devices, uint, 0);
 MODULE_PARM_DESC(num_devices, "Number of ramzswap devices");
+module_param(compressor, charp, 0);
+MODULE_PARM_DESC(compressor, "Default crypto compressor (lzo, deflate)");
+module_param(dedup, int, 0);
+MODULE_PARM_DESC(dedup, "Share identical compressed pages");
+module_param(wb_interval, uint, 0);
+MODULE_PARM_DESC(wb_interval, "Seconds between backing device writeback passes");
+module_param(wb_idle_age, uint, 0);
+MODULE_PARM_DESC(wb_idle_age, "Passes a page must be idle before writeback "
+	"(0: write back incompressible pages only)");
+module_param(wb_batch, uint, 0);
+MODULE_PARM_DESC(wb_batch, "Pages written back per batch");
 
 module_init(ramzswap_init);
 module_exit(ramzswap_exit);
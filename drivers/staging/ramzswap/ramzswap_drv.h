@@ -17,9 +17,12 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
 
 #include "ramzswap_ioctl.h"
-#include "xvmalloc.h"
+#include "zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -30,13 +33,13 @@ static const unsigned max_num_devices = 32;
 /*
  * Stored at beginning of each compressed object.
  *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
+ * The allocator rounds objects up to its size classes, so the exact
+ * compressed size is kept here. It also counts the table entries
+ * sharing this object when identical pages are deduplicated.
  */
 struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
+	u32 size;	/* compressed size, excluding this header */
+	u32 refcount;	/* table entries sharing this object */
 };
 
 /*-- Configurable parameters */
@@ -52,8 +55,8 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -71,6 +74,9 @@ enum rzs_pageflags {
 	/* Page consists entirely of zeros */
 	RZS_ZERO,
 
+	/* Page has been written back to the backing device */
+	RZS_BACKED,
+
 	__NR_RZS_PAGEFLAGS,
 };
 
@@ -81,9 +87,12 @@ enum rzs_pageflags {
  * These table entries must fit exactly in a page.
  */
 struct table {
-	struct page *page;
-	u16 offset;
-	u8 count;	/* object ref count (not yet used) */
+	union {
+		struct page *page;	/* RZS_UNCOMPRESSED: the page itself */
+		unsigned long handle;	/* compressed object */
+		unsigned long bslot;	/* RZS_BACKED: backing device slot */
+	};
+	u8 idle;	/* writeback passes since last access, saturating */
 	u8 flags;
 } __attribute__((aligned(4)));
 
@@ -103,16 +112,71 @@ struct ramzswap_stats {
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u64 bd_reads;		/* reads served from backing device */
+	u64 bd_writes;		/* pages written back */
+	u64 bd_failed_writes;	/* writebacks that did not complete */
+	u32 pages_backed;	/* no. of pages on backing device */
+	u32 pages_idle;		/* resident pages idle for wb_idle_age passes
+				 * (as of the last writeback pass) */
 #endif
 };
 
+/*
+ * Writeback of idle and incompressible pages to the backing device.
+ * A batch of pages is submitted at once and waited for as a whole.
+ */
+struct ramzswap_wb_batch {
+	atomic_t pending;
+	struct completion done;
+};
+
+struct ramzswap_wb_item {
+	u32 index;
+	union {			/* object being written back (referenced) */
+		struct page *page;
+		unsigned long handle;
+	};
+	int uncompressed;
+	unsigned long bslot;
+	struct page *io_page;	/* page handed to the backing device */
+	int error;
+	struct ramzswap_wb_batch *batch;
+};
+
+/*
+ * Compression working memory. There is one of these per possible CPU
+ * so that swap-out on different CPUs does not serialize. The mutex is
+ * only contended if a writer is migrated away while another writer
+ * picks up the same CPU's buffers.
+ */
+struct ramzswap_comp {
+	struct mutex lock;
+	struct crypto_comp *tfm;
+	void *buffer;
+};
+
 struct ramzswap {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct ramzswap_comp __percpu *comp;
 	struct table *table;
+	/*
+	 * Dedup hints: hash of compressed contents -> (table index + 1)
+	 * of a slot that last stored such an object. Protected by lock.
+	 */
+	u32 *dedup_table;
+	u32 dedup_mask;
+	char compressor[RZS_MAX_COMPRESSOR_NAME];
+
+	/* Optional backing device. Slot allocation is under lock. */
+	char backing_name[RZS_MAX_BACKING_NAME];
+	struct block_device *backing_bdev;
+	unsigned long *bd_bitmap;	/* used backing slots */
+	unsigned long bd_nr_slots;
+	unsigned long bd_next;		/* slot allocation cursor */
+	struct delayed_work wb_work;
+	struct ramzswap_wb_item *wb_items;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;
+	spinlock_t lock;	/* protect table updates and 32-bit stats */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
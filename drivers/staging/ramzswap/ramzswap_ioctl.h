@@ -15,6 +15,9 @@
 #ifndef _RAMZSWAP_IOCTL_H_
 #define _RAMZSWAP_IOCTL_H_
 
+#define RZS_MAX_COMPRESSOR_NAME	16
+#define RZS_MAX_BACKING_NAME	64
+
 struct ramzswap_ioctl_stats {
 	u64 disksize;		/* user specified or equal to backing swap
 				 * size (if present) */
@@ -34,9 +37,31 @@ struct ramzswap_ioctl_stats {
 	u64 mem_used_total;
 } __attribute__ ((packed, aligned(4)));
 
+/*
+ * Counters added after RZSIO_GET_STATS. The caller sets size to the size
+ * of the struct it was built with; at most that many bytes are filled in
+ * and size is set to the number filled. New counters are only appended.
+ */
+struct ramzswap_ioctl_stats2 {
+	u32 size;
+	u32 pages_backed;	/* no. of pages on backing device */
+	u32 pages_idle;		/* resident pages idle long enough to write back */
+	u64 bd_reads;		/* reads served from backing device */
+	u64 bd_writes;		/* pages written back */
+	u64 bd_failed_writes;
+	u32 frag_pct;		/* % of allocator memory in unused slots */
+	u64 compactions;	/* allocator compaction passes */
+	u64 objs_migrated;	/* objects moved by compaction */
+	u64 pages_compacted;	/* pages returned by compaction */
+	u64 handle_bytes;	/* allocator memory used by object handles */
+} __attribute__ ((packed, aligned(4)));
+
 #define RZSIO_SET_DISKSIZE_KB	_IOW('z', 0, size_t)
 #define RZSIO_GET_STATS		_IOR('z', 1, struct ramzswap_ioctl_stats)
 #define RZSIO_INIT		_IO('z', 2)
 #define RZSIO_RESET		_IO('z', 3)
+#define RZSIO_SET_COMPRESSOR	_IOW('z', 4, char[RZS_MAX_COMPRESSOR_NAME])
+#define RZSIO_SET_BACKING_DEV	_IOW('z', 5, char[RZS_MAX_BACKING_NAME])
+#define RZSIO_GET_STATS2	_IOWR('z', 6, u32)	/* struct ramzswap_ioctl_stats2 */
 
 #endif
@@ -0,0 +1,685 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Objects are sorted into size classes ZS_SIZE_CLASS_DELTA bytes apart.
+ * Each class carves same sized slots out of spans of one or more pages,
+ * with the span size picked so that little of it is left unused.
+ * Users get an opaque handle instead of a <page, offset> pair and must
+ * map it to get at the object. Since nothing outside the allocator
+ * knows where an object lives, zs_compact() can move objects out of
+ * sparsely used spans into fuller ones and give the emptied pages back
+ * to the buddy allocator. It runs from a shrinker under memory pressure.
+ * Handles come from a slab cache of their own, so they are packed
+ * tightly instead of taking a cache line each; they are counted in the
+ * pool size.
+ */
+
+#include <linux/bitops.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/bit_spinlock.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+/* Shared by all pools */
+static struct kmem_cache *zs_handle_cache;
+static int zs_handle_cache_users;
+static DEFINE_MUTEX(zs_handle_cache_lock);
+
+static int get_handle_cache(void)
+{
+	int ret = 0;
+
+	mutex_lock(&zs_handle_cache_lock);
+	if (!zs_handle_cache_users) {
+		zs_handle_cache = kmem_cache_create("zs_handle",
+					sizeof(struct zs_handle), 0, 0, NULL);
+		if (!zs_handle_cache)
+			ret = -ENOMEM;
+	}
+	if (!ret)
+		zs_handle_cache_users++;
+	mutex_unlock(&zs_handle_cache_lock);
+
+	return ret;
+}
+
+static void put_handle_cache(void)
+{
+	mutex_lock(&zs_handle_cache_lock);
+	if (!--zs_handle_cache_users) {
+		kmem_cache_destroy(zs_handle_cache);
+		zs_handle_cache = NULL;
+	}
+	mutex_unlock(&zs_handle_cache_lock);
+}
+
+static u64 handle_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->handles) *
+		kmem_cache_size(zs_handle_cache);
+}
+
+static u32 get_class_index(u32 size)
+{
+	if (size <= ZS_MIN_ALLOC_SIZE)
+		return 0;
+	return DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE, ZS_SIZE_CLASS_DELTA);
+}
+
+/*
+ * Pick the span size, in pages, that wastes the least space for the
+ * given object size.
+ */
+static u16 get_pages_per_span(u32 size)
+{
+	u16 i, best = 1;
+	u32 used, best_pct = 0;
+
+	for (i = 1; i <= ZS_MAX_SPAN_PAGES; i++) {
+		used = (i * PAGE_SIZE / size) * size;
+		if (used * 100 / (i * PAGE_SIZE) > best_pct) {
+			best_pct = used * 100 / (i * PAGE_SIZE);
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static enum zs_fullness get_fullness(struct zs_class *class,
+			struct zs_span *span)
+{
+	if (span->inuse == class->objs_per_span)
+		return ZS_FULL;
+	if (span->inuse * ZS_FULLNESS_FRAC <=
+			class->objs_per_span * (ZS_FULLNESS_FRAC - 1))
+		return ZS_ALMOST_EMPTY;
+	return ZS_ALMOST_FULL;
+}
+
+static void fix_fullness(struct zs_class *class, struct zs_span *span)
+{
+	enum zs_fullness fullness = get_fullness(class, span);
+
+	if (fullness == span->fullness)
+		return;
+
+	span->fullness = fullness;
+	list_move(&span->list, &class->spans[fullness]);
+}
+
+static int slot_is_free(struct zs_span *span, u16 idx)
+{
+	return span->slots[idx] & ZS_SLOT_FREE;
+}
+
+/*
+ * Copy len bytes between buf and a span starting at byte offset, which
+ * may cross into the next page.
+ */
+static void copy_from_span(struct zs_span *span, u32 offset, void *buf,
+			u32 len)
+{
+	u32 pg, off, n;
+	unsigned char *vaddr;
+
+	while (len) {
+		pg = offset >> PAGE_SHIFT;
+		off = offset & ~PAGE_MASK;
+		n = min_t(u32, len, PAGE_SIZE - off);
+
+		vaddr = kmap_atomic(span->pages[pg], KM_USER1);
+		memcpy(buf, vaddr + off, n);
+		kunmap_atomic(vaddr, KM_USER1);
+
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+}
+
+static void copy_to_span(struct zs_span *span, u32 offset, const void *buf,
+			u32 len)
+{
+	u32 pg, off, n;
+	unsigned char *vaddr;
+
+	while (len) {
+		pg = offset >> PAGE_SHIFT;
+		off = offset & ~PAGE_MASK;
+		n = min_t(u32, len, PAGE_SIZE - off);
+
+		vaddr = kmap_atomic(span->pages[pg], KM_USER1);
+		memcpy(vaddr + off, buf, n);
+		kunmap_atomic(vaddr, KM_USER1);
+
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+}
+
+static void free_span(struct zs_pool *pool, struct zs_class *class,
+			struct zs_span *span)
+{
+	u16 i;
+
+	for (i = 0; i < class->pages_per_span; i++)
+		__free_page(span->pages[i]);
+	kfree(span);
+
+	atomic_long_sub(class->pages_per_span, &pool->pages);
+}
+
+static struct zs_span *alloc_span(struct zs_pool *pool,
+			struct zs_class *class, gfp_t flags)
+{
+	u16 i;
+	struct zs_span *span;
+
+	span = kzalloc(sizeof(*span) +
+			class->objs_per_span * sizeof(span->slots[0]),
+			flags & ~__GFP_HIGHMEM);
+	if (!span)
+		return NULL;
+
+	for (i = 0; i < class->pages_per_span; i++) {
+		span->pages[i] = alloc_page(flags);
+		if (!span->pages[i])
+			goto fail;
+	}
+
+	for (i = 0; i < class->objs_per_span; i++)
+		span->slots[i] = ((unsigned long)(i + 1) << 1) | ZS_SLOT_FREE;
+
+	span->class = class;
+	span->free = 0;
+	INIT_LIST_HEAD(&span->list);
+
+	atomic_long_add(class->pages_per_span, &pool->pages);
+	return span;
+
+fail:
+	while (i--)
+		__free_page(span->pages[i]);
+	kfree(span);
+	return NULL;
+}
+
+/*
+ * Take a free slot of span for handle. Caller must hold the class lock.
+ */
+static u16 alloc_slot(struct zs_class *class, struct zs_span *span,
+			struct zs_handle *handle)
+{
+	u16 idx = span->free;
+
+	span->free = span->slots[idx] >> 1;
+	span->slots[idx] = (unsigned long)handle;
+	span->inuse++;
+	class->nr_objs++;
+	fix_fullness(class, span);
+
+	return idx;
+}
+
+static void free_slot(struct zs_class *class, struct zs_span *span, u16 idx)
+{
+	span->slots[idx] = ((unsigned long)span->free << 1) | ZS_SLOT_FREE;
+	span->free = idx;
+	span->inuse--;
+	class->nr_objs--;
+}
+
+/* Span with free slots to allocate from, fullest first */
+static struct zs_span *find_span(struct zs_class *class)
+{
+	if (!list_empty(&class->spans[ZS_ALMOST_FULL]))
+		return list_first_entry(&class->spans[ZS_ALMOST_FULL],
+					struct zs_span, list);
+	if (!list_empty(&class->spans[ZS_ALMOST_EMPTY]))
+		return list_first_entry(&class->spans[ZS_ALMOST_EMPTY],
+					struct zs_span, list);
+	return NULL;
+}
+
+/**
+ * zs_malloc - allocate an object from the pool
+ * @pool: pool to allocate from
+ * @size: size of the object, at most ZS_MAX_ALLOC_SIZE
+ * @flags: flags for allocating pages and metadata
+ *
+ * Returns a handle for the object or 0 on failure. The handle must be
+ * mapped with zs_map_object() to access the object.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, u32 size, gfp_t flags)
+{
+	struct zs_class *class;
+	struct zs_span *span, *new = NULL;
+	struct zs_handle *handle;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	class = &pool->classes[get_class_index(size)];
+
+	handle = kmem_cache_alloc(zs_handle_cache, flags & ~__GFP_HIGHMEM);
+	if (!handle)
+		return 0;
+	handle->lock = 0;
+
+	spin_lock(&class->lock);
+	span = find_span(class);
+	if (!span) {
+		/* Pages are allocated without the lock, it may reclaim */
+		spin_unlock(&class->lock);
+		new = alloc_span(pool, class, flags);
+		if (!new) {
+			kmem_cache_free(zs_handle_cache, handle);
+			return 0;
+		}
+		spin_lock(&class->lock);
+
+		span = find_span(class);
+		if (!span) {
+			span = new;
+			new = NULL;
+			span->fullness = ZS_ALMOST_EMPTY;
+			list_add(&span->list, &class->spans[ZS_ALMOST_EMPTY]);
+			class->nr_spans++;
+		}
+	}
+
+	handle->span = span;
+	handle->idx = alloc_slot(class, span, handle);
+	spin_unlock(&class->lock);
+
+	/* Someone else grew the class meanwhile */
+	if (new)
+		free_span(pool, class, new);
+
+	atomic_long_add(class->size, &pool->obj_bytes);
+	atomic_long_inc(&pool->handles);
+
+	return (unsigned long)handle;
+}
+
+/**
+ * zs_free - free an object
+ * @pool: pool the object was allocated from
+ * @handle: handle returned by zs_malloc()
+ *
+ * The object must not be mapped.
+ */
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	struct zs_handle *h = (struct zs_handle *)handle;
+	struct zs_class *class;
+	struct zs_span *span;
+
+	/* An object never changes class, but its span can go away */
+	bit_spin_lock(0, &h->lock);
+	class = h->span->class;
+	bit_spin_unlock(0, &h->lock);
+
+	spin_lock(&class->lock);
+	span = h->span;
+	free_slot(class, span, h->idx);
+	if (!span->inuse) {
+		list_del(&span->list);
+		class->nr_spans--;
+	} else {
+		fix_fullness(class, span);
+		span = NULL;
+	}
+	spin_unlock(&class->lock);
+
+	if (span)
+		free_span(pool, class, span);
+
+	atomic_long_sub(class->size, &pool->obj_bytes);
+	atomic_long_dec(&pool->handles);
+	kmem_cache_free(zs_handle_cache, h);
+}
+
+/**
+ * zs_map_object - get a pointer to an object
+ * @pool: pool the object was allocated from
+ * @handle: handle returned by zs_malloc()
+ *
+ * The object stays in place until zs_unmap_object(). Like kmap_atomic
+ * this must not sleep in between, and only one object can be mapped at
+ * a time. KM_USER1 is used for the mapping.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle)
+{
+	struct zs_handle *h = (struct zs_handle *)handle;
+	struct zs_map_area *area;
+	struct zs_class *class;
+	u32 offset, off;
+
+	bit_spin_lock(0, &h->lock);
+
+	class = h->span->class;
+	offset = h->idx * class->size;
+	off = offset & ~PAGE_MASK;
+
+	area = per_cpu_ptr(pool->map_area, smp_processor_id());
+	if (off + class->size <= PAGE_SIZE) {
+		area->copied = 0;
+		area->vaddr = kmap_atomic(h->span->pages[offset >> PAGE_SHIFT],
+					KM_USER1);
+		return area->vaddr + off;
+	}
+
+	/* Object straddles two pages, work on a copy */
+	area->copied = 1;
+	copy_from_span(h->span, offset, area->buf, class->size);
+
+	return area->buf;
+}
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	struct zs_handle *h = (struct zs_handle *)handle;
+	struct zs_map_area *area;
+	struct zs_class *class;
+
+	area = per_cpu_ptr(pool->map_area, smp_processor_id());
+	if (!area->copied) {
+		kunmap_atomic(area->vaddr, KM_USER1);
+	} else {
+		class = h->span->class;
+		copy_to_span(h->span, h->idx * class->size, area->buf,
+				class->size);
+	}
+
+	bit_spin_unlock(0, &h->lock);
+}
+
+/*
+ * Move the objects of src into other spans of the class. Objects that
+ * are mapped right now are left alone. Returns 1 if src was emptied
+ * and freed. Caller must hold the class lock.
+ */
+static int migrate_span(struct zs_pool *pool, struct zs_class *class,
+			struct zs_span *src, void *buf)
+{
+	u16 idx;
+	struct zs_span *dst;
+	struct zs_handle *h;
+
+	/* Off the lists, so that src is not picked as a target */
+	list_del(&src->list);
+
+	for (idx = 0; idx < class->objs_per_span && src->inuse; idx++) {
+		if (slot_is_free(src, idx))
+			continue;
+
+		dst = find_span(class);
+		if (!dst)
+			break;
+
+		h = (struct zs_handle *)src->slots[idx];
+		if (!bit_spin_trylock(0, &h->lock))
+			continue;
+
+		copy_from_span(src, idx * class->size, buf, class->size);
+		h->idx = alloc_slot(class, dst, h);
+		h->span = dst;
+		copy_to_span(dst, h->idx * class->size, buf, class->size);
+
+		bit_spin_unlock(0, &h->lock);
+
+		free_slot(class, src, idx);
+		pool->objs_migrated++;
+	}
+
+	if (src->inuse) {
+		src->fullness = get_fullness(class, src);
+		list_add(&src->list, &class->spans[src->fullness]);
+		return 0;
+	}
+
+	class->nr_spans--;
+	free_span(pool, class, src);
+	pool->pages_compacted += class->pages_per_span;
+
+	return 1;
+}
+
+/* Number of whole spans worth of free slots in a class */
+static u32 class_free_spans(struct zs_class *class)
+{
+	return (class->nr_spans * class->objs_per_span - class->nr_objs)
+			/ class->objs_per_span;
+}
+
+/* Caller must hold compact_lock */
+static unsigned long __zs_compact(struct zs_pool *pool)
+{
+	int i;
+	void *buf;
+	u64 freed;
+	struct zs_class *class;
+	struct zs_span *src;
+
+	freed = pool->pages_compacted;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		class = &pool->classes[i];
+
+		spin_lock(&class->lock);
+		while (class_free_spans(class) &&
+				!list_empty(&class->spans[ZS_ALMOST_EMPTY])) {
+			/* Targets are taken from the head */
+			src = list_entry(class->spans[ZS_ALMOST_EMPTY].prev,
+					struct zs_span, list);
+
+			buf = per_cpu_ptr(pool->map_area,
+					smp_processor_id())->buf;
+			if (!migrate_span(pool, class, src, buf))
+				break;
+
+			spin_unlock(&class->lock);
+			cond_resched();
+			spin_lock(&class->lock);
+		}
+		spin_unlock(&class->lock);
+	}
+
+	pool->compactions++;
+
+	return pool->pages_compacted - freed;
+}
+
+/**
+ * zs_compact - release sparsely used spans
+ * @pool: pool to compact
+ *
+ * For every class with at least one span's worth of free slots, the
+ * objects of almost empty spans are moved into other spans and the
+ * emptied spans are freed.
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	unsigned long freed;
+
+	mutex_lock(&pool->compact_lock);
+	freed = __zs_compact(pool);
+	mutex_unlock(&pool->compact_lock);
+
+	return freed;
+}
+
+/* Pages compaction could free right now */
+static unsigned long zs_compactable_pages(struct zs_pool *pool)
+{
+	int i;
+	unsigned long pages = 0;
+	struct zs_class *class;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		class = &pool->classes[i];
+		pages += class_free_spans(class) * class->pages_per_span;
+	}
+
+	return pages;
+}
+
+static int zs_shrink(struct shrinker *shrinker, int nr_to_scan,
+			gfp_t gfp_mask)
+{
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+					shrinker);
+
+	/* Compaction does no I/O and allocates nothing, any context will do */
+	if (nr_to_scan && mutex_trylock(&pool->compact_lock)) {
+		__zs_compact(pool);
+		mutex_unlock(&pool->compact_lock);
+	}
+
+	return min_t(unsigned long, zs_compactable_pages(pool), INT_MAX);
+}
+
+static void free_map_areas(struct zs_pool *pool)
+{
+	int cpu;
+
+	if (!pool->map_area)
+		return;
+
+	for_each_possible_cpu(cpu)
+		free_page((unsigned long)
+			per_cpu_ptr(pool->map_area, cpu)->buf);
+
+	free_percpu(pool->map_area);
+	pool->map_area = NULL;
+}
+
+/*
+ * Create a memory pool. Allocates the size class table and the map
+ * buffers; pages are only allocated as objects are.
+ */
+struct zs_pool *zs_create_pool(void)
+{
+	int i, cpu;
+	u32 size;
+	struct zs_pool *pool;
+	struct zs_class *class;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	if (get_handle_cache()) {
+		kfree(pool);
+		return NULL;
+	}
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		class = &pool->classes[i];
+		size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+
+		spin_lock_init(&class->lock);
+		class->size = size;
+		class->pages_per_span = get_pages_per_span(size);
+		class->objs_per_span = class->pages_per_span * PAGE_SIZE / size;
+		INIT_LIST_HEAD(&class->spans[ZS_ALMOST_FULL]);
+		INIT_LIST_HEAD(&class->spans[ZS_ALMOST_EMPTY]);
+		INIT_LIST_HEAD(&class->spans[ZS_FULL]);
+	}
+
+	pool->map_area = alloc_percpu(struct zs_map_area);
+	if (!pool->map_area)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_map_area *area = per_cpu_ptr(pool->map_area, cpu);
+
+		area->buf = (void *)__get_free_page(GFP_KERNEL);
+		if (!area->buf)
+			goto fail;
+	}
+
+	mutex_init(&pool->compact_lock);
+
+	pool->shrinker.shrink = zs_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
+	return pool;
+
+fail:
+	free_map_areas(pool);
+	put_handle_cache();
+	kfree(pool);
+	return NULL;
+}
+
+/*
+ * All objects must have been freed.
+ */
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i, j;
+	struct zs_class *class;
+	struct zs_span *span, *tmp;
+
+	if (!pool)
+		return;
+
+	unregister_shrinker(&pool->shrinker);
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		class = &pool->classes[i];
+		for (j = 0; j < __NR_ZS_FULLNESS; j++) {
+			list_for_each_entry_safe(span, tmp, &class->spans[j],
+						list) {
+				WARN_ON(span->inuse);
+				free_span(pool, class, span);
+			}
+		}
+	}
+
+	free_map_areas(pool);
+	put_handle_cache();
+	kfree(pool);
+}
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return ((u64)atomic_long_read(&pool->pages) << PAGE_SHIFT) +
+		handle_bytes(pool);
+}
+
+void zs_get_stats(struct zs_pool *pool, struct zs_pool_stats *stats)
+{
+	stats->pages = atomic_long_read(&pool->pages);
+	stats->obj_bytes = atomic_long_read(&pool->obj_bytes);
+	stats->handle_bytes = handle_bytes(pool);
+
+	mutex_lock(&pool->compact_lock);
+	stats->compactions = pool->compactions;
+	stats->objs_migrated = pool->objs_migrated;
+	stats->pages_compacted = pool->pages_compacted;
+	mutex_unlock(&pool->compact_lock);
+}
@@ -0,0 +1,113 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+
+/* User configurable params */
+
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/* Size classes are separated by ZS_SIZE_CLASS_DELTA bytes */
+#define ZS_SIZE_CLASS_DELTA	16
+#define ZS_NR_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) \
+					/ ZS_SIZE_CLASS_DELTA + 1)
+
+/* Upper bound on the number of pages in a span */
+#define ZS_MAX_SPAN_PAGES	4
+
+/*
+ * A span is almost empty (a compaction source) while no more than
+ * 3/4 of its slots are used.
+ */
+#define ZS_FULLNESS_FRAC	4
+
+/* End of user params */
+
+enum zs_fullness {
+	ZS_ALMOST_FULL,
+	ZS_ALMOST_EMPTY,
+	ZS_FULL,
+	__NR_ZS_FULLNESS,
+};
+
+/*
+ * Objects of one size class are packed back to back in a span of
+ * pages_per_span pages, so they may straddle page boundaries. The
+ * pages need not be contiguous. slots[] holds, for each object, the
+ * handle pointing at it, or for a free slot the index of the next
+ * free slot shifted left by one with bit 0 set.
+ */
+struct zs_span {
+	struct list_head list;
+	struct zs_class *class;
+	struct page *pages[ZS_MAX_SPAN_PAGES];
+	u16 inuse;
+	u16 free;		/* first free slot, objs_per_span if none */
+	u8 fullness;
+	unsigned long slots[0];
+};
+
+#define ZS_SLOT_FREE		1UL
+
+/*
+ * Users only see a pointer to this. Compaction moves the object and
+ * updates span and idx under the class lock and the handle's bit lock.
+ */
+struct zs_handle {
+	struct zs_span *span;
+	u16 idx;
+	unsigned long lock;	/* bit 0, held while mapped or migrated */
+};
+
+struct zs_class {
+	spinlock_t lock;
+	u32 size;
+	u16 pages_per_span;
+	u16 objs_per_span;
+	u32 nr_spans;
+	u32 nr_objs;
+	struct list_head spans[__NR_ZS_FULLNESS];
+};
+
+/* Per-cpu state for objects that straddle two pages */
+struct zs_map_area {
+	void *buf;		/* PAGE_SIZE bytes */
+	void *vaddr;		/* kmap_atomic address, if not copied */
+	int copied;
+};
+
+struct zs_pool {
+	struct zs_class classes[ZS_NR_CLASSES];
+	struct zs_map_area *map_area;	/* percpu */
+	struct mutex compact_lock;
+	struct shrinker shrinker;
+
+	/* stats */
+	atomic_long_t pages;
+	atomic_long_t obj_bytes;
+	atomic_long_t handles;
+	u64 compactions;	/* under compact_lock */
+	u64 objs_migrated;
+	u64 pages_compacted;
+};
+
+#endif
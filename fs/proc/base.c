@@ -1035,20 +1035,27 @@ static ssize_t oom_adjust_write(struct file *file, const char __user *buf,
 	task = get_proc_task(file->f_path.dentry->d_inode);
 	if (!task)
 		return -ESRCH;
+	/* the low memory killer's oom_adj index is keyed on this value */
+	write_lock_irq(&tasklist_lock);
 	if (!lock_task_sighand(task, &flags)) {
+		write_unlock_irq(&tasklist_lock);
 		put_task_struct(task);
 		return -ESRCH;
 	}
 
 	if (oom_adjust < task->signal->oom_adj && !capable(CAP_SYS_RESOURCE)) {
 		unlock_task_sighand(task, &flags);
+		write_unlock_irq(&tasklist_lock);
 		put_task_struct(task);
 		return -EACCES;
 	}
 
+	lowmem_adj_tree_del(task->group_leader);
 	task->signal->oom_adj = oom_adjust;
+	lowmem_adj_tree_add(task->group_leader);
 
 	unlock_task_sighand(task, &flags);
+	write_unlock_irq(&tasklist_lock);
 	put_task_struct(task);
 
 	return count;
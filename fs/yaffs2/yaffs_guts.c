@@ -26,6 +26,7 @@
 #include "yaffs_yaffs2.h"
 #include "yaffs_bitmap.h"
 #include "yaffs_verify.h"
+#include "yaffs_summary.h"
 
 #include "yaffs_nand.h"
 #include "yaffs_packedtags2.h"
@@ -37,6 +38,9 @@
 #define YAFFS_GC_GOOD_ENOUGH 2
 #define YAFFS_GC_PASSIVE_THRESHOLD 4
 
+/* Block ages beyond this don't make a block any more attractive to gc */
+#define YAFFS_GC_MAX_AGE (1 << 20)
+
 #include "yaffs_ecc.h"
 
 
@@ -201,6 +205,8 @@ __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo)
 {
 	int i, j;
 
+	YLOCK(&dev->scratchLock);
+
 	dev->tempInUse++;
 	if (dev->tempInUse > dev->maxTemp)
 		dev->maxTemp = dev->tempInUse;
@@ -215,6 +221,7 @@ __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo)
 					    dev->tempBuffer[j].line;
 			}
 
+			YUNLOCK(&dev->scratchLock);
 			return dev->tempBuffer[i].buffer;
 		}
 	}
@@ -233,6 +240,8 @@ __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo)
 	 */
 
 	dev->unmanagedTempAllocations++;
+	YUNLOCK(&dev->scratchLock);
+
 	return YMALLOC(dev->nDataBytesPerChunk);
 
 }
@@ -242,22 +251,29 @@ void yaffs_ReleaseTempBuffer(yaffs_Device *dev, __u8 *buffer,
 {
 	int i;
 
+	YLOCK(&dev->scratchLock);
+
 	dev->tempInUse--;
 
 	for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++) {
 		if (dev->tempBuffer[i].buffer == buffer) {
 			dev->tempBuffer[i].line = 0;
+			YUNLOCK(&dev->scratchLock);
 			return;
 		}
 	}
 
+	if (buffer)
+		dev->unmanagedTempDeallocations++;
+
+	YUNLOCK(&dev->scratchLock);
+
 	if (buffer) {
 		/* assume it is an unmanaged one. */
 		T(YAFFS_TRACE_BUFFERS,
 		  (TSTR("Releasing unmanaged temp buffer in line %d" TENDSTR),
 		   lineNo));
 		YFREE(buffer);
-		dev->unmanagedTempDeallocations++;
 	}
 
 }
@@ -468,6 +484,8 @@ static int yaffs_WriteNewChunkWithTagsToNAND(struct yaffs_DeviceStruct *dev,
 		/* Copy the data into the robustification buffer */
 		yaffs_HandleWriteChunkOk(dev, chunk, data, tags);
 
+		yaffs_SummaryAdd(dev, chunk, tags);
+
 	} while (writeOk != YAFFS_OK &&
 		(yaffs_wr_attempts <= 0 || attempts <= yaffs_wr_attempts));
 
@@ -1894,6 +1912,10 @@ void yaffs_BlockBecameDirty(yaffs_Device *dev, int blockNo)
 	if(blockNo == dev->gcBlock)
 		dev->gcBlock = 0;
 
+	/* Never write a summary into a block that has been erased under it */
+	if (blockNo == dev->summaryBlock)
+		dev->summaryBlock = -1;
+
 	/* If this block is currently the best candidate for gc then drop as a candidate */
 	if(blockNo == dev->gcDirtiest){
 		dev->gcDirtiest = 0;
@@ -1932,6 +1954,11 @@ void yaffs_BlockBecameDirty(yaffs_Device *dev, int blockNo)
 		bi->pagesInUse = 0;
 		bi->softDeletions = 0;
 		bi->hasShrinkHeader = 0;
+		if (bi->hasSummary) {
+			/* The summary chunk is free again */
+			dev->nFreeChunks++;
+			bi->hasSummary = 0;
+		}
 		bi->skipErasedCheck = 1;  /* This is clean, so no need to check */
 		bi->gcPrioritise = 0;
 		yaffs_ClearChunkBits(dev, blockNo);
@@ -1939,7 +1966,9 @@ void yaffs_BlockBecameDirty(yaffs_Device *dev, int blockNo)
 		T(YAFFS_TRACE_ERASE,
 		  (TSTR("Erased block %d" TENDSTR), blockNo));
 	} else {
-		dev->nFreeChunks -= dev->param.nChunksPerBlock;	/* We lost a block of free space */
+		/* We lost a block of free space, less any summary chunk already taken out */
+		dev->nFreeChunks -= dev->param.nChunksPerBlock - bi->hasSummary;
+		bi->hasSummary = 0;
 
 		yaffs_RetireBlock(dev, blockNo);
 		T(YAFFS_TRACE_ERROR | YAFFS_TRACE_BAD_BLOCKS,
@@ -2023,6 +2052,16 @@ static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve,
 		/* Get next block to allocate off */
 		dev->allocationBlock = yaffs_FindBlockForAllocation(dev);
 		dev->allocationPage = 0;
+
+		/* Reserve the last chunk of a fresh block for its summary.
+		 * It stays out of the free count until the block is erased.
+		 */
+		if (dev->allocationBlock >= 0 && dev->summaryEnabled) {
+			bi = yaffs_GetBlockInfo(dev, dev->allocationBlock);
+			bi->hasSummary = 1;
+			dev->nFreeChunks--;
+			yaffs_SummaryStart(dev, dev->allocationBlock);
+		}
 	}
 
 	if (!useReserve && !yaffs_CheckSpaceForAllocation(dev, 1)) {
@@ -2050,7 +2089,7 @@ static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve,
 		dev->nFreeChunks--;
 
 		/* If the block is full set the state to full */
-		if (dev->allocationPage >= dev->param.nChunksPerBlock) {
+		if (dev->allocationPage >= dev->param.nChunksPerBlock - bi->hasSummary) {
 			bi->blockState = YAFFS_BLOCK_STATE_FULL;
 			dev->allocationBlock = -1;
 		}
@@ -2368,14 +2407,44 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 	return retVal;
 }
 
+/*
+ * yaffs_GcScore() rates a block for cost-benefit garbage collection.
+ * Collecting a block frees (nChunksPerBlock - used) chunks at the cost of
+ * reading the whole block and writing the used chunks back. Cold blocks,
+ * those written long ago, are worth more because the data left in them is
+ * unlikely to be deleted soon by itself. Returns
+ *	free * age / (nChunksPerBlock + used)
+ * where the age is how many blocks have been allocated since this one.
+ */
+static unsigned yaffs_GcScore(yaffs_Device *dev, yaffs_BlockInfo *bi,
+				int pagesUsed)
+{
+	unsigned age = 1;
+
+#ifdef CONFIG_YAFFS_YAFFS2
+	if (dev->param.isYaffs2 && dev->sequenceNumber > bi->sequenceNumber)
+		age += dev->sequenceNumber - bi->sequenceNumber;
+#endif
+	if (age > YAFFS_GC_MAX_AGE)
+		age = YAFFS_GC_MAX_AGE;
+
+	return (dev->param.nChunksPerBlock - pagesUsed) * age /
+		(dev->param.nChunksPerBlock + pagesUsed);
+}
+
 /*
  * FindBlockForgarbageCollection is used to select the dirtiest block (or close enough)
  * for garbage collection.
+ *
+ * With costBenefit set, passive gc instead picks the block with the best
+ * yaffs_GcScore() among those dirty enough to pass the threshold.
+ * Aggressive gc always wants the dirtiest block since it needs space now.
  */
 
 static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 					int aggressive,
-					int background)
+					int background,
+					int costBenefit)
 {
 	int i;
 	int iterations;
@@ -2388,6 +2457,7 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 	/* First let's see if we need to grab a prioritised block */
 	if (dev->hasPendingPrioritisedGCs && !aggressive) {
 		dev->gcDirtiest = 0;
+		dev->gcBestScore = 0;
 		bi = dev->blockInfo;
 		for (i = dev->internalStartBlock;
 			i <= dev->internalEndBlock && !selected;
@@ -2427,7 +2497,22 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 
 	if (!selected){
 		int pagesUsed;
+		unsigned score;
 		int nBlocks = dev->internalEndBlock - dev->internalStartBlock + 1;
+
+		if (aggressive)
+			costBenefit = 0;
+
+		/* The candidate from an earlier pass may have changed since */
+		if (dev->gcDirtiest > 0) {
+			bi = yaffs_GetBlockInfo(dev, dev->gcDirtiest);
+			if (bi->blockState != YAFFS_BLOCK_STATE_FULL) {
+				dev->gcDirtiest = 0;
+				dev->gcPagesInUse = 0;
+				dev->gcBestScore = 0;
+			}
+		}
+
 		if (aggressive){
 			threshold = dev->param.nChunksPerBlock;
 			iterations = nBlocks;
@@ -2456,7 +2541,8 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 
 		for (i = 0;
 			i < iterations &&
-			(dev->gcDirtiest < 1 ||
+			(costBenefit ||
+				dev->gcDirtiest < 1 ||
 				dev->gcPagesInUse > YAFFS_GC_GOOD_ENOUGH);
 			i++) {
 			dev->gcBlockFinder++;
@@ -2468,9 +2554,21 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 
 			pagesUsed = bi->pagesInUse - bi->softDeletions;
 
-			if (bi->blockState == YAFFS_BLOCK_STATE_FULL &&
-				pagesUsed < dev->param.nChunksPerBlock &&
-				(dev->gcDirtiest < 1 || pagesUsed < dev->gcPagesInUse) &&
+			if (bi->blockState != YAFFS_BLOCK_STATE_FULL ||
+				pagesUsed >= dev->param.nChunksPerBlock)
+				continue;
+
+			if (costBenefit) {
+				if (pagesUsed > threshold)
+					continue;
+				score = yaffs_GcScore(dev, bi, pagesUsed);
+				if ((dev->gcDirtiest < 1 || score > dev->gcBestScore) &&
+					yaffs2_BlockNotDisqualifiedFromGC(dev, bi)) {
+					dev->gcDirtiest = dev->gcBlockFinder;
+					dev->gcPagesInUse = pagesUsed;
+					dev->gcBestScore = score;
+				}
+			} else if ((dev->gcDirtiest < 1 || pagesUsed < dev->gcPagesInUse) &&
 				yaffs2_BlockNotDisqualifiedFromGC(dev, bi)) {
 				dev->gcDirtiest = dev->gcBlockFinder;
 				dev->gcPagesInUse = pagesUsed;
@@ -2512,6 +2610,7 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 
 		dev->gcDirtiest = 0;
 		dev->gcPagesInUse = 0;
+		dev->gcBestScore = 0;
 		dev->gcNotDone = 0;
 		if(dev->refreshSkip > 0)
 			dev->refreshSkip--;
@@ -2546,9 +2645,12 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev, int background)
 	int minErased;
 	int erasedChunks;
 	int checkpointBlockAdjust;
+	unsigned control = YAFFS_GC_CONTROL_ENABLE;
+
+	if(dev->param.gcControl)
+		control = dev->param.gcControl(dev);
 
-	if(dev->param.gcControl &&
-		(dev->param.gcControl(dev) & 1) == 0)
+	if(!(control & YAFFS_GC_CONTROL_ENABLE))
 		return YAFFS_OK;
 
 	if (dev->gcDisable) {
@@ -2572,6 +2674,12 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev, int background)
 		if (dev->nErasedBlocks < minErased)
 			aggressive = 1;
 		else {
+			/* Passive gc is the background thread's job, keeping
+			 * its cost out of foreground writes.
+			 */
+			if(!background && (control & YAFFS_GC_CONTROL_BG_PASSIVE))
+				break;
+
 			if(!background && erasedChunks > (dev->nFreeChunks / 4))
 				break;
 
@@ -2597,7 +2705,9 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev, int background)
 			dev->nCleanups=0;
 		}
 		if (dev->gcBlock < 1) {
-			dev->gcBlock = yaffs_FindBlockForGarbageCollection(dev, aggressive, background);
+			dev->gcBlock = yaffs_FindBlockForGarbageCollection(dev,
+					aggressive, background,
+					control & YAFFS_GC_CONTROL_COST_BENEFIT);
 			dev->gcChunk = 0;
 			dev->nCleanups=0;
 		}
@@ -3434,8 +3544,8 @@ static void yaffs_InvalidateWholeChunkCache(yaffs_Object *in)
  * Curve-balls: the first chunk might also be the last chunk.
  */
 
-int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
-			int nBytes)
+static int yaffs_ReadDataWorker(yaffs_Object *in, __u8 *buffer, loff_t offset,
+			int nBytes, int shared)
 {
 
 	int chunk;
@@ -3463,7 +3573,17 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 		else
 			nToCopy = dev->nDataBytesPerChunk - start;
 
-		cache = yaffs_FindChunkCache(in, chunk);
+		/* Cache contents only change under exclusive access, but the
+		 * hit count and LRU are shared between parallel readers.
+		 */
+		if (shared) {
+			YLOCK(&dev->scratchLock);
+			cache = yaffs_FindChunkCache(in, chunk);
+			if (cache)
+				yaffs_UseChunkCache(dev, cache, 0);
+			YUNLOCK(&dev->scratchLock);
+		} else
+			cache = yaffs_FindChunkCache(in, chunk);
 
 		/* If the chunk is already in the cache or it is less than a whole chunk
 		 * or we're using inband tags then use the cache (if there is caching)
@@ -3475,6 +3595,10 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 				/* If we can't find the data in the cache, then load it up. */
 
 				if (!cache) {
+					/* Grabbing a cache might flush a dirty one */
+					if (shared)
+						return -1;
+
 					cache = yaffs_GrabChunkCache(in->myDev);
 					cache->object = in;
 					cache->chunkId = chunk;
@@ -3486,14 +3610,18 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 					cache->nBytes = 0;
 				}
 
-				yaffs_UseChunkCache(dev, cache, 0);
+				if (shared) {
+					memcpy(buffer, &cache->data[start], nToCopy);
+				} else {
+					yaffs_UseChunkCache(dev, cache, 0);
 
-				cache->locked = 1;
+					cache->locked = 1;
 
 
-				memcpy(buffer, &cache->data[start], nToCopy);
+					memcpy(buffer, &cache->data[start], nToCopy);
 
-				cache->locked = 0;
+					cache->locked = 0;
+				}
 			} else {
 				/* Read into the local buffer then copy..*/
 
@@ -3526,6 +3654,26 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 	return nDone;
 }
 
+int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
+			int nBytes)
+{
+	return yaffs_ReadDataWorker(in, buffer, offset, nBytes, 0);
+}
+
+/*
+ * yaffs_ReadDataFromFileShared() is for readers that run in parallel with
+ * other readers (but never with writers). It is the same as
+ * yaffs_ReadDataFromFile() except that it will not load the short op cache,
+ * since that can mean writing out a dirty cache entry. If the read needs
+ * the cache loaded it gives up and returns -1; the caller must then retry
+ * with yaffs_ReadDataFromFile() while holding exclusive access.
+ */
+int yaffs_ReadDataFromFileShared(yaffs_Object *in, __u8 *buffer, loff_t offset,
+			int nBytes)
+{
+	return yaffs_ReadDataWorker(in, buffer, offset, nBytes, 1);
+}
+
 int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 			int nBytes, int writeThrough)
 {
@@ -4362,8 +4510,16 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 		in->lazyLoaded ? "not yet" : "already"));
 #endif
 
-	if (in->lazyLoaded && in->hdrChunk > 0) {
-		in->lazyLoaded = 0;
+	if (!in->lazyLoaded || in->hdrChunk <= 0) {
+		/* Pairs with the barrier before lazyLoaded is cleared below */
+		Y_RMB();
+		return;
+	}
+
+	/* Parallel readers can race to load the same object */
+	YMUTEX_LOCK(&dev->lazyLoadLock);
+
+	if (in->lazyLoaded) {
 		chunkData = yaffs_GetTempBuffer(dev, __LINE__);
 
 		result = yaffs_ReadChunkWithTagsFromNAND(dev, in->hdrChunk, chunkData, &tags);
@@ -4396,7 +4552,13 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 		}
 
 		yaffs_ReleaseTempBuffer(dev, chunkData, __LINE__);
+
+		/* Readers that skip the lock must see the details first */
+		Y_WMB();
+		in->lazyLoaded = 0;
 	}
+
+	YMUTEX_UNLOCK(&dev->lazyLoadLock);
 }
 
 /*------------------------------  Directory Functions ----------------------------- */
@@ -5128,6 +5290,10 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 		return YAFFS_FAIL;
 	}
 
+	YLOCK_INIT(&dev->scratchLock);
+	YMUTEX_INIT(&dev->nandReadLock);
+	YMUTEX_INIT(&dev->lazyLoadLock);
+
 	dev->internalStartBlock = dev->param.startBlock;
 	dev->internalEndBlock = dev->param.endBlock;
 	dev->blockOffset = 0;
@@ -5332,6 +5498,9 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 			init_failed = 1;
 	}
 
+	if (!init_failed && !yaffs_SummaryInit(dev))
+		init_failed = 1;
+
 	if (dev->param.isYaffs2)
 		dev->param.useHeaderFileSize = 1;
 
@@ -5441,6 +5610,8 @@ void yaffs_Deinitialise(yaffs_Device *dev)
 
 		YFREE(dev->gcCleanupList);
 
+		yaffs_SummaryDeinit(dev);
+
 		for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++)
 			YFREE(dev->tempBuffer[i].buffer);
 
@@ -5467,7 +5638,7 @@ int yaffs_CountFreeChunks(yaffs_Device *dev)
 		case YAFFS_BLOCK_STATE_FULL:
 			nFree +=
 			    (dev->param.nChunksPerBlock - blk->pagesInUse +
-			     blk->softDeletions);
+			     blk->softDeletions - blk->hasSummary);
 			break;
 		default:
 			break;
@@ -87,6 +87,12 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
+/* Pseudo object id for block summary chunks. This is deliberately above
+ * YAFFS_MAX_OBJECT_ID so that code which does not know about summaries
+ * treats them as chunks with bad tags and ignores them.
+ */
+#define YAFFS_OBJECTID_SUMMARY		0x0FFFFF00
+
 
 #define YAFFS_MAX_SHORT_OP_CACHES	20
 
@@ -289,6 +295,7 @@ typedef struct {
 
 #ifdef CONFIG_YAFFS_YAFFS2
 	__u32 hasShrinkHeader:1; /* This block has at least one shrink object header */
+	__u32 hasSummary:1;	 /* Last chunk is reserved for (or holds) a block summary */
 	__u32 sequenceNumber;	 /* block sequence number for yaffs2 */
 #endif
 
@@ -587,7 +594,7 @@ struct yaffs_DeviceParamStruct {
 	/* Callback to mark the superblock dirty */
 	void (*markSuperBlockDirty)(struct yaffs_DeviceStruct *dev);
 	
-	/*  Callback to control garbage collection. */
+	/*  Callback to control garbage collection. Returns YAFFS_GC_CONTROL_xxx */
 	unsigned (*gcControl)(struct yaffs_DeviceStruct *dev);
 
         /* Debug control flags. Don't use unless you know what you're doing */
@@ -602,10 +609,17 @@ struct yaffs_DeviceParamStruct {
 	int autoUnicode;
 #endif
 	int alwaysCheckErased; /* Force chunk erased check always on */
+
+	int disableSummary;	/* yaffs2 only: Don't write block summary chunks */
 };
 
 typedef struct yaffs_DeviceParamStruct yaffs_DeviceParam;
 
+/* Flags returned by the gcControl callback */
+#define YAFFS_GC_CONTROL_ENABLE		0x01	/* Garbage collection allowed */
+#define YAFFS_GC_CONTROL_BG_PASSIVE	0x02	/* Leave passive gc to a background thread */
+#define YAFFS_GC_CONTROL_COST_BENEFIT	0x04	/* Pick passive gc victims by cost-benefit */
+
 struct yaffs_DeviceStruct {
 	struct yaffs_DeviceParamStruct param;
 
@@ -701,6 +715,7 @@ struct yaffs_DeviceStruct {
 	unsigned gcBlockFinder;
 	unsigned gcDirtiest;
 	unsigned gcPagesInUse;
+	unsigned gcBestScore;	/* Cost-benefit score of gcDirtiest */
 	unsigned gcNotDone;
 	unsigned gcBlock;
 	unsigned gcChunk;
@@ -729,6 +744,14 @@ struct yaffs_DeviceStruct {
 	int nUnlinkedFiles;		/* Count of unlinked files. */
 	int nBackgroundDeletions;	/* Count of background deletions. */
 
+	/* Parallel reader support. The OS layer may let several readers
+	 * into the guts at once (see yaffs_ReadDataFromFileShared()); these
+	 * protect the device state that reading still modifies.
+	 */
+	YLOCK_T scratchLock;	/* Temp buffer pool and short op cache LRU */
+	YMUTEX_T nandReadLock;	/* NAND reads: driver spare buffers, ECC marks */
+	YMUTEX_T lazyLoadLock;	/* Loading details of lazy loaded objects */
+
 	/* Temporary buffer management */
 	yaffs_TempBuffer tempBuffer[YAFFS_N_TEMP_BUFFERS];
 	int maxTemp;
@@ -747,6 +770,11 @@ struct yaffs_DeviceStruct {
 	/* Dirty directory handling */
 	struct ylist_head dirtyDirectories; /* List of dirty directories */
 
+	/* Block summaries */
+	int summaryEnabled;	/* Writing summaries on this device */
+	int summaryBlock;	/* Block whose summary is being built, or -1 */
+	struct yaffs_SummaryTagsStruct *summaryTags; /* One entry per data chunk */
+
 
 	/* Statistcs */
 	__u32 nPageWrites;
@@ -769,6 +797,8 @@ struct yaffs_DeviceStruct {
 	__u32 nUnmarkedDeletions;
 	__u32 refreshCount;
 	__u32 cacheHits;
+	__u32 nSummaryWrites;
+	__u32 nSummaryScans;
 
 };
 
@@ -855,6 +885,8 @@ int yaffs_GetAttributes(yaffs_Object *obj, struct iattr *attr);
 /* File operations */
 int yaffs_ReadDataFromFile(yaffs_Object *obj, __u8 *buffer, loff_t offset,
 				int nBytes);
+int yaffs_ReadDataFromFileShared(yaffs_Object *obj, __u8 *buffer,
+				loff_t offset, int nBytes);
 int yaffs_WriteDataToFile(yaffs_Object *obj, const __u8 *buffer, loff_t offset,
 				int nBytes, int writeThrough);
 int yaffs_ResizeFile(yaffs_Object *obj, loff_t newSize);
@@ -25,14 +25,15 @@ struct yaffs_LinuxContext {
 	struct super_block * superBlock;
 	struct task_struct *bgThread; /* Background thread for this device */
 	int bgRunning;
-        struct semaphore grossLock;     /* Gross locking semaphore */
+	int bgKicked;	/* Foreground wants gc now; under grossLock */
+	struct rw_semaphore grossLock;	/* Shared for reads, else exclusive */
 	__u8 *spareBuffer;      /* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 				 */
 	struct ylist_head searchContexts;
+	spinlock_t searchLock;	/* Guards searchContexts between readdirs */
 	void (*putSuperFunc)(struct super_block *sb);
 
-	struct task_struct *readdirProcess;
 	unsigned mount_id;
 };
 
@@ -26,12 +26,17 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 
 	int realignedChunkInNAND = chunkInNAND - dev->chunkOffset;
 
-	dev->nPageReads++;
-
 	/* If there are no tags provided, use local tags to get prioritised gc working */
 	if (!tags)
 		tags = &localTags;
 
+	/* Drivers read through per-device spare buffers, so parallel
+	 * readers take turns here. The flash serialises them anyway.
+	 */
+	YMUTEX_LOCK(&dev->nandReadLock);
+
+	dev->nPageReads++;
+
 	if (dev->param.readChunkWithTagsFromNAND)
 		result = dev->param.readChunkWithTagsFromNAND(dev, realignedChunkInNAND, buffer,
 						      tags);
@@ -48,6 +53,8 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		yaffs_HandleChunkError(dev, bi);
 	}
 
+	YMUTEX_UNLOCK(&dev->nandReadLock);
+
 	return result;
 }
 
@@ -0,0 +1,269 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2010 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Block summaries.
+ *
+ * When summaries are enabled the last chunk of each block is reserved.
+ * While a block is being filled the tags of each chunk written are
+ * collected in RAM, and once the last data chunk has been written they
+ * are written out to the reserved chunk. A backwards scan can then get
+ * the tags of all the data chunks in a block from one read instead of
+ * reading the tags of each chunk.
+ *
+ * Summaries are only an optimisation. Blocks that were not filled in
+ * one go (the block being allocated at unmount, blocks skipped after a
+ * write error, blocks written by code that knows nothing about summaries)
+ * have no summary and are scanned the old way.
+ *
+ * The tags in a summary are protected by the ECC of the summary chunk,
+ * not by the ECC of the chunks they describe. That costs nothing the old
+ * scan had: a backwards scan only reads tags, so the ECC of data areas
+ * was never checked at mount time and still is checked when the data is
+ * read. Blocks that show ECC trouble while their summary is being read
+ * are scanned chunk by chunk anyway, so that every chunk's tags go
+ * through the usual error handling.
+ */
+
+#include "yaffs_summary.h"
+#include "yaffs_trace.h"
+#include "yaffs_nand.h"
+#include "yaffs_tagsvalidity.h"
+#include "yaffs_getblockinfo.h"
+
+#define YAFFS_SUMMARY_MAGIC	0x5953554D	/* "YSUM" */
+
+typedef struct {
+	__u32 magic;
+	__u32 sequenceNumber;
+	__u32 nEntries;
+	__u32 sum;
+} yaffs_SummaryHeader;
+
+static int yaffs_SummaryEntries(yaffs_Device *dev)
+{
+	return dev->param.nChunksPerBlock - 1;
+}
+
+static int yaffs_SummaryBytes(yaffs_Device *dev)
+{
+	return sizeof(yaffs_SummaryHeader) +
+		yaffs_SummaryEntries(dev) * sizeof(yaffs_SummaryTags);
+}
+
+static __u32 yaffs_SummarySum(const yaffs_SummaryTags *st, int nEntries)
+{
+	const __u32 *w = (const __u32 *)st;
+	int nWords = nEntries * sizeof(yaffs_SummaryTags) / sizeof(__u32);
+	__u32 sum = 0;
+	int i;
+
+	for (i = 0; i < nWords; i++)
+		sum = ((sum << 1) | (sum >> 31)) + w[i];
+
+	return sum;
+}
+
+int yaffs_SummaryInit(yaffs_Device *dev)
+{
+	dev->summaryEnabled = 0;
+	dev->summaryBlock = -1;
+	dev->summaryTags = NULL;
+
+	if (!dev->param.isYaffs2 || dev->param.disableSummary)
+		return YAFFS_OK;
+
+	if (yaffs_SummaryBytes(dev) > dev->nDataBytesPerChunk) {
+		T(YAFFS_TRACE_ALWAYS,
+		  (TSTR("yaffs: %d chunks per block is too many for a summary,"
+		  " summaries disabled" TENDSTR), dev->param.nChunksPerBlock));
+		return YAFFS_OK;
+	}
+
+	dev->summaryTags = YMALLOC(yaffs_SummaryEntries(dev) *
+					sizeof(yaffs_SummaryTags));
+	if (!dev->summaryTags)
+		return YAFFS_FAIL;
+
+	dev->summaryEnabled = 1;
+
+	return YAFFS_OK;
+}
+
+void yaffs_SummaryDeinit(yaffs_Device *dev)
+{
+	if (dev->summaryTags)
+		YFREE(dev->summaryTags);
+	dev->summaryTags = NULL;
+	dev->summaryEnabled = 0;
+	dev->summaryBlock = -1;
+}
+
+/*
+ * Called when allocation starts on a fresh block.
+ */
+void yaffs_SummaryStart(yaffs_Device *dev, int blk)
+{
+	if (!dev->summaryEnabled)
+		return;
+
+	memset(dev->summaryTags, 0,
+		yaffs_SummaryEntries(dev) * sizeof(yaffs_SummaryTags));
+	dev->summaryBlock = blk;
+}
+
+static void yaffs_SummaryWrite(yaffs_Device *dev, int blk)
+{
+	yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, blk);
+	yaffs_SummaryHeader *hdr;
+	yaffs_ExtendedTags tags;
+	int nEntries = yaffs_SummaryEntries(dev);
+	int chunk = blk * dev->param.nChunksPerBlock + nEntries;
+	__u8 *buffer;
+
+	/* The summary is tagged with the current sequence number, so it
+	 * must still be the one this block was allocated with.
+	 */
+	if (bi->sequenceNumber != dev->sequenceNumber)
+		return;
+
+	buffer = yaffs_GetTempBuffer(dev, __LINE__);
+
+	memset(buffer, 0xff, dev->nDataBytesPerChunk);
+	hdr = (yaffs_SummaryHeader *)buffer;
+	hdr->magic = YAFFS_SUMMARY_MAGIC;
+	hdr->sequenceNumber = bi->sequenceNumber;
+	hdr->nEntries = nEntries;
+	hdr->sum = yaffs_SummarySum(dev->summaryTags, nEntries);
+	memcpy(buffer + sizeof(yaffs_SummaryHeader), dev->summaryTags,
+		nEntries * sizeof(yaffs_SummaryTags));
+
+	yaffs_InitialiseTags(&tags);
+	tags.objectId = YAFFS_OBJECTID_SUMMARY;
+	tags.chunkId = 1;
+	tags.byteCount = yaffs_SummaryBytes(dev);
+
+	/* counted even if it fails, as nPageWrites is */
+	dev->nSummaryWrites++;
+	if (yaffs_WriteChunkWithTagsToNAND(dev, chunk, buffer, &tags) != YAFFS_OK)
+		T(YAFFS_TRACE_ERROR,
+		  (TSTR("**>> yaffs failed to write summary for block %d"
+		  TENDSTR), blk));
+
+	yaffs_ReleaseTempBuffer(dev, buffer, __LINE__);
+}
+
+/*
+ * Called after a chunk has been written successfully. Once the last data
+ * chunk of the block is in, the summary is written.
+ */
+void yaffs_SummaryAdd(yaffs_Device *dev, int chunkInNAND,
+			const yaffs_ExtendedTags *tags)
+{
+	int blk = chunkInNAND / dev->param.nChunksPerBlock;
+	int c = chunkInNAND % dev->param.nChunksPerBlock;
+	int nEntries = yaffs_SummaryEntries(dev);
+	yaffs_SummaryTags *st;
+
+	if (!dev->summaryEnabled || blk != dev->summaryBlock || c >= nEntries)
+		return;
+
+	st = &dev->summaryTags[c];
+	st->objectId = tags->objectId;
+	st->chunkId = tags->chunkId;
+	st->byteCount = tags->byteCount;
+
+	if (c == nEntries - 1) {
+		yaffs_SummaryWrite(dev, blk);
+		dev->summaryBlock = -1;
+	}
+}
+
+/*
+ * Read the summary of a block during scanning.
+ * The tags of the last chunk are always returned in tags so that the
+ * caller does not have to read them again if there is no summary.
+ * Returns the summary entries (held in buffer) or NULL.
+ */
+const yaffs_SummaryTags *yaffs_SummaryRead(yaffs_Device *dev, int blk,
+			__u8 *buffer, yaffs_ExtendedTags *tags)
+{
+	yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, blk);
+	yaffs_SummaryHeader *hdr = (yaffs_SummaryHeader *)buffer;
+	yaffs_ExtendedTags dataTags;
+	const yaffs_SummaryTags *st;
+	int nEntries = yaffs_SummaryEntries(dev);
+	int chunk = blk * dev->param.nChunksPerBlock + nEntries;
+
+	/* Tags first, so blocks without a summary only pay for a tags read */
+	yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL, tags);
+
+	if (!tags->chunkUsed ||
+	    tags->eccResult == YAFFS_ECC_RESULT_UNFIXED ||
+	    tags->objectId != YAFFS_OBJECTID_SUMMARY ||
+	    tags->sequenceNumber != bi->sequenceNumber ||
+	    yaffs_SummaryBytes(dev) > dev->nDataBytesPerChunk)
+		return NULL;
+
+	if (yaffs_ReadChunkWithTagsFromNAND(dev, chunk, buffer, &dataTags) != YAFFS_OK ||
+	    dataTags.eccResult == YAFFS_ECC_RESULT_UNFIXED)
+		return NULL;
+
+	/* Either read above may have hit a (corrected) ECC error */
+	if (bi->gcPrioritise || bi->chunkErrorStrikes) {
+		T(YAFFS_TRACE_SCAN,
+		  (TSTR("Block %d has ECC errors, summary not used" TENDSTR),
+		  blk));
+		return NULL;
+	}
+
+	st = (const yaffs_SummaryTags *)(buffer + sizeof(yaffs_SummaryHeader));
+
+	if (hdr->magic != YAFFS_SUMMARY_MAGIC ||
+	    hdr->sequenceNumber != bi->sequenceNumber ||
+	    hdr->nEntries != nEntries ||
+	    hdr->sum != yaffs_SummarySum(st, nEntries)) {
+		T(YAFFS_TRACE_SCAN,
+		  (TSTR("Block %d has a bad summary" TENDSTR), blk));
+		return NULL;
+	}
+
+	dev->nSummaryScans++;
+
+	return st;
+}
+
+/*
+ * Turn a summary entry into the tags the scanner would have read.
+ * Only data chunks are taken from the summary; object headers carry
+ * extra information in their tags so those are still read from NAND.
+ * Returns 1 if tags were filled in.
+ */
+int yaffs_SummaryGetTags(yaffs_Device *dev, const yaffs_SummaryTags *st,
+			int blk, yaffs_ExtendedTags *tags)
+{
+	yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, blk);
+
+	if (st->objectId == 0 || st->chunkId == 0)
+		return 0;
+
+	yaffs_InitialiseTags(tags);
+	tags->chunkUsed = 1;
+	tags->eccResult = YAFFS_ECC_RESULT_NO_ERROR;
+	tags->objectId = st->objectId;
+	tags->chunkId = st->chunkId;
+	tags->byteCount = st->byteCount;
+	tags->sequenceNumber = bi->sequenceNumber;
+
+	return 1;
+}
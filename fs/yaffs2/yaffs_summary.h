@@ -0,0 +1,40 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2010 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Block summaries for yaffs2
+ */
+
+#ifndef __YAFFS_SUMMARY_H__
+#define __YAFFS_SUMMARY_H__
+
+#include "yaffs_guts.h"
+
+/* One summary entry per data chunk in a block, as stored on NAND. */
+typedef struct yaffs_SummaryTagsStruct {
+	__u32 objectId;
+	__u32 chunkId;
+	__u32 byteCount;
+} yaffs_SummaryTags;
+
+int yaffs_SummaryInit(yaffs_Device *dev);
+void yaffs_SummaryDeinit(yaffs_Device *dev);
+void yaffs_SummaryStart(yaffs_Device *dev, int blk);
+void yaffs_SummaryAdd(yaffs_Device *dev, int chunkInNAND,
+			const yaffs_ExtendedTags *tags);
+const yaffs_SummaryTags *yaffs_SummaryRead(yaffs_Device *dev, int blk,
+			__u8 *buffer, yaffs_ExtendedTags *tags);
+int yaffs_SummaryGetTags(yaffs_Device *dev, const yaffs_SummaryTags *st,
+			int blk, yaffs_ExtendedTags *tags);
+
+#endif
@@ -174,7 +174,10 @@ unsigned int yaffs_traceMask = YAFFS_TRACE_BAD_BLOCKS | YAFFS_TRACE_ALWAYS;
 unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
+unsigned int yaffs_gc_cost_benefit = 1;
 unsigned int yaffs_bg_enable = 1;
+unsigned int yaffs_bg_passive_gc = 1;
+unsigned int yaffs_bg_idle_passes = 16;
 
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
@@ -182,12 +185,18 @@ module_param(yaffs_traceMask, uint, 0644);
 module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
+module_param(yaffs_gc_cost_benefit, uint, 0644);
 module_param(yaffs_bg_enable, uint, 0644);
+module_param(yaffs_bg_passive_gc, uint, 0644);
+module_param(yaffs_bg_idle_passes, uint, 0644);
 #else
 MODULE_PARM(yaffs_traceMask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
 MODULE_PARM(yaffs_auto_checkpoint, "i");
 MODULE_PARM(yaffs_gc_control, "i");
+MODULE_PARM(yaffs_gc_cost_benefit, "i");
+MODULE_PARM(yaffs_bg_passive_gc, "i");
+MODULE_PARM(yaffs_bg_idle_passes, "i");
 #endif
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
@@ -507,22 +516,69 @@ static  int yaffs_vfs_setsize(struct inode *inode, loff_t newsize)
 
 }
 
+static unsigned yaffs_bg_gc_urgency(yaffs_Device *dev);
+
+/*
+ * Called by the guts before each garbage collection attempt.
+ * yaffs_gc_cost_benefit selects victims by age as well as dirtiness.
+ * While the background thread runs, yaffs_bg_passive_gc leaves it all
+ * passive gc so that foreground writes only collect when short of space.
+ * A writer that finds gc falling behind kicks the thread.
+ */
 static unsigned yaffs_gc_control_callback(yaffs_Device *dev)
 {
-	return yaffs_gc_control;
+	struct yaffs_LinuxContext *context = yaffs_DeviceToLC(dev);
+	unsigned control = yaffs_gc_control;
+
+	if (yaffs_gc_cost_benefit)
+		control |= YAFFS_GC_CONTROL_COST_BENEFIT;
+
+	if (yaffs_bg_enable && yaffs_bg_passive_gc && context->bgThread) {
+		control |= YAFFS_GC_CONTROL_BG_PASSIVE;
+
+		if (current != context->bgThread && !context->bgKicked &&
+		    yaffs_bg_gc_urgency(dev) > 1) {
+			context->bgKicked = 1;
+			wake_up_process(context->bgThread);
+		}
+	}
+
+	return control;
 }
                 	                                                                                          	
+/*
+ * The gross lock is a reader/writer semaphore. Anything that can write to
+ * the device - allocation, gc, object header and data writes, deletion -
+ * takes it exclusively through yaffs_GrossLock(). The pure read paths
+ * (readpage, lookup and readdir) take it shared through yaffs_SharedLock()
+ * and so run in parallel with each other. The bits of device state that
+ * those paths still modify are protected by finer locks in the guts; see
+ * yaffs_ReadDataFromFileShared().
+ */
 static void yaffs_GrossLock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locking %p\n"), current));
-	down(&(yaffs_DeviceToLC(dev)->grossLock));
+	down_write(&(yaffs_DeviceToLC(dev)->grossLock));
 	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locked %p\n"), current));
 }
 
 static void yaffs_GrossUnlock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_LOCK, (TSTR("yaffs unlocking %p\n"), current));
-	up(&(yaffs_DeviceToLC(dev)->grossLock));
+	up_write(&(yaffs_DeviceToLC(dev)->grossLock));
+}
+
+static void yaffs_SharedLock(yaffs_Device *dev)
+{
+	T(YAFFS_TRACE_LOCK, (TSTR("yaffs shared locking %p\n"), current));
+	down_read(&(yaffs_DeviceToLC(dev)->grossLock));
+	T(YAFFS_TRACE_LOCK, (TSTR("yaffs shared locked %p\n"), current));
+}
+
+static void yaffs_SharedUnlock(yaffs_Device *dev)
+{
+	T(YAFFS_TRACE_LOCK, (TSTR("yaffs shared unlocking %p\n"), current));
+	up_read(&(yaffs_DeviceToLC(dev)->grossLock));
 }
 
 #ifdef YAFFS_COMPILE_EXPORTFS
@@ -607,7 +663,10 @@ static struct export_operations yaffs_export_ops =
  *
  * A seach context lives for the duration of a readdir.
  *
- * All these functions must be called while yaffs is locked.
+ * All these functions must be called while yaffs is locked. Since readdir
+ * only holds the lock shared, creating and disposing of a search context
+ * also takes searchLock. yaffs_RemoveObjectCallback() runs with the lock
+ * held exclusively so it needs nothing more.
  */
 
 struct yaffs_SearchContext {
@@ -637,7 +696,9 @@ static struct yaffs_SearchContext * yaffs_NewSearch(yaffs_Object *dir)
                                 dir->variant.directoryVariant.children.next,
 				yaffs_Object,siblings);
 		YINIT_LIST_HEAD(&sc->others);
+		spin_lock(&yaffs_DeviceToLC(dev)->searchLock);
 		ylist_add(&sc->others,&(yaffs_DeviceToLC(dev)->searchContexts));
+		spin_unlock(&yaffs_DeviceToLC(dev)->searchLock);
 	}
 	return sc;
 }
@@ -648,7 +709,9 @@ static struct yaffs_SearchContext * yaffs_NewSearch(yaffs_Object *dir)
 static void yaffs_EndSearch(struct yaffs_SearchContext * sc)
 {
 	if(sc){
+		spin_lock(&yaffs_DeviceToLC(sc->dev)->searchLock);
 		ylist_del(&sc->others);
+		spin_unlock(&yaffs_DeviceToLC(sc->dev)->searchLock);
 		YFREE(sc);
 	}
 }
@@ -786,8 +849,7 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 
 	yaffs_Device *dev = yaffs_InodeToObject(dir)->myDev;
 
-	if(current != yaffs_DeviceToLC(dev)->readdirProcess)
-		yaffs_GrossLock(dev);
+	yaffs_SharedLock(dev);
 
 	T(YAFFS_TRACE_OS,
 		(TSTR("yaffs_lookup for %d:%s\n"),
@@ -799,8 +861,7 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 	obj = yaffs_GetEquivalentObject(obj);	/* in case it was a hardlink */
 
 	/* Can't hold gross lock when calling yaffs_get_inode() */
-	if(current != yaffs_DeviceToLC(dev)->readdirProcess)
-		yaffs_GrossUnlock(dev);
+	yaffs_SharedUnlock(dev);
 
 	if (obj) {
 		T(YAFFS_TRACE_OS,
@@ -1014,13 +1075,24 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_GrossLock(dev);
+	yaffs_SharedLock(dev);
 
-	ret = yaffs_ReadDataFromFile(obj, pg_buf,
+	ret = yaffs_ReadDataFromFileShared(obj, pg_buf,
 				pg->index << PAGE_CACHE_SHIFT,
 				PAGE_CACHE_SIZE);
 
-	yaffs_GrossUnlock(dev);
+	yaffs_SharedUnlock(dev);
+
+	if (ret < 0) {
+		/* Needs the short op cache loaded, which may write */
+		yaffs_GrossLock(dev);
+
+		ret = yaffs_ReadDataFromFile(obj, pg_buf,
+					pg->index << PAGE_CACHE_SHIFT,
+					PAGE_CACHE_SIZE);
+
+		yaffs_GrossUnlock(dev);
+	}
 
 	if (ret >= 0)
 		ret = 0;
@@ -1575,9 +1647,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 	obj = yaffs_DentryToObject(f->f_dentry);
 	dev = obj->myDev;
 
-	yaffs_GrossLock(dev);
-
-	yaffs_DeviceToLC(dev)->readdirProcess = current;
+	yaffs_SharedLock(dev);
 
 	offset = f->f_pos;
 
@@ -1593,12 +1663,12 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		T(YAFFS_TRACE_OS,
 			(TSTR("yaffs_readdir: entry . ino %d \n"),
 			(int)inode->i_ino));
-		yaffs_GrossUnlock(dev);
+		yaffs_SharedUnlock(dev);
 		if (filldir(dirent, ".", 1, offset, inode->i_ino, DT_DIR) < 0){
-			yaffs_GrossLock(dev);
+			yaffs_SharedLock(dev);
 			goto out;
 		}
-		yaffs_GrossLock(dev);
+		yaffs_SharedLock(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -1606,13 +1676,13 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		T(YAFFS_TRACE_OS,
 			(TSTR("yaffs_readdir: entry .. ino %d \n"),
 			(int)f->f_dentry->d_parent->d_inode->i_ino));
-		yaffs_GrossUnlock(dev);
+		yaffs_SharedUnlock(dev);
 		if (filldir(dirent, "..", 2, offset,
 			f->f_dentry->d_parent->d_inode->i_ino, DT_DIR) < 0){
-			yaffs_GrossLock(dev);
+			yaffs_SharedLock(dev);
 			goto out;
 		}
-		yaffs_GrossLock(dev);
+		yaffs_SharedLock(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -1640,7 +1710,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 			  (TSTR("yaffs_readdir: %s inode %d\n"),
 			  name, yaffs_GetObjectInode(l)));
 
-                        yaffs_GrossUnlock(dev);
+                        yaffs_SharedUnlock(dev);
 
 			if (filldir(dirent,
 					name,
@@ -1648,11 +1718,11 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 					offset,
 					this_inode,
 					this_type) < 0){
-				yaffs_GrossLock(dev);
+				yaffs_SharedLock(dev);
 				goto out;
 			}
 
-                        yaffs_GrossLock(dev);
+                        yaffs_SharedLock(dev);
 
 			offset++;
 			f->f_pos++;
@@ -1662,8 +1732,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 
 out:
 	yaffs_EndSearch(sc);
-	yaffs_DeviceToLC(dev)->readdirProcess = NULL;
-	yaffs_GrossUnlock(dev);
+	yaffs_SharedUnlock(dev);
 
 	return retVal;
 }
@@ -2312,6 +2381,43 @@ void yaffs_background_waker(unsigned long data)
 	wake_up_process((struct task_struct *)data);
 }
 
+/*
+ * Chunks written other than by gc, to tell when the device is idle. gc
+ * filling a block also writes its summary chunk, so those do not count.
+ */
+static __u32 yaffs_bg_fg_writes(yaffs_Device *dev)
+{
+	return dev->nPageWrites - dev->nGCCopies - dev->nSummaryWrites;
+}
+
+/*
+ * yaffs_bg_idle_gc() carries on with gc while nothing else writes to the
+ * device, one pass (a few chunks) at a time. The lock is dropped between
+ * passes so that readers and writers are never held up for more than one
+ * pass. Called and returns with the gross lock held.
+ */
+static void yaffs_bg_idle_gc(yaffs_Device *dev, unsigned urgency)
+{
+	unsigned passes;
+	__u32 writes;
+
+	for (passes = 1; passes < yaffs_bg_idle_passes && urgency > 0; passes++) {
+		writes = yaffs_bg_fg_writes(dev);
+
+		yaffs_GrossUnlock(dev);
+		cond_resched();
+		yaffs_GrossLock(dev);
+
+		if (kthread_should_stop() || !yaffs_bg_enable ||
+		    dev->isCheckpointed || yaffs_bg_fg_writes(dev) != writes)
+			break;
+
+		urgency = yaffs_bg_gc_urgency(dev);
+		if (urgency > 0)
+			yaffs_BackgroundGarbageCollect(dev, urgency);
+	}
+}
+
 static int yaffs_BackgroundThread(void *data)
 {
 	yaffs_Device *dev = (yaffs_Device *)data;
@@ -2321,6 +2427,9 @@ static int yaffs_BackgroundThread(void *data)
 	unsigned long next_gc = now;
 	unsigned long expires;
 	unsigned int urgency;
+	__u32 last_writes = 0;
+	int idle;
+	int kicked;
 
 	int gcResult;
 	struct timer_list timer;
@@ -2347,15 +2456,23 @@ static int yaffs_BackgroundThread(void *data)
 
 		now = jiffies;
 
+		/* Nothing but us has written since we last looked */
+		idle = (yaffs_bg_fg_writes(dev) == last_writes);
+		kicked = context->bgKicked;
+		context->bgKicked = 0;
+
 		if(time_after(now, next_dir_update) && yaffs_bg_enable){
 			yaffs_UpdateDirtyDirectories(dev);
 			next_dir_update = now + HZ;
 		}
 
-		if(time_after(now,next_gc) && yaffs_bg_enable){
+		if((kicked || time_after(now,next_gc)) && yaffs_bg_enable){
 			if(!dev->isCheckpointed){
 				urgency = yaffs_bg_gc_urgency(dev);
 				gcResult = yaffs_BackgroundGarbageCollect(dev, urgency);
+				if(idle)
+					yaffs_bg_idle_gc(dev, urgency);
+				urgency = yaffs_bg_gc_urgency(dev);
 				if(urgency > 1)
 					next_gc = now + HZ/20+1;
 				else if(urgency > 0)
@@ -2368,6 +2485,7 @@ static int yaffs_BackgroundThread(void *data)
 				*/
 				next_gc = next_dir_update;
 		}
+		last_writes = yaffs_bg_fg_writes(dev);
 		yaffs_GrossUnlock(dev);
 #if 1
 		expires = next_dir_update;
@@ -2383,7 +2501,10 @@ static int yaffs_BackgroundThread(void *data)
 
                 set_current_state(TASK_INTERRUPTIBLE);
 		add_timer(&timer);
-		schedule();
+		if (context->bgKicked)
+			__set_current_state(TASK_RUNNING);
+		else
+			schedule();
 		del_timer_sync(&timer);
 #else
 		msleep(10);
@@ -2528,15 +2649,13 @@ static void yaffs_read_inode(struct inode *inode)
 	T(YAFFS_TRACE_OS,
 		(TSTR("yaffs_read_inode for %d\n"), (int)inode->i_ino));
 
-	if(current != yaffs_DeviceToLC(dev)->readdirProcess)
-		yaffs_GrossLock(dev);
+	yaffs_GrossLock(dev);
 
 	obj = yaffs_FindObjectByNumber(dev, inode->i_ino);
 
 	yaffs_FillInodeFromObject(inode, obj);
 
-	if(current != yaffs_DeviceToLC(dev)->readdirProcess)
-		yaffs_GrossUnlock(dev);
+	yaffs_GrossUnlock(dev);
 }
 
 #endif
@@ -2612,6 +2731,8 @@ typedef struct {
 	int lazy_loading_overridden;
 	int empty_lost_and_found;
 	int empty_lost_and_found_overridden;
+	int summary_enabled;
+	int summary_overridden;
 } yaffs_options;
 
 #define MAX_OPT_LEN 30
@@ -2658,6 +2779,12 @@ static int yaffs_parse_options(yaffs_options *options, const char *options_str)
 		} else if (!strcmp(cur_opt, "empty-lost-and-found-on")){
 			options->empty_lost_and_found = 1;
 			options->empty_lost_and_found_overridden=1;
+		} else if (!strcmp(cur_opt, "summary-off")){
+			options->summary_enabled = 0;
+			options->summary_overridden = 1;
+		} else if (!strcmp(cur_opt, "summary-on")){
+			options->summary_enabled = 1;
+			options->summary_overridden = 1;
 		} else if (!strcmp(cur_opt, "no-cache"))
 			options->no_cache = 1;
 		else if (!strcmp(cur_opt, "no-checkpoint-read"))
@@ -2957,6 +3084,12 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	if(options.empty_lost_and_found_overridden)
 		param->emptyLostAndFound = options.empty_lost_and_found;
 
+#ifdef CONFIG_YAFFS_DISABLE_SUMMARY
+	param->disableSummary = 1;
+#endif
+	if(options.summary_overridden)
+		param->disableSummary = !options.summary_enabled;
+
 	/* ... and the functions. */
 	if (yaffsVersion == 2) {
 		param->writeChunkWithTagsToNAND =
@@ -3034,9 +3167,10 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 
         /* Directory search handling...*/
         YINIT_LIST_HEAD(&(yaffs_DeviceToLC(dev)->searchContexts));
+	spin_lock_init(&(yaffs_DeviceToLC(dev)->searchLock));
         param->removeObjectCallback = yaffs_RemoveObjectCallback;
 
-	init_MUTEX(&(yaffs_DeviceToLC(dev)->grossLock));
+	init_rwsem(&(yaffs_DeviceToLC(dev)->grossLock));
 
 	yaffs_GrossLock(dev);
 
@@ -3200,6 +3334,7 @@ static char *yaffs_dump_dev_part0(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "nShortOpCaches..... %d\n", dev->param.nShortOpCaches);
 	buf += sprintf(buf, "nReservedBlocks.... %d\n", dev->param.nReservedBlocks);
 	buf += sprintf(buf, "alwaysCheckErased.. %d\n", dev->param.alwaysCheckErased);
+	buf += sprintf(buf, "disableSummary..... %d\n", dev->param.disableSummary);
 
 	buf += sprintf(buf, "\n");
 
@@ -3238,6 +3373,8 @@ static char *yaffs_dump_dev_part1(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "nDeletedFiles...... %u\n", dev->nDeletedFiles);
 	buf += sprintf(buf, "nUnlinkedFiles..... %u\n", dev->nUnlinkedFiles);
 	buf += sprintf(buf, "refreshCount....... %u\n", dev->refreshCount);
+	buf += sprintf(buf, "nSummaryWrites..... %u\n", dev->nSummaryWrites);
+	buf += sprintf(buf, "nSummaryScans...... %u\n", dev->nSummaryScans);
 	buf +=
 	    sprintf(buf, "nBackgroudDeletions %u\n", dev->nBackgroundDeletions);
 
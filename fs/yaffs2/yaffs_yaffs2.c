@@ -21,6 +21,7 @@
 #include "yaffs_nand.h"
 #include "yaffs_getblockinfo.h"
 #include "yaffs_verify.h"
+#include "yaffs_summary.h"
 
 /*
  * Checkpoints are really no benefit on very small partitions.
@@ -932,6 +933,10 @@ int yaffs2_ScanBackwards(yaffs_Device *dev)
 	int nBlocks = dev->internalEndBlock - dev->internalStartBlock + 1;
 	int itsUnlinked;
 	__u8 *chunkData;
+	__u8 *summaryBuffer;
+	const yaffs_SummaryTags *summary;
+	yaffs_ExtendedTags lastTags;
+	int haveLastTags;
 
 	int fileSize;
 	int isShrink;
@@ -967,6 +972,7 @@ int yaffs2_ScanBackwards(yaffs_Device *dev)
 	dev->blocksInCheckpoint = 0;
 
 	chunkData = yaffs_GetTempBuffer(dev, __LINE__);
+	summaryBuffer = yaffs_GetTempBuffer(dev, __LINE__);
 
 	/* Scan all the blocks to determine their state */
 	bi = dev->blockInfo;
@@ -974,6 +980,7 @@ int yaffs2_ScanBackwards(yaffs_Device *dev)
 		yaffs_ClearChunkBits(dev, blk);
 		bi->pagesInUse = 0;
 		bi->softDeletions = 0;
+		bi->hasSummary = 0;
 
 		yaffs_QueryInitialBlockState(dev, blk, &state, &sequenceNumber);
 
@@ -1063,6 +1070,17 @@ int yaffs2_ScanBackwards(yaffs_Device *dev)
 
 		deleted = 0;
 
+		/* If the block has a summary we get the tags of its data chunks
+		 * from that instead of reading them one by one. Either way the
+		 * tags of the last chunk have now been read.
+		 */
+		summary = NULL;
+		haveLastTags = 0;
+		if (state == YAFFS_BLOCK_STATE_NEEDS_SCANNING) {
+			summary = yaffs_SummaryRead(dev, blk, summaryBuffer, &lastTags);
+			haveLastTags = 1;
+		}
+
 		/* For each chunk in each block that needs scanning.... */
 		foundChunksInBlock = 0;
 		for (c = dev->param.nChunksPerBlock - 1;
@@ -1075,7 +1093,22 @@ int yaffs2_ScanBackwards(yaffs_Device *dev)
 
 			chunk = blk * dev->param.nChunksPerBlock + c;
 
-			result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
+			if (c == dev->param.nChunksPerBlock - 1 && haveLastTags) {
+				if (summary) {
+					/* The summary chunk itself. It is
+					 * neither data nor free space.
+					 */
+					bi->hasSummary = 1;
+					foundChunksInBlock = 1;
+					continue;
+				}
+				tags = lastTags;
+				result = YAFFS_OK;
+			} else if (summary &&
+				   yaffs_SummaryGetTags(dev, &summary[c], blk, &tags))
+				result = YAFFS_OK;
+			else
+				result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
 							&tags);
 
 			/* Let's have a good look at this chunk... */
@@ -1529,6 +1562,7 @@ int yaffs2_ScanBackwards(yaffs_Device *dev)
 	yaffs_HardlinkFixup(dev, hardList);
 
 
+	yaffs_ReleaseTempBuffer(dev, summaryBuffer, __LINE__);
 	yaffs_ReleaseTempBuffer(dev, chunkData, __LINE__);
 
 	if (alloc_failed)
@@ -49,6 +49,8 @@
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
 #include <linux/xattr.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
 
 #define YCHAR char
 #define YUCHAR unsigned char
@@ -76,6 +78,18 @@
 #define YYIELD() schedule()
 #define Y_DUMP_STACK() dump_stack()
 
+/* Locking for readers that run in parallel under a shared device lock */
+#define YLOCK_T			spinlock_t
+#define YLOCK_INIT(l)		spin_lock_init(l)
+#define YLOCK(l)		spin_lock(l)
+#define YUNLOCK(l)		spin_unlock(l)
+#define YMUTEX_T		struct mutex
+#define YMUTEX_INIT(m)		mutex_init(m)
+#define YMUTEX_LOCK(m)		mutex_lock(m)
+#define YMUTEX_UNLOCK(m)	mutex_unlock(m)
+#define Y_WMB()			smp_wmb()
+#define Y_RMB()			smp_rmb()
+
 #define YAFFS_ROOT_MODE			0755
 #define YAFFS_LOSTNFOUND_MODE		0700
 
@@ -154,6 +168,20 @@
 
 #endif
 
+#ifndef YLOCK_T
+/* Environments that never run readers in parallel need no locking */
+#define YLOCK_T			int
+#define YLOCK_INIT(l)		do { } while (0)
+#define YLOCK(l)		do { } while (0)
+#define YUNLOCK(l)		do { } while (0)
+#define YMUTEX_T		int
+#define YMUTEX_INIT(m)		do { } while (0)
+#define YMUTEX_LOCK(m)		do { } while (0)
+#define YMUTEX_UNLOCK(m)	do { } while (0)
+#define Y_WMB()			do { } while (0)
+#define Y_RMB()			do { } while (0)
+#endif
+
 #if defined(CONFIG_YAFFS_DIRECT) || defined(CONFIG_YAFFS_WINCE)
 
 #ifdef CONFIG_YAFFSFS_PROVIDE_VALUES
@@ -34,6 +34,22 @@
  */
 #define PMEM_GET_TOTAL_SIZE	_IOW(PMEM_IOCTL_MAGIC, 7, unsigned int)
 #define PMEM_CACHE_FLUSH	_IOW(PMEM_IOCTL_MAGIC, 8, unsigned int)
+/* Cache maintenance on part of a cached mapping of the file, pass a
+ * struct pmem_addr. vaddr + offset is the start of the dirty range in one
+ * of the caller's mappings of the file and length its size (0 means to the
+ * end of that mapping). CLEAN writes dirty lines back before a device
+ * reads the buffer, INV discards stale lines after a device wrote it,
+ * CLEAN_INV does both. They do nothing on uncached mappings.
+ */
+#define PMEM_CLEAN_INV_CACHES	_IOW(PMEM_IOCTL_MAGIC, 11, unsigned int)
+#define PMEM_CLEAN_CACHES	_IOW(PMEM_IOCTL_MAGIC, 12, unsigned int)
+#define PMEM_INV_CACHES		_IOW(PMEM_IOCTL_MAGIC, 13, unsigned int)
+/* Choose whether this allocation is mapped cached (non-zero argument, the
+ * default) or uncached (zero) in a cached region, before the file is
+ * mmaped. Fails with EINVAL in regions that are not cached and on files
+ * opened with O_SYNC, which are always mapped uncached.
+ */
+#define PMEM_SET_CACHED		_IOW(PMEM_IOCTL_MAGIC, 14, unsigned int)
 
 struct android_pmem_platform_data
 {
@@ -57,6 +73,12 @@ struct pmem_region {
 	unsigned long len;
 };
 
+struct pmem_addr {
+	unsigned long vaddr;
+	unsigned long offset;
+	unsigned long length;
+};
+
 #ifdef CONFIG_ANDROID_PMEM
 int is_pmem_file(struct file *file);
 int get_pmem_file(int fd, unsigned long *start, unsigned long *vstart,
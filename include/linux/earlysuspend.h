@@ -18,6 +18,7 @@
 
 #ifdef CONFIG_HAS_EARLYSUSPEND
 #include <linux/list.h>
+#include <linux/completion.h>
 #endif
 
 /* The early_suspend structure defines suspend and resume hooks to be called
@@ -29,18 +30,36 @@
  * the suspend handlers have already been called without a matching call to the
  * resume handlers, the suspend handler will be called directly from
  * register_early_suspend. This direct call can violate the normal level order.
+ *
+ * A handler that sets EARLY_SUSPEND_ASYNC_RESUME in flags has its resume hook
+ * run asynchronously, concurrently with the following resume hooks up to the
+ * next handler without the flag, which still waits for all resume hooks
+ * before it. Among asynchronous handlers it is only ordered after the
+ * handlers listed in the NULL terminated resume_deps array. Only
+ * handlers that resume before the dependent one in the normal level order,
+ * i.e. have a higher level, can be waited for; other entries are ignored.
+ * All resume hooks have completed when the late resume work finishes.
  */
 enum {
 	EARLY_SUSPEND_LEVEL_BLANK_SCREEN = 50,
 	EARLY_SUSPEND_LEVEL_STOP_DRAWING = 100,
 	EARLY_SUSPEND_LEVEL_DISABLE_FB = 150,
 };
+enum {
+	EARLY_SUSPEND_ASYNC_RESUME = 1U << 0,
+};
 struct early_suspend {
 #ifdef CONFIG_HAS_EARLYSUSPEND
 	struct list_head link;
 	int level;
 	void (*suspend)(struct early_suspend *h);
 	void (*resume)(struct early_suspend *h);
+	unsigned int flags;
+	struct early_suspend **resume_deps;
+
+	/* private to kernel/power/earlysuspend.c */
+	unsigned int resume_order;
+	struct completion resume_done;
 #endif
 };
 
@@ -6,6 +6,7 @@
 #include <linux/init.h>
 #include <linux/pm.h>
 #include <linux/mm.h>
+#include <linux/ktime.h>
 #include <asm/errno.h>
 
 #if defined(CONFIG_PM_SLEEP) && defined(CONFIG_VT) && defined(CONFIG_VT_CONSOLE)
@@ -273,6 +274,35 @@ static inline void suspend_nvs_save(void) {}
 static inline void suspend_nvs_restore(void) {}
 #endif /* CONFIG_SUSPEND_NVS */
 
+/* kernel/power/suspend_profile.c */
+enum suspend_profile_kind {
+	SUSPEND_PROFILE_EARLY_SUSPEND,
+	SUSPEND_PROFILE_LATE_RESUME,
+	SUSPEND_PROFILE_DEV_SUSPEND,
+	SUSPEND_PROFILE_DEV_SUSPEND_NOIRQ,
+	SUSPEND_PROFILE_DEV_RESUME_NOIRQ,
+	SUSPEND_PROFILE_DEV_RESUME,
+	SUSPEND_PROFILE_STAGE,
+	SUSPEND_PROFILE_KINDS
+};
+
+#ifdef CONFIG_SUSPEND_PROFILE
+extern void suspend_profile_new_cycle(void);
+extern ktime_t suspend_profile_start(void);
+extern void suspend_profile_end(enum suspend_profile_kind kind,
+				const char *name, const void *fn,
+				ktime_t start, int error);
+#else /* !CONFIG_SUSPEND_PROFILE */
+static inline void suspend_profile_new_cycle(void) {}
+static inline ktime_t suspend_profile_start(void)
+{
+	return ktime_set(0, 0);
+}
+static inline void suspend_profile_end(enum suspend_profile_kind kind,
+				       const char *name, const void *fn,
+				       ktime_t start, int error) {}
+#endif /* !CONFIG_SUSPEND_PROFILE */
+
 #ifdef CONFIG_PM_SLEEP
 void save_processor_state(void);
 void restore_processor_state(void);
@@ -0,0 +1,126 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_TRACE_BINDER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_BINDER_H
+
+#include <linux/tracepoint.h>
+
+/**
+ * binder_transaction_enqueue - called when a transaction is queued
+ * @debug_id:	debug id of the transaction
+ * @from_pid:	pid of the sending process
+ * @from_tid:	pid of the sending thread
+ * @to_pid:	pid of the target process
+ * @to_tid:	pid of the target thread, 0 if queued to the process
+ * @node_id:	debug id of the target node, 0 for a reply
+ * @reply:	transaction is a reply
+ * @flags:	transaction flags
+ * @code:	transaction code
+ */
+TRACE_EVENT(binder_transaction_enqueue,
+
+	TP_PROTO(int debug_id, int from_pid, int from_tid, int to_pid,
+		 int to_tid, int node_id, int reply, unsigned int flags,
+		 unsigned int code),
+
+	TP_ARGS(debug_id, from_pid, from_tid, to_pid, to_tid, node_id, reply,
+		flags, code),
+
+	TP_STRUCT__entry(
+		__field(int,		debug_id)
+		__field(int,		from_pid)
+		__field(int,		from_tid)
+		__field(int,		to_pid)
+		__field(int,		to_tid)
+		__field(int,		node_id)
+		__field(int,		reply)
+		__field(unsigned int,	flags)
+		__field(unsigned int,	code)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= debug_id;
+		__entry->from_pid	= from_pid;
+		__entry->from_tid	= from_tid;
+		__entry->to_pid		= to_pid;
+		__entry->to_tid		= to_tid;
+		__entry->node_id	= node_id;
+		__entry->reply		= reply;
+		__entry->flags		= flags;
+		__entry->code		= code;
+	),
+
+	TP_printk("transaction=%d from=%d:%d dest=%d:%d node=%d reply=%d "
+		  "flags=0x%x code=0x%x",
+		  __entry->debug_id, __entry->from_pid, __entry->from_tid,
+		  __entry->to_pid, __entry->to_tid, __entry->node_id,
+		  __entry->reply, __entry->flags, __entry->code)
+);
+
+/**
+ * binder_transaction_wakeup - called when the target of a transaction is
+ * woken up
+ * @debug_id:	debug id of the transaction
+ * @to_pid:	pid of the target process
+ * @to_tid:	pid of the woken thread, 0 if the process wait queue is used
+ */
+TRACE_EVENT(binder_transaction_wakeup,
+
+	TP_PROTO(int debug_id, int to_pid, int to_tid),
+
+	TP_ARGS(debug_id, to_pid, to_tid),
+
+	TP_STRUCT__entry(
+		__field(int,	debug_id)
+		__field(int,	to_pid)
+		__field(int,	to_tid)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= debug_id;
+		__entry->to_pid		= to_pid;
+		__entry->to_tid		= to_tid;
+	),
+
+	TP_printk("transaction=%d dest=%d:%d",
+		  __entry->debug_id, __entry->to_pid, __entry->to_tid)
+);
+
+/**
+ * binder_transaction_dequeue - called when a transaction is delivered to
+ * user space
+ * @debug_id:	debug id of the transaction
+ * @pid:	pid of the receiving process
+ * @tid:	pid of the receiving thread
+ * @latency_us:	time since the transaction was queued, in microseconds
+ */
+TRACE_EVENT(binder_transaction_dequeue,
+
+	TP_PROTO(int debug_id, int pid, int tid, s64 latency_us),
+
+	TP_ARGS(debug_id, pid, tid, latency_us),
+
+	TP_STRUCT__entry(
+		__field(int,	debug_id)
+		__field(int,	pid)
+		__field(int,	tid)
+		__field(s64,	latency_us)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= debug_id;
+		__entry->pid		= pid;
+		__entry->tid		= tid;
+		__entry->latency_us	= latency_us;
+	),
+
+	TP_printk("transaction=%d dest=%d:%d latency=%lldus",
+		  __entry->debug_id, __entry->pid, __entry->tid,
+		  __entry->latency_us)
+);
+
+#endif /*  _TRACE_BINDER_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
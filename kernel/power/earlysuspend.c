@@ -13,6 +13,7 @@
  *
  */
 
+#include <linux/async.h>
 #include <linux/earlysuspend.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
@@ -29,6 +30,8 @@ enum {
 };
 static int debug_mask = DEBUG_USER_STATE;
 module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
+static int async_resume = 1;
+module_param_named(async_resume, async_resume, int, S_IRUGO | S_IWUSR);
 
 extern struct wake_lock sync_wake_lock;
 extern struct workqueue_struct *sync_work_queue;
@@ -55,6 +58,10 @@ enum {
 	SUSPEND_REQUESTED_AND_SUSPENDED = SUSPEND_REQUESTED | SUSPENDED,
 };
 static int state;
+static LIST_HEAD(late_resume_domain);
+/* resume_order of the last handler numbered and of the last pass' start */
+static unsigned int resume_order;
+static unsigned int resume_base;
 
 static void sync_system(struct work_struct *work)
 {
@@ -74,6 +81,8 @@ void register_early_suspend(struct early_suspend *handler)
 		if (e->level > handler->level)
 			break;
 	}
+	handler->resume_order = 0;
+	init_completion(&handler->resume_done);
 	list_add_tail(&handler->link, pos);
 	if ((state & SUSPENDED) && handler->suspend)
 		handler->suspend(handler);
@@ -112,9 +121,15 @@ static void early_suspend(struct work_struct *work)
 
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("early_suspend: call handlers\n");
+	suspend_profile_new_cycle();
 	list_for_each_entry(pos, &early_suspend_handlers, link) {
-		if (pos->suspend != NULL)
+		if (pos->suspend != NULL) {
+			ktime_t start = suspend_profile_start();
+
 			pos->suspend(pos);
+			suspend_profile_end(SUSPEND_PROFILE_EARLY_SUSPEND,
+					    NULL, pos->suspend, start, 0);
+		}
 	}
 	mutex_unlock(&early_suspend_lock);
 
@@ -142,6 +157,39 @@ abort:
 	spin_unlock_irqrestore(&state_lock, irqflags);
 }
 
+/*
+ * Run one resume hook once the handlers it depends on are done. resume_order
+ * is handed out in resume order for each late_resume pass, starting above
+ * resume_base, so a dependency is valid only if it was numbered in this pass
+ * before the dependent handler. Waiting for anything else could deadlock.
+ */
+static void call_late_resume(struct early_suspend *handler)
+{
+	struct early_suspend **dep;
+	ktime_t start;
+
+	for (dep = handler->resume_deps; dep && *dep; dep++) {
+		if ((*dep)->resume_order > resume_base &&
+		    (*dep)->resume_order < handler->resume_order)
+			wait_for_completion(&(*dep)->resume_done);
+		else
+			pr_warning("late_resume: %pf ignores dependency %pf\n",
+				   handler->resume, (*dep)->resume);
+	}
+	if (handler->resume != NULL) {
+		start = suspend_profile_start();
+		handler->resume(handler);
+		suspend_profile_end(SUSPEND_PROFILE_LATE_RESUME, NULL,
+				    handler->resume, start, 0);
+	}
+	complete_all(&handler->resume_done);
+}
+
+static void async_late_resume(void *data, async_cookie_t cookie)
+{
+	call_late_resume(data);
+}
+
 static void late_resume(struct work_struct *work)
 {
 	struct early_suspend *pos;
@@ -176,9 +224,22 @@ static void late_resume(struct work_struct *work)
 
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: call handlers\n");
-	list_for_each_entry_reverse(pos, &early_suspend_handlers, link)
-		if (pos->resume != NULL)
-			pos->resume(pos);
+	resume_base = resume_order;
+	list_for_each_entry_reverse(pos, &early_suspend_handlers, link) {
+		INIT_COMPLETION(pos->resume_done);
+		pos->resume_order = ++resume_order;
+	}
+	list_for_each_entry_reverse(pos, &early_suspend_handlers, link) {
+		if (async_resume && (pos->flags & EARLY_SUSPEND_ASYNC_RESUME)) {
+			async_schedule_domain(async_late_resume, pos,
+					      &late_resume_domain);
+		} else {
+			/* keep the level order for synchronous handlers */
+			async_synchronize_full_domain(&late_resume_domain);
+			call_late_resume(pos);
+		}
+	}
+	async_synchronize_full_domain(&late_resume_domain);
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: done\n");
 abort:
@@ -25,6 +25,27 @@
 
 #include "power.h"
 
+/*
+ * Time a platform or device-list stage of the suspend sequence for the
+ * suspend profiler.  Compiles down to the plain call without it.
+ */
+#define profile_stage(name, call)					\
+({									\
+	ktime_t __start = suspend_profile_start();			\
+	int __error = (call);						\
+	suspend_profile_end(SUSPEND_PROFILE_STAGE, name, NULL,		\
+			    __start, __error);				\
+	__error;							\
+})
+
+#define profile_stage_void(name, call)					\
+do {									\
+	ktime_t __start = suspend_profile_start();			\
+	call;								\
+	suspend_profile_end(SUSPEND_PROFILE_STAGE, name, NULL,		\
+			    __start, 0);				\
+} while (0)
+
 const char *const pm_states[PM_SUSPEND_MAX] = {
 #ifdef CONFIG_EARLYSUSPEND
 	[PM_SUSPEND_ON]		= "on",
@@ -137,19 +158,21 @@ static int suspend_enter(suspend_state_t state)
 	int error;
 
 	if (suspend_ops->prepare) {
-		error = suspend_ops->prepare();
+		error = profile_stage("prepare", suspend_ops->prepare());
 		if (error)
 			return error;
 	}
 
-	error = dpm_suspend_noirq(PMSG_SUSPEND);
+	error = profile_stage("dpm_suspend_noirq",
+			      dpm_suspend_noirq(PMSG_SUSPEND));
 	if (error) {
 		printk(KERN_ERR "PM: Some devices failed to power down\n");
 		goto Platfrom_finish;
 	}
 
 	if (suspend_ops->prepare_late) {
-		error = suspend_ops->prepare_late();
+		error = profile_stage("prepare_late",
+				      suspend_ops->prepare_late());
 		if (error)
 			goto Power_up_devices;
 	}
@@ -179,14 +202,14 @@ static int suspend_enter(suspend_state_t state)
 
  Platform_wake:
 	if (suspend_ops->wake)
-		suspend_ops->wake();
+		profile_stage_void("wake", suspend_ops->wake());
 
  Power_up_devices:
-	dpm_resume_noirq(PMSG_RESUME);
+	profile_stage_void("dpm_resume_noirq", dpm_resume_noirq(PMSG_RESUME));
 
  Platfrom_finish:
 	if (suspend_ops->finish)
-		suspend_ops->finish();
+		profile_stage_void("finish", suspend_ops->finish());
 
 	return error;
 }
@@ -204,15 +227,20 @@ int suspend_devices_and_enter(suspend_state_t state)
 	if (!suspend_ops)
 		return -ENOSYS;
 
+#ifndef CONFIG_EARLYSUSPEND
+	/* otherwise the cycle was started by early_suspend() */
+	suspend_profile_new_cycle();
+#endif
 	if (suspend_ops->begin) {
-		error = suspend_ops->begin(state);
+		error = profile_stage("begin", suspend_ops->begin(state));
 		if (error)
 			goto Close;
 	}
 	suspend_console();
 	saved_mask = clear_gfp_allowed_mask(GFP_IOFS);
 	suspend_test_start();
-	error = dpm_suspend_start(PMSG_SUSPEND);
+	error = profile_stage("dpm_suspend_start",
+			      dpm_suspend_start(PMSG_SUSPEND));
 	if (error) {
 		printk(KERN_ERR "PM: Some devices failed to suspend\n");
 		goto Recover_platform;
@@ -225,18 +253,18 @@ int suspend_devices_and_enter(suspend_state_t state)
 
  Resume_devices:
 	suspend_test_start();
-	dpm_resume_end(PMSG_RESUME);
+	profile_stage_void("dpm_resume_end", dpm_resume_end(PMSG_RESUME));
 	suspend_test_finish("resume devices");
 	set_gfp_allowed_mask(saved_mask);
 	resume_console();
  Close:
 	if (suspend_ops->end)
-		suspend_ops->end();
+		profile_stage_void("end", suspend_ops->end());
 	return error;
 
  Recover_platform:
 	if (suspend_ops->recover)
-		suspend_ops->recover();
+		profile_stage_void("recover", suspend_ops->recover());
 	goto Resume_devices;
 }
 
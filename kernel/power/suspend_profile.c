@@ -0,0 +1,371 @@
+/* kernel/power/suspend_profile.c
+ *
+ * Suspend/resume latency profiler.
+ *
+ * Every early suspend handler, device suspend/resume callback and
+ * platform suspend stage that is bracketed by suspend_profile_start()
+ * and suspend_profile_end() is timed.  The most recent samples are kept
+ * in a ring buffer and a log2 latency histogram is accumulated for each
+ * handler across suspend cycles.  Both are exported in debugfs:
+ *
+ *   /sys/kernel/debug/suspend_profile/samples   last samples, oldest first
+ *   /sys/kernel/debug/suspend_profile/handlers  per-handler statistics
+ *
+ * Writing to either file clears it.  When suspend_profile.budget_us is
+ * non-zero every sample exceeding it is reported in the kernel log and
+ * counted against its handler.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/debugfs.h>
+#include <linux/hash.h>
+#include <linux/init.h>
+#include <linux/jhash.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/suspend.h>
+
+#define PROFILE_RING_SIZE	256
+#define PROFILE_HASH_BITS	6
+#define PROFILE_HASH_SIZE	(1 << PROFILE_HASH_BITS)
+#define PROFILE_NAME_LEN	32
+/* bucket n holds samples of [2^(n-1), 2^n) usecs, the last one the rest */
+#define PROFILE_BUCKETS		24
+
+static int enabled = 1;
+module_param(enabled, int, S_IRUGO | S_IWUSR);
+static unsigned int budget_us;
+module_param(budget_us, uint, S_IRUGO | S_IWUSR);
+
+struct profile_sample {
+	s64 start_ns;
+	u32 usecs;
+	u32 cycle;
+	int error;
+	u8 kind;
+	u8 over_budget;
+	char name[PROFILE_NAME_LEN];
+};
+
+struct profile_handler {
+	struct hlist_node node;
+	const void *fn;
+	enum suspend_profile_kind kind;
+	char name[PROFILE_NAME_LEN];
+	unsigned int count;
+	unsigned int errors;
+	unsigned int over_budget;
+	u32 last_usecs;
+	u32 max_usecs;
+	u64 total_usecs;
+	unsigned int hist[PROFILE_BUCKETS];
+};
+
+static const char *const kind_names[SUSPEND_PROFILE_KINDS] = {
+	[SUSPEND_PROFILE_EARLY_SUSPEND]		= "early_suspend",
+	[SUSPEND_PROFILE_LATE_RESUME]		= "late_resume",
+	[SUSPEND_PROFILE_DEV_SUSPEND]		= "suspend",
+	[SUSPEND_PROFILE_DEV_SUSPEND_NOIRQ]	= "suspend_noirq",
+	[SUSPEND_PROFILE_DEV_RESUME_NOIRQ]	= "resume_noirq",
+	[SUSPEND_PROFILE_DEV_RESUME]		= "resume",
+	[SUSPEND_PROFILE_STAGE]			= "stage",
+};
+
+/* protects everything below; samples may be taken with irqs disabled */
+static DEFINE_SPINLOCK(profile_lock);
+static struct profile_sample profile_ring[PROFILE_RING_SIZE];
+static unsigned int profile_head;
+static unsigned int profile_count;
+static struct hlist_head profile_hash[PROFILE_HASH_SIZE];
+static unsigned int profile_cycle;
+static unsigned int profile_untracked;
+
+/**
+ * suspend_profile_new_cycle - mark the start of a suspend cycle
+ *
+ * Samples are tagged with the cycle they were taken in so that the ring
+ * can be split back into individual suspend/resume sequences.  A cycle
+ * starts in early_suspend(); the suspend attempts and the late resume
+ * that follow belong to it.  Without CONFIG_EARLYSUSPEND every
+ * suspend_devices_and_enter() starts one.
+ */
+void suspend_profile_new_cycle(void)
+{
+	unsigned long irqflags;
+
+	spin_lock_irqsave(&profile_lock, irqflags);
+	profile_cycle++;
+	spin_unlock_irqrestore(&profile_lock, irqflags);
+}
+
+/**
+ * suspend_profile_start - timestamp the start of a profiled callback
+ *
+ * Returns a zero time when profiling is disabled, which makes the matching
+ * suspend_profile_end() a no-op.
+ */
+ktime_t suspend_profile_start(void)
+{
+	if (!enabled)
+		return ktime_set(0, 0);
+	return ktime_get();
+}
+
+static unsigned int profile_hashfn(enum suspend_profile_kind kind,
+				   const char *name, const void *fn)
+{
+	if (fn)
+		return hash_ptr((void *)fn, PROFILE_HASH_BITS) ^ kind;
+	return jhash(name, strlen(name), kind) & (PROFILE_HASH_SIZE - 1);
+}
+
+static struct profile_handler *profile_find(enum suspend_profile_kind kind,
+					    const char *name, const void *fn)
+{
+	struct hlist_head *head;
+	struct hlist_node *pos;
+	struct profile_handler *handler;
+
+	head = &profile_hash[profile_hashfn(kind, name, fn) &
+			     (PROFILE_HASH_SIZE - 1)];
+	hlist_for_each_entry(handler, pos, head, node) {
+		if (handler->kind != kind || handler->fn != fn)
+			continue;
+		if (fn || !strncmp(handler->name, name, PROFILE_NAME_LEN - 1))
+			return handler;
+	}
+
+	handler = kzalloc(sizeof(*handler), GFP_ATOMIC);
+	if (!handler) {
+		profile_untracked++;
+		return NULL;
+	}
+	handler->kind = kind;
+	handler->fn = fn;
+	strlcpy(handler->name, name, sizeof(handler->name));
+	hlist_add_head(&handler->node, head);
+	return handler;
+}
+
+/**
+ * suspend_profile_end - record a profiled callback
+ * @kind:	class of the callback
+ * @name:	name of the handler, or NULL to name it after @fn
+ * @fn:		handler function; samples with the same non-NULL @fn are
+ *		accounted to one handler, otherwise @name is the key
+ * @start:	value returned by suspend_profile_start()
+ * @error:	return value of the callback, 0 if it has none
+ */
+void suspend_profile_end(enum suspend_profile_kind kind, const char *name,
+			 const void *fn, ktime_t start, int error)
+{
+	struct profile_handler *handler;
+	struct profile_sample *sample;
+	unsigned long irqflags;
+	char buf[PROFILE_NAME_LEN];
+	unsigned int budget = budget_us;
+	s64 usecs64;
+	u32 usecs;
+	bool over;
+
+	if (!start.tv64)
+		return;
+
+	usecs64 = ktime_to_us(ktime_sub(ktime_get(), start));
+	usecs = min_t(s64, max_t(s64, usecs64, 0), UINT_MAX);
+	over = budget && usecs > budget;
+
+	if (!name) {
+		snprintf(buf, sizeof(buf), "%pf", fn);
+		name = buf;
+	}
+
+	spin_lock_irqsave(&profile_lock, irqflags);
+	handler = profile_find(kind, name, fn);
+	if (handler) {
+		handler->count++;
+		if (error)
+			handler->errors++;
+		if (over)
+			handler->over_budget++;
+		handler->last_usecs = usecs;
+		if (usecs > handler->max_usecs)
+			handler->max_usecs = usecs;
+		handler->total_usecs += usecs;
+		handler->hist[min(fls(usecs), PROFILE_BUCKETS - 1)]++;
+	}
+
+	sample = &profile_ring[profile_head];
+	sample->start_ns = ktime_to_ns(start);
+	sample->usecs = usecs;
+	sample->cycle = profile_cycle;
+	sample->error = error;
+	sample->kind = kind;
+	sample->over_budget = over;
+	strlcpy(sample->name, name, sizeof(sample->name));
+	profile_head = (profile_head + 1) % PROFILE_RING_SIZE;
+	if (profile_count < PROFILE_RING_SIZE)
+		profile_count++;
+	spin_unlock_irqrestore(&profile_lock, irqflags);
+
+	if (over)
+		pr_warning("PM: %s %s took %u usecs, budget %u usecs\n",
+			   kind_names[kind], name, usecs, budget);
+}
+
+static int samples_show(struct seq_file *m, void *unused)
+{
+	struct profile_sample *sample;
+	unsigned long irqflags;
+	unsigned int i;
+
+	seq_printf(m, "cycle\tstart\t\tusecs\terror\tkind\t\tname\n");
+	spin_lock_irqsave(&profile_lock, irqflags);
+	for (i = 0; i < profile_count; i++) {
+		unsigned long rem;
+		u64 secs;
+
+		sample = &profile_ring[(profile_head + PROFILE_RING_SIZE -
+					profile_count + i) % PROFILE_RING_SIZE];
+		secs = sample->start_ns;
+		rem = do_div(secs, NSEC_PER_SEC);
+		seq_printf(m, "%u\t%5llu.%06lu\t%u%s\t%d\t%-13s\t%s\n",
+			   sample->cycle, (unsigned long long)secs,
+			   rem / NSEC_PER_USEC,
+			   sample->usecs, sample->over_budget ? "!" : "",
+			   sample->error, kind_names[sample->kind],
+			   sample->name);
+	}
+	spin_unlock_irqrestore(&profile_lock, irqflags);
+	return 0;
+}
+
+static int handlers_show(struct seq_file *m, void *unused)
+{
+	struct profile_handler *handler;
+	struct hlist_node *pos;
+	unsigned long irqflags;
+	int i, b;
+
+	spin_lock_irqsave(&profile_lock, irqflags);
+	seq_printf(m, "cycles %u budget %u usecs untracked %u\n",
+		   profile_cycle, budget_us, profile_untracked);
+	seq_printf(m, "kind\t\tname\t\t\t\tcount\terrors\tover\t"
+		   "avg\tmax\tlast\n");
+	for (i = 0; i < PROFILE_HASH_SIZE; i++) {
+		hlist_for_each_entry(handler, pos, &profile_hash[i], node) {
+			u64 avg = handler->total_usecs;
+
+			do_div(avg, handler->count);
+			seq_printf(m, "%-13s\t%-31s\t%u\t%u\t%u\t%llu\t%u\t%u\n",
+				   kind_names[handler->kind], handler->name,
+				   handler->count, handler->errors,
+				   handler->over_budget,
+				   (unsigned long long)avg,
+				   handler->max_usecs, handler->last_usecs);
+			seq_printf(m, "\t");
+			for (b = 0; b < PROFILE_BUCKETS; b++) {
+				if (!handler->hist[b])
+					continue;
+				if (b == PROFILE_BUCKETS - 1)
+					seq_printf(m, " >=%u:%u",
+						   1U << (b - 1),
+						   handler->hist[b]);
+				else
+					seq_printf(m, " <%u:%u", 1U << b,
+						   handler->hist[b]);
+			}
+			seq_printf(m, "\n");
+		}
+	}
+	spin_unlock_irqrestore(&profile_lock, irqflags);
+	return 0;
+}
+
+static ssize_t samples_write(struct file *file, const char __user *buf,
+			     size_t count, loff_t *ppos)
+{
+	unsigned long irqflags;
+
+	spin_lock_irqsave(&profile_lock, irqflags);
+	profile_head = 0;
+	profile_count = 0;
+	spin_unlock_irqrestore(&profile_lock, irqflags);
+	return count;
+}
+
+static ssize_t handlers_write(struct file *file, const char __user *buf,
+			      size_t count, loff_t *ppos)
+{
+	struct profile_handler *handler;
+	struct hlist_node *pos, *n;
+	unsigned long irqflags;
+	int i;
+
+	spin_lock_irqsave(&profile_lock, irqflags);
+	for (i = 0; i < PROFILE_HASH_SIZE; i++) {
+		hlist_for_each_entry_safe(handler, pos, n, &profile_hash[i],
+					  node) {
+			hlist_del(&handler->node);
+			kfree(handler);
+		}
+	}
+	profile_untracked = 0;
+	spin_unlock_irqrestore(&profile_lock, irqflags);
+	return count;
+}
+
+static int samples_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, samples_show, NULL);
+}
+
+static int handlers_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, handlers_show, NULL);
+}
+
+static const struct file_operations samples_fops = {
+	.owner = THIS_MODULE,
+	.open = samples_open,
+	.read = seq_read,
+	.write = samples_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations handlers_fops = {
+	.owner = THIS_MODULE,
+	.open = handlers_open,
+	.read = seq_read,
+	.write = handlers_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init suspend_profile_init(void)
+{
+	struct dentry *dir;
+
+	dir = debugfs_create_dir("suspend_profile", NULL);
+	if (!dir)
+		return -ENOMEM;
+	debugfs_create_file("samples", S_IRUGO | S_IWUSR, dir, NULL,
+			    &samples_fops);
+	debugfs_create_file("handlers", S_IRUGO | S_IWUSR, dir, NULL,
+			    &handlers_fops);
+	return 0;
+}
+late_initcall(suspend_profile_init);
@@ -19,6 +19,7 @@
 #include <linux/suspend.h>
 #include <linux/syscalls.h> /* sys_sync */
 #include <linux/wakelock.h>
+#include <linux/percpu.h>
 #ifdef CONFIG_WAKELOCK_STAT
 #include <linux/proc_fs.h>
 #endif
@@ -48,7 +49,11 @@ module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 static DEFINE_SPINLOCK(list_lock);
 static LIST_HEAD(inactive_locks);
 static struct list_head active_wake_locks[WAKE_LOCK_TYPE_COUNT];
-static int current_event_num;
+/* active locks with a timeout, sorted by expiry, protected by list_lock */
+static struct rb_root expire_tree[WAKE_LOCK_TYPE_COUNT];
+/* number of active locks without a timeout, protected by list_lock */
+static int active_nolimit[WAKE_LOCK_TYPE_COUNT];
+static atomic_t current_event_num;
 struct workqueue_struct *suspend_work_queue;
 struct workqueue_struct *sync_work_queue;
 struct wake_lock main_wake_lock;
@@ -56,6 +61,20 @@ struct wake_lock sync_wake_lock;
 suspend_state_t requested_suspend_state = PM_SUSPEND_MEM;
 static struct wake_lock unknown_wakeup;
 
+#ifdef CONFIG_WAKELOCK_STAT
+/* operation counts, kept per cpu so the fast path needs no shared lock */
+struct wakelock_op_stats {
+	unsigned long lock;
+	unsigned long lock_fast;
+	unsigned long unlock;
+	unsigned long expire;
+};
+static DEFINE_PER_CPU(struct wakelock_op_stats, wakelock_op_stats);
+#define wakelock_op_inc(field) this_cpu_inc(wakelock_op_stats.field)
+#else
+#define wakelock_op_inc(field) do { } while (0)
+#endif
+
 #ifdef CONFIG_WAKELOCK_STAT
 static struct wake_lock deleted_wake_locks;
 static ktime_t last_sleep_time_update;
@@ -199,12 +218,48 @@ static void update_sleep_wait_stats_locked(int done)
 }
 #endif
 
+/* Caller must acquire the list_lock spinlock */
+static void activate_wake_lock_locked(struct wake_lock *lock, int type)
+{
+	struct rb_node **p = &expire_tree[type].rb_node;
+	struct rb_node *parent = NULL;
+
+	if (!(lock->flags & WAKE_LOCK_AUTO_EXPIRE)) {
+		active_nolimit[type]++;
+		return;
+	}
+	while (*p) {
+		struct wake_lock *entry;
+
+		parent = *p;
+		entry = rb_entry(parent, struct wake_lock, expire_node);
+		if (time_before(lock->expires, entry->expires))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&lock->expire_node, parent, p);
+	rb_insert_color(&lock->expire_node, &expire_tree[type]);
+}
+
+/* Caller must acquire the list_lock spinlock */
+static void deactivate_wake_lock_locked(struct wake_lock *lock, int type)
+{
+	if (!(lock->flags & WAKE_LOCK_ACTIVE))
+		return;
+	if (lock->flags & WAKE_LOCK_AUTO_EXPIRE)
+		rb_erase(&lock->expire_node, &expire_tree[type]);
+	else
+		active_nolimit[type]--;
+}
 
 static void expire_wake_lock(struct wake_lock *lock)
 {
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_unlock_stat_locked(lock, 1);
 #endif
+	wakelock_op_inc(expire);
+	deactivate_wake_lock_locked(lock, lock->flags & WAKE_LOCK_TYPE_MASK);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
 	list_del(&lock->link);
 	list_add(&lock->link, &inactive_locks);
@@ -237,21 +292,27 @@ static void print_active_locks(int type)
 
 static long has_wake_lock_locked(int type)
 {
-	struct wake_lock *lock, *n;
-	long max_timeout = 0;
+	struct wake_lock *lock;
+	struct rb_node *n;
+	unsigned long now = jiffies;
+	long timeout;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry_safe(lock, n, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout <= 0)
-				expire_wake_lock(lock);
-			else if (timeout > max_timeout)
-				max_timeout = timeout;
-		} else
-			return -1;
+	while ((n = rb_first(&expire_tree[type]))) {
+		lock = rb_entry(n, struct wake_lock, expire_node);
+		if ((long)(lock->expires - now) > 0)
+			break;
+		expire_wake_lock(lock);
 	}
-	return max_timeout;
+	if (active_nolimit[type])
+		return -1;
+	n = rb_last(&expire_tree[type]);
+	if (!n)
+		return 0;
+	lock = rb_entry(n, struct wake_lock, expire_node);
+	/* jiffies ticking on must not turn a held lock into 0 or -1 */
+	timeout = lock->expires - now;
+	return timeout > 0 ? timeout : 1;
 }
 
 long has_wake_lock(int type)
@@ -295,7 +356,7 @@ static void suspend(struct work_struct *work)
 #endif /* CONFIG_SVNET_WHITELIST */
 
 
-	entry_event_num = current_event_num;
+	entry_event_num = atomic_read(&current_event_num);
 	sys_sync();
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("suspend: enter suspend\n");
@@ -310,7 +371,7 @@ static void suspend(struct work_struct *work)
 			tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
 			tm.tm_hour, tm.tm_min, tm.tm_sec, ts.tv_nsec);
 	}
-	if (current_event_num == entry_event_num) {
+	if (atomic_read(&current_event_num) == entry_event_num) {
 		if (debug_mask & DEBUG_SUSPEND)
 			pr_info("suspend: pm_suspend returned with no event\n");
 		wake_lock_timeout(&unknown_wakeup, HZ / 2);
@@ -381,6 +442,7 @@ void wake_lock_init(struct wake_lock *lock, int type, const char *name)
 	lock->flags = (type & WAKE_LOCK_TYPE_MASK) | WAKE_LOCK_INITIALIZED;
 
 	INIT_LIST_HEAD(&lock->link);
+	RB_CLEAR_NODE(&lock->expire_node);
 	spin_lock_irqsave(&list_lock, irqflags);
 	list_add(&lock->link, &inactive_locks);
 	spin_unlock_irqrestore(&list_lock, irqflags);
@@ -393,7 +455,9 @@ void wake_lock_destroy(struct wake_lock *lock)
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_lock_destroy name=%s\n", lock->name);
 	spin_lock_irqsave(&list_lock, irqflags);
-	lock->flags &= ~WAKE_LOCK_INITIALIZED;
+	deactivate_wake_lock_locked(lock, lock->flags & WAKE_LOCK_TYPE_MASK);
+	lock->flags &= ~(WAKE_LOCK_INITIALIZED | WAKE_LOCK_ACTIVE |
+			 WAKE_LOCK_AUTO_EXPIRE);
 #ifdef CONFIG_WAKELOCK_STAT
 	if (lock->stat.count) {
 		deleted_wake_locks.stat.count += lock->stat.count;
@@ -422,6 +486,7 @@ static void wake_lock_internal(
 	long expire_in;
 
 	spin_lock_irqsave(&list_lock, irqflags);
+	wakelock_op_inc(lock);
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
 	BUG_ON(!(lock->flags & WAKE_LOCK_INITIALIZED));
@@ -438,6 +503,7 @@ static void wake_lock_internal(
 		lock->stat.last_time = ktime_get();
 	}
 #endif
+	deactivate_wake_lock_locked(lock, type);
 	if (!(lock->flags & WAKE_LOCK_ACTIVE)) {
 		lock->flags |= WAKE_LOCK_ACTIVE;
 #ifdef CONFIG_WAKELOCK_STAT
@@ -460,8 +526,9 @@ static void wake_lock_internal(
 		lock->flags &= ~WAKE_LOCK_AUTO_EXPIRE;
 		list_add(&lock->link, &active_wake_locks[type]);
 	}
+	activate_wake_lock_locked(lock, type);
 	if (type == WAKE_LOCK_SUSPEND) {
-		current_event_num++;
+		atomic_inc(&current_event_num);
 #ifdef CONFIG_WAKELOCK_STAT
 		if (lock == &main_wake_lock)
 			update_sleep_wait_stats_locked(1);
@@ -491,6 +558,30 @@ static void wake_lock_internal(
 
 void wake_lock(struct wake_lock *lock)
 {
+	int flags = ACCESS_ONCE(lock->flags);
+
+	/*
+	 * Locking a lock that is already held without a timeout changes
+	 * nothing but the event count, as long as no wakeup or sleep time
+	 * accounting is pending, so skip list_lock for it.
+	 */
+	if ((flags & (WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE)) ==
+	    WAKE_LOCK_ACTIVE && lock != &main_wake_lock &&
+	    !(debug_mask & DEBUG_WAKE_LOCK)) {
+		if ((flags & WAKE_LOCK_TYPE_MASK) != WAKE_LOCK_SUSPEND) {
+			wakelock_op_inc(lock_fast);
+			return;
+		}
+#ifdef CONFIG_WAKELOCK_STAT
+		if (!ACCESS_ONCE(wait_for_wakeup) &&
+		    wake_lock_active(&main_wake_lock))
+#endif
+		{
+			atomic_inc(&current_event_num);
+			wakelock_op_inc(lock_fast);
+			return;
+		}
+	}
 	wake_lock_internal(lock, 0, 0);
 }
 EXPORT_SYMBOL(wake_lock);
@@ -506,12 +597,14 @@ void wake_unlock(struct wake_lock *lock)
 	int type;
 	unsigned long irqflags;
 	spin_lock_irqsave(&list_lock, irqflags);
+	wakelock_op_inc(unlock);
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_unlock_stat_locked(lock, 0);
 #endif
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_unlock: %s\n", lock->name);
+	deactivate_wake_lock_locked(lock, type);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
 	list_del(&lock->link);
 	list_add(&lock->link, &inactive_locks);
@@ -561,6 +654,40 @@ static const struct file_operations wakelock_stats_fops = {
 	.release = single_release,
 };
 
+#ifdef CONFIG_WAKELOCK_STAT
+static int wakelock_ops_show(struct seq_file *m, void *unused)
+{
+	struct wakelock_op_stats sum = { 0 };
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct wakelock_op_stats *s = &per_cpu(wakelock_op_stats, cpu);
+
+		sum.lock += s->lock;
+		sum.lock_fast += s->lock_fast;
+		sum.unlock += s->unlock;
+		sum.expire += s->expire;
+	}
+	seq_printf(m, "lock\tlock_fast\tunlock\texpire\n");
+	seq_printf(m, "%lu\t%lu\t%lu\t%lu\n",
+		   sum.lock, sum.lock_fast, sum.unlock, sum.expire);
+	return 0;
+}
+
+static int wakelock_ops_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, wakelock_ops_show, NULL);
+}
+
+static const struct file_operations wakelock_ops_fops = {
+	.owner = THIS_MODULE,
+	.open = wakelock_ops_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+#endif
+
 static int __init wakelocks_init(void)
 {
 	int ret;
@@ -604,6 +731,7 @@ static int __init wakelocks_init(void)
 
 #ifdef CONFIG_WAKELOCK_STAT
 	proc_create("wakelocks", S_IRUGO, NULL, &wakelock_stats_fops);
+	proc_create("wakelock_ops", S_IRUGO, NULL, &wakelock_ops_fops);
 #endif
 
 	return 0;
@@ -624,6 +752,7 @@ err_platform_device_register:
 static void  __exit wakelocks_exit(void)
 {
 #ifdef CONFIG_WAKELOCK_STAT
+	remove_proc_entry("wakelock_ops", NULL);
 	remove_proc_entry("wakelocks", NULL);
 #endif
 	destroy_workqueue(suspend_work_queue);
@@ -0,0 +1,449 @@
+/*
+ * binder-pingpong.c -- binder transaction ping-pong stress test
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * The parent becomes the context manager and serves handle 0 from a
+ * number of looper threads, echoing every transaction back as its reply.
+ * It then forks client processes which each run several threads calling
+ * handle 0 with payloads of random size.  Every payload carries its own
+ * sequence number and length and is checked by the server and, through
+ * the reply, by the client.  With -o a share of the calls is sent
+ * one-way, which exercises the async queue of the node alongside the
+ * synchronous calls.
+ *
+ * At the end each client prints its round trip latencies, and the parent
+ * prints the aggregate call rate and the number of failed and corrupted
+ * transactions.  Only one context manager can exist, so on Android stop
+ * the framework and servicemanager first ("stop; stop servicemanager").
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -o binder-pingpong binder-pingpong.c -lpthread -lrt */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* from drivers/staging/android/binder.h */
+struct binder_write_read {
+	signed long	write_size;
+	signed long	write_consumed;
+	unsigned long	write_buffer;
+	signed long	read_size;
+	signed long	read_consumed;
+	unsigned long	read_buffer;
+};
+
+struct binder_version {
+	signed long	protocol_version;
+};
+
+struct binder_transaction_data {
+	union {
+		size_t	handle;
+		void	*ptr;
+	} target;
+	void		*cookie;
+	unsigned int	code;
+	unsigned int	flags;
+	pid_t		sender_pid;
+	uid_t		sender_euid;
+	size_t		data_size;
+	size_t		offsets_size;
+	union {
+		struct {
+			const void	*buffer;
+			const void	*offsets;
+		} ptr;
+		uint8_t	buf[8];
+	} data;
+};
+
+struct binder_ptr_cookie {
+	void *ptr;
+	void *cookie;
+};
+
+#define BINDER_CURRENT_PROTOCOL_VERSION 7
+#define BINDER_WRITE_READ	_IOWR('b', 1, struct binder_write_read)
+#define BINDER_SET_CONTEXT_MGR	_IOW('b', 7, int)
+#define BINDER_VERSION		_IOWR('b', 9, struct binder_version)
+
+#define TF_ONE_WAY		0x01
+
+#define BR_ERROR		_IOR('r', 0, int)
+#define BR_OK			_IO('r', 1)
+#define BR_TRANSACTION		_IOR('r', 2, struct binder_transaction_data)
+#define BR_REPLY		_IOR('r', 3, struct binder_transaction_data)
+#define BR_DEAD_REPLY		_IO('r', 5)
+#define BR_TRANSACTION_COMPLETE	_IO('r', 6)
+#define BR_INCREFS		_IOR('r', 7, struct binder_ptr_cookie)
+#define BR_ACQUIRE		_IOR('r', 8, struct binder_ptr_cookie)
+#define BR_RELEASE		_IOR('r', 9, struct binder_ptr_cookie)
+#define BR_DECREFS		_IOR('r', 10, struct binder_ptr_cookie)
+#define BR_NOOP			_IO('r', 12)
+#define BR_SPAWN_LOOPER		_IO('r', 13)
+#define BR_FAILED_REPLY		_IO('r', 17)
+
+#define BC_TRANSACTION		_IOW('c', 0, struct binder_transaction_data)
+#define BC_REPLY		_IOW('c', 1, struct binder_transaction_data)
+#define BC_FREE_BUFFER		_IOW('c', 3, int)
+#define BC_ENTER_LOOPER		_IO('c', 12)
+
+#define MAP_SIZE		(1024 * 1024)
+#define READ_SIZE		256
+
+struct txn_cmd {
+	uint32_t cmd;
+	struct binder_transaction_data tr;
+} __attribute__((packed));
+
+struct free_cmd {
+	uint32_t cmd;
+	const void *ptr;
+} __attribute__((packed));
+
+static int nr_procs = 4, nr_threads = 4, nr_servers = 4, oneway_pct;
+static unsigned long iterations = 10000;
+static size_t max_size = 4096;
+static unsigned long srv_bad;
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int binder_open(void)
+{
+	struct binder_version vers;
+	int fd;
+
+	fd = open("/dev/binder", O_RDWR);
+	if (fd < 0) {
+		perror("/dev/binder");
+		exit(1);
+	}
+	if (ioctl(fd, BINDER_VERSION, &vers) < 0 ||
+	    vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol version mismatch\n");
+		exit(1);
+	}
+	if (mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, fd, 0) ==
+	    MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	return fd;
+}
+
+static int binder_write_read(int fd, const void *wbuf, size_t wlen,
+			     void *rbuf, size_t rlen, size_t *rgot)
+{
+	struct binder_write_read bwr;
+	int ret;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_size = wlen;
+	bwr.write_buffer = (unsigned long)wbuf;
+	bwr.read_size = rlen;
+	bwr.read_buffer = (unsigned long)rbuf;
+	do {
+		ret = ioctl(fd, BINDER_WRITE_READ, &bwr);
+	} while (ret < 0 && errno == EINTR && !bwr.write_consumed &&
+		 !bwr.read_consumed);
+	if (ret < 0) {
+		perror("BINDER_WRITE_READ");
+		return -1;
+	}
+	if (rgot)
+		*rgot = bwr.read_consumed;
+	return 0;
+}
+
+/*
+ * Payload: word 0 is the sequence number, word 1 the length in bytes,
+ * the rest a pattern derived from both.
+ */
+static void fill(uint32_t *p, uint32_t seq, size_t len)
+{
+	size_t i;
+
+	p[0] = seq;
+	p[1] = len;
+	for (i = 2; i < len / 4; i++)
+		p[i] = seq * 2654435761u ^ i;
+}
+
+static int check(const uint32_t *p, size_t len)
+{
+	size_t i;
+
+	if (len < 8 || len % 4 || p[1] != len)
+		return -1;
+	for (i = 2; i < len / 4; i++)
+		if (p[i] != (p[0] * 2654435761u ^ i))
+			return -1;
+	return 0;
+}
+
+static void free_buffer(int fd, const void *ptr)
+{
+	struct free_cmd fc = { BC_FREE_BUFFER, ptr };
+
+	binder_write_read(fd, &fc, sizeof(fc), NULL, 0, NULL);
+}
+
+/* skip the payload of a return command we are not interested in */
+static size_t br_size(uint32_t cmd)
+{
+	return _IOC_SIZE(cmd);
+}
+
+static void *server_thread(void *arg)
+{
+	int fd = (long)arg;
+	uint32_t rbuf[READ_SIZE / 4];
+	uint32_t enter = BC_ENTER_LOOPER;
+	struct {
+		struct txn_cmd reply;
+		struct free_cmd fc;
+	} __attribute__((packed)) w;
+	const void *wptr = &enter;
+	size_t wlen = sizeof(enter), got, pos;
+
+	for (;;) {
+		if (binder_write_read(fd, wptr, wlen, rbuf, sizeof(rbuf),
+				      &got))
+			exit(1);
+		wlen = 0;
+		for (pos = 0; pos < got; ) {
+			uint32_t cmd = *(uint32_t *)((char *)rbuf + pos);
+			struct binder_transaction_data *tr;
+
+			pos += sizeof(cmd);
+			if (cmd != BR_TRANSACTION) {
+				pos += br_size(cmd);
+				continue;
+			}
+			tr = (void *)((char *)rbuf + pos);
+			pos += sizeof(*tr);
+
+			if (check(tr->data.ptr.buffer, tr->data_size))
+				__sync_fetch_and_add(&srv_bad, 1);
+			if (tr->flags & TF_ONE_WAY) {
+				free_buffer(fd, tr->data.ptr.buffer);
+				continue;
+			}
+			/* echo the payload, then give the buffer back */
+			memset(&w, 0, sizeof(w));
+			w.reply.cmd = BC_REPLY;
+			w.reply.tr.data_size = tr->data_size;
+			w.reply.tr.data.ptr.buffer = tr->data.ptr.buffer;
+			w.fc.cmd = BC_FREE_BUFFER;
+			w.fc.ptr = tr->data.ptr.buffer;
+			if (binder_write_read(fd, &w, sizeof(w), NULL, 0, NULL))
+				exit(1);
+		}
+	}
+	return NULL;
+}
+
+struct client_stats {
+	int fd;
+	unsigned long calls, failed, bad;
+	double lat_sum, lat_max;
+	unsigned int seed;
+};
+
+static void *client_thread(void *arg)
+{
+	struct client_stats *st = arg;
+	int fd = st->fd;
+	uint32_t *data = malloc(max_size);
+	uint32_t rbuf[READ_SIZE / 4];
+	struct txn_cmd tc;
+	unsigned long i;
+
+	for (i = 0; i < iterations; i++) {
+		size_t len = 8 + (rand_r(&st->seed) % (max_size / 4 - 1)) * 4;
+		int oneway = rand_r(&st->seed) % 100 < oneway_pct;
+		const void *wptr = &tc;
+		size_t wlen = sizeof(tc), got, pos;
+		int done = 0;
+		double t;
+
+		fill(data, (uint32_t)(i * 7919 + st->seed), len);
+		memset(&tc, 0, sizeof(tc));
+		tc.cmd = BC_TRANSACTION;
+		tc.tr.target.handle = 0;
+		tc.tr.code = 1;
+		tc.tr.flags = oneway ? TF_ONE_WAY : 0;
+		tc.tr.data_size = len;
+		tc.tr.data.ptr.buffer = data;
+
+		t = now_us();
+		while (!done) {
+			if (binder_write_read(fd, wptr, wlen, rbuf,
+					      sizeof(rbuf), &got))
+				exit(1);
+			wlen = 0;
+			for (pos = 0; pos < got; ) {
+				uint32_t cmd = *(uint32_t *)((char *)rbuf + pos);
+				struct binder_transaction_data *tr;
+
+				pos += sizeof(cmd);
+				switch (cmd) {
+				case BR_TRANSACTION_COMPLETE:
+					if (oneway)
+						done = 1;
+					break;
+				case BR_REPLY:
+					tr = (void *)((char *)rbuf + pos);
+					if (tr->data_size != len ||
+					    memcmp(tr->data.ptr.buffer, data,
+						   len))
+						st->bad++;
+					free_buffer(fd, tr->data.ptr.buffer);
+					done = 1;
+					break;
+				case BR_DEAD_REPLY:
+				case BR_FAILED_REPLY:
+					st->failed++;
+					done = 1;
+					break;
+				}
+				pos += br_size(cmd);
+			}
+		}
+		t = now_us() - t;
+		st->calls++;
+		st->lat_sum += t;
+		if (t > st->lat_max)
+			st->lat_max = t;
+	}
+	free(data);
+	return NULL;
+}
+
+static int client(int id)
+{
+	struct client_stats *st = calloc(nr_threads, sizeof(*st));
+	pthread_t *tids = calloc(nr_threads, sizeof(*tids));
+	struct client_stats sum;
+	int fd = binder_open();
+	int i;
+
+	memset(&sum, 0, sizeof(sum));
+	for (i = 0; i < nr_threads; i++) {
+		st[i].fd = fd;
+		st[i].seed = id * nr_threads + i;
+		pthread_create(&tids[i], NULL, client_thread, &st[i]);
+	}
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(tids[i], NULL);
+		sum.calls += st[i].calls;
+		sum.failed += st[i].failed;
+		sum.bad += st[i].bad;
+		sum.lat_sum += st[i].lat_sum;
+		if (st[i].lat_max > sum.lat_max)
+			sum.lat_max = st[i].lat_max;
+	}
+	printf("client %d: %lu calls, %lu failed, %lu corrupted, "
+	       "latency avg %.1f us, max %.1f us\n", id, sum.calls,
+	       sum.failed, sum.bad, sum.calls ? sum.lat_sum / sum.calls : 0,
+	       sum.lat_max);
+	fflush(stdout);
+	return sum.failed || sum.bad;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-p <processes>] [-t <threads per process>]\n"
+		"       [-S <server threads>] [-n <calls per thread>]\n"
+		"       [-s <max payload bytes>] [-o <one-way percent>]\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t tid;
+	double t;
+	int c, fd, i, status, ret = 0;
+
+	while ((c = getopt(argc, argv, "p:t:S:n:s:o:")) != -1) {
+		switch (c) {
+		case 'p':
+			nr_procs = atoi(optarg);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'S':
+			nr_servers = atoi(optarg);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			max_size = strtoul(optarg, NULL, 0) & ~(size_t)3;
+			break;
+		case 'o':
+			oneway_pct = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_procs < 1 || nr_threads < 1 || nr_servers < 1 ||
+	    max_size < 8 || max_size > MAP_SIZE / 4)
+		usage(argv[0]);
+
+	fd = binder_open();
+	if (ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0) {
+		perror("BINDER_SET_CONTEXT_MGR");
+		return 1;
+	}
+	for (i = 0; i < nr_servers; i++)
+		pthread_create(&tid, NULL, server_thread, (void *)(long)fd);
+
+	t = now_us();
+	for (i = 0; i < nr_procs; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (!pid) {
+			close(fd);
+			_exit(client(i));
+		}
+	}
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			ret = 1;
+	t = now_us() - t;
+
+	printf("total: %lu calls in %.0f ms, %.0f calls/s, "
+	       "%lu corrupted at the server\n",
+	       iterations * nr_procs * nr_threads, t / 1000,
+	       iterations * nr_procs * nr_threads / (t / 1e6), srv_bad);
+	return ret || srv_bad;
+}
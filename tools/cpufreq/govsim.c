@@ -0,0 +1,615 @@
+/*
+ * govsim.c -- trace driven model of the ondemand and interactive cpufreq
+ *             governors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Replays a load trace against models of the ondemand governor and of the
+ * interactive governor (drivers/cpufreq/cpufreq_interactive.c) and reports
+ * for each the energy used and the response latency of the traced work.
+ *
+ * A trace has one work item per line, sorted by arrival time:
+ *
+ *	<arrival time in ms> <work in millions of cycles> [i]
+ *
+ * Items run to completion in arrival order on one CPU at the current
+ * speed; an item's latency is the time from its arrival to its completion.
+ * 'i' marks work started by an input event (touch, key), which is what the
+ * interactive governor boosts on.  Lines starting with '#' are ignored.
+ *
+ * To record a trace on a device, pin the speed with the userspace governor,
+ * record sched_switch events to and from the idle task with ftrace together
+ * with the input event times from getevent, and write every busy period as
+ * an item of (busy time * pinned speed) cycles.  "govsim -g <seconds>"
+ * writes a synthetic touch-and-scroll trace instead.
+ *
+ * The speeds and voltages are those of the S5PV210 table up to 1 GHz.
+ * Power is modelled as Ceff * V^2 * f while busy plus leakage that scales
+ * with the voltage, busy or idle; a speed change stalls the CPU for the
+ * transition latency.  The numbers are meant for comparing governors and
+ * tunables on the same trace, not as absolute energy figures.
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -o govsim govsim.c */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TICK_US			100
+#define CEFF_PF			250	/* switched capacitance */
+#define LEAK_UW_PER_MV		40	/* leakage per mV of supply */
+
+struct opp {
+	unsigned int mhz;
+	unsigned int mv;
+};
+
+/* ascending */
+static const struct opp opps[] = {
+	{  100,  950 },
+	{  200,  950 },
+	{  400, 1050 },
+	{  600, 1200 },
+	{  800, 1275 },
+	{ 1000, 1350 },
+};
+#define NR_OPPS		(int)(sizeof(opps) / sizeof(opps[0]))
+#define OPP_MIN		0
+#define OPP_MAX		(NR_OPPS - 1)
+
+struct item {
+	double arrival;		/* us */
+	double mcycles;
+	int input;
+	double done;		/* us */
+};
+
+struct sim {
+	double now;		/* us */
+	int cur;		/* current speed, index into opps[] */
+	int busy;
+	double busy_time;	/* us spent busy since the start */
+	double stall_until;	/* us, speed change in progress */
+	double energy;		/* uJ */
+	unsigned int changes;
+};
+
+struct governor {
+	const char *name;
+	void (*start)(struct sim *s);
+	void (*timer)(struct sim *s);
+	void (*idle_start)(struct sim *s);
+	void (*idle_end)(struct sim *s);
+	void (*input)(struct sim *s);
+};
+
+static unsigned int trans_us = 100;
+
+/* lowest speed at or above mhz, like CPUFREQ_RELATION_L */
+static int opp_ceil(unsigned int mhz)
+{
+	int i;
+
+	for (i = 0; i < NR_OPPS; i++)
+		if (opps[i].mhz >= mhz)
+			return i;
+	return OPP_MAX;
+}
+
+static void set_speed(struct sim *s, int opp)
+{
+	if (opp == s->cur)
+		return;
+	s->cur = opp;
+	s->changes++;
+	s->stall_until = s->now + trans_us;
+}
+
+/* load in percent over the window that started at (*start, *start_busy) */
+static unsigned int window_load(struct sim *s, double *start,
+				double *start_busy)
+{
+	double wall = s->now - *start;
+	double busy = s->busy_time - *start_busy;
+
+	*start = s->now;
+	*start_busy = s->busy_time;
+	if (wall <= 0)
+		return 0;
+	return (unsigned int)(100 * busy / wall);
+}
+
+/*
+ * ondemand, as dbs_check_cpu() in drivers/cpufreq/cpufreq_ondemand.c: a
+ * fixed sampling period, straight to the top speed above up_threshold,
+ * otherwise the lowest speed that keeps the load under up_threshold minus
+ * down_differential.
+ */
+static struct {
+	unsigned int sampling_rate;	/* us */
+	unsigned int up_threshold;
+	unsigned int down_differential;
+	double next;
+	double win_start, win_busy;
+} od = {
+	.sampling_rate = 100000,	/* 1000 * the 100 us S5PV210 latency */
+	.up_threshold = 80,
+	.down_differential = 10,
+};
+
+static void od_start(struct sim *s)
+{
+	od.next = s->now + od.sampling_rate;
+	od.win_start = s->now;
+	od.win_busy = s->busy_time;
+}
+
+static void od_timer(struct sim *s)
+{
+	unsigned int load, load_freq;
+
+	if (s->now < od.next)
+		return;
+	od.next = s->now + od.sampling_rate;
+
+	load = window_load(s, &od.win_start, &od.win_busy);
+	load_freq = load * opps[s->cur].mhz;
+	if (load_freq > od.up_threshold * opps[s->cur].mhz) {
+		set_speed(s, OPP_MAX);
+		return;
+	}
+	if (load_freq < (od.up_threshold - od.down_differential) *
+			opps[s->cur].mhz)
+		set_speed(s, opp_ceil(load_freq /
+			  (od.up_threshold - od.down_differential)));
+}
+
+static void od_nop(struct sim *s)
+{
+	(void)s;
+}
+
+static const struct governor ondemand = {
+	.name = "ondemand",
+	.start = od_start,
+	.timer = od_timer,
+	.idle_start = od_nop,
+	.idle_end = od_nop,
+	.input = od_nop,
+};
+
+/*
+ * interactive, following cpufreq_interactive.c: a short timer restarted on
+ * idle exit and cancelled while idle at the lowest speed, history based
+ * load prediction, min_sample_time before lowering the speed, and boost to
+ * hispeed_freq on input.
+ */
+#define MAX_HISTORY_LEN		8
+
+static struct {
+	unsigned int timer_rate;	/* us */
+	unsigned int min_sample_time;	/* us */
+	unsigned int go_hispeed_load;
+	unsigned int history_len;
+	unsigned int boostpulse_duration; /* us */
+	int hispeed;			/* index into opps[] */
+	double timer;			/* expiry, < 0 if not pending */
+	double win_start, win_busy;
+	double freq_change_time;
+	double boost_until;
+	int idling, timer_idlecancel, target;
+	unsigned int load_hist[MAX_HISTORY_LEN];
+	unsigned int hist_head, hist_count;
+} ia = {
+	.timer_rate = 20000,
+	.min_sample_time = 80000,
+	.go_hispeed_load = 85,
+	.history_len = 4,
+	.boostpulse_duration = 500000,
+	.hispeed = OPP_MAX,
+};
+
+static unsigned int ia_predict_load(unsigned int load)
+{
+	unsigned int n, i, idx, weight;
+	unsigned int sum = 0, wsum = 0, oldest = load;
+	int pred;
+
+	ia.load_hist[ia.hist_head] = load;
+	ia.hist_head = (ia.hist_head + 1) % MAX_HISTORY_LEN;
+	if (ia.hist_count < MAX_HISTORY_LEN)
+		ia.hist_count++;
+
+	n = ia.history_len < ia.hist_count ? ia.history_len : ia.hist_count;
+	for (i = 0; i < n; i++) {
+		idx = (ia.hist_head + MAX_HISTORY_LEN - 1 - i) %
+			MAX_HISTORY_LEN;
+		weight = n - i;
+		sum += ia.load_hist[idx] * weight;
+		wsum += weight;
+		oldest = ia.load_hist[idx];
+	}
+
+	pred = sum / wsum;
+	if (n > 1)
+		pred += ((int)load - (int)oldest) / (int)(n - 1);
+	if (pred < 0)
+		pred = 0;
+	if (pred > 100)
+		pred = 100;
+	return pred;
+}
+
+static void ia_arm(struct sim *s)
+{
+	ia.timer = s->now + ia.timer_rate;
+}
+
+static void ia_start(struct sim *s)
+{
+	ia.target = s->cur;
+	ia.win_start = s->now;
+	ia.win_busy = s->busy_time;
+	ia.freq_change_time = s->now;
+	ia.boost_until = -1;
+	ia.hist_count = 0;
+	ia.idling = !s->busy;
+	ia.timer_idlecancel = 0;
+	ia_arm(s);
+}
+
+static void ia_timer(struct sim *s)
+{
+	unsigned int load, pred, mhz;
+	int opp;
+
+	if (ia.timer < 0 || s->now < ia.timer)
+		return;
+	ia.timer = -1;
+
+	load = window_load(s, &ia.win_start, &ia.win_busy);
+	pred = ia_predict_load(load);
+	if (pred < load)
+		pred = load;
+
+	if (pred >= ia.go_hispeed_load && s->cur < ia.hispeed)
+		mhz = opps[ia.hispeed].mhz;
+	else
+		mhz = opps[OPP_MAX].mhz * pred / 100;
+	if (s->now < ia.boost_until && mhz < opps[ia.hispeed].mhz)
+		mhz = opps[ia.hispeed].mhz;
+	opp = opp_ceil(mhz);
+
+	if (!(opp < ia.target &&
+	      s->now - ia.freq_change_time < ia.min_sample_time) &&
+	    opp != ia.target) {
+		ia.target = opp;
+		ia.freq_change_time = s->now;
+		set_speed(s, opp);
+	}
+
+	if (ia.idling && ia.target == OPP_MIN)
+		ia.timer_idlecancel = 1;
+	else
+		ia_arm(s);
+}
+
+static void ia_idle_start(struct sim *s)
+{
+	ia.idling = 1;
+	if (ia.target != OPP_MIN && ia.timer < 0) {
+		ia.win_start = s->now;
+		ia.win_busy = s->busy_time;
+		ia.timer_idlecancel = 0;
+		ia_arm(s);
+	}
+}
+
+static void ia_idle_end(struct sim *s)
+{
+	ia.idling = 0;
+	if (ia.timer < 0) {
+		if (ia.timer_idlecancel) {
+			ia.hist_count = 0;
+			ia.timer_idlecancel = 0;
+		}
+		ia.win_start = s->now;
+		ia.win_busy = s->busy_time;
+		ia_arm(s);
+	}
+}
+
+static void ia_input(struct sim *s)
+{
+	ia.boost_until = s->now + ia.boostpulse_duration;
+	if (ia.target < ia.hispeed) {
+		ia.target = ia.hispeed;
+		set_speed(s, ia.hispeed);
+	}
+}
+
+static const struct governor interactive = {
+	.name = "interactive",
+	.start = ia_start,
+	.timer = ia_timer,
+	.idle_start = ia_idle_start,
+	.idle_end = ia_idle_end,
+	.input = ia_input,
+};
+
+static void power_tick(struct sim *s)
+{
+	double mv = opps[s->cur].mv;
+	double uw = LEAK_UW_PER_MV * mv;
+
+	if (s->busy)
+		uw += (double)CEFF_PF * mv * mv * opps[s->cur].mhz / 1e6;
+	s->energy += uw * TICK_US / 1e6;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* mean, 95th percentile and maximum latency in ms of the selected items */
+static void latency(struct item *items, int nr, int input_only,
+		    double *avg, double *p95, double *max)
+{
+	double *lat, sum = 0;
+	int i, n = 0;
+
+	*avg = *p95 = *max = 0;
+	lat = malloc(nr * sizeof(*lat));
+	if (!lat) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < nr; i++) {
+		if (input_only && !items[i].input)
+			continue;
+		lat[n] = (items[i].done - items[i].arrival) / 1000;
+		sum += lat[n++];
+	}
+	if (n) {
+		qsort(lat, n, sizeof(*lat), cmp_double);
+		*avg = sum / n;
+		*p95 = lat[(n * 95 + 99) / 100 - 1];
+		*max = lat[n - 1];
+	}
+	free(lat);
+}
+
+static void report(const char *name, struct sim *s, struct item *items,
+		   int nr)
+{
+	double avg, p95, max, iavg, ip95, imax;
+
+	latency(items, nr, 0, &avg, &p95, &max);
+	latency(items, nr, 1, &iavg, &ip95, &imax);
+	printf("%-12s %10.1f %8.2f %8.2f %8.2f %8.2f %8.2f %8u\n", name,
+	       s->energy / 1000, avg, p95, max, iavg, ip95, s->changes);
+}
+
+static void run(const struct governor *gov, struct item *items, int nr)
+{
+	struct sim s = { .cur = OPP_MIN };
+	int next = 0, head = 0;
+	double left = 0, end;
+
+	/* same wall time for every governor: until 1 s after the last item */
+	end = items[nr - 1].arrival + 1000000;
+
+	gov->start(&s);
+	while (head < nr || s.now < end) {
+		while (next < nr && items[next].arrival <= s.now) {
+			if (items[next].input)
+				gov->input(&s);
+			if (next++ == head) {
+				left = items[head].mcycles * 1e6;
+				s.busy = 1;
+				gov->idle_end(&s);
+			}
+		}
+
+		power_tick(&s);
+
+		if (s.busy) {
+			double cycles = 0;
+
+			s.busy_time += TICK_US;
+			if (s.now >= s.stall_until)
+				cycles = (double)opps[s.cur].mhz * TICK_US;
+			while (cycles > 0 && head < next) {
+				if (left > cycles) {
+					left -= cycles;
+					break;
+				}
+				cycles -= left;
+				items[head].done = s.now + TICK_US -
+					cycles / opps[s.cur].mhz;
+				if (++head < next)
+					left = items[head].mcycles * 1e6;
+			}
+		}
+
+		s.now += TICK_US;
+
+		if (s.busy && head == next) {
+			s.busy = 0;
+			gov->idle_start(&s);
+		}
+		gov->timer(&s);
+	}
+
+	report(gov->name, &s, items, nr);
+}
+
+static int read_trace(FILE *f, struct item **items)
+{
+	struct item *it = NULL;
+	int nr = 0, size = 0, line = 0;
+	char buf[128], flag[8];
+	double ms, mcycles;
+	int n;
+
+	while (fgets(buf, sizeof(buf), f)) {
+		line++;
+		if (buf[0] == '#' || buf[0] == '\n')
+			continue;
+		flag[0] = 0;
+		n = sscanf(buf, "%lf %lf %7s", &ms, &mcycles, flag);
+		if (n < 2 || ms < 0 || mcycles <= 0 ||
+		    (n == 3 && strcmp(flag, "i")) ||
+		    (nr && ms * 1000 < it[nr - 1].arrival)) {
+			fprintf(stderr, "line %d: bad item\n", line);
+			return -EINVAL;
+		}
+		if (nr == size) {
+			size = size ? size * 2 : 1024;
+			it = realloc(it, size * sizeof(*it));
+			if (!it)
+				return -ENOMEM;
+		}
+		it[nr].arrival = ms * 1000;
+		it[nr].mcycles = mcycles;
+		it[nr].input = n == 3;
+		it[nr].done = 0;
+		nr++;
+	}
+	*items = it;
+	return nr;
+}
+
+static unsigned int rnd_state = 1;
+
+static unsigned int rnd(unsigned int n)
+{
+	rnd_state = rnd_state * 1103515245 + 12345;
+	return (rnd_state >> 16) % n;
+}
+
+/*
+ * Synthetic touch-and-scroll trace: background housekeeping every 100 ms,
+ * and every 1 to 4 s a touch that starts 0.3 to 1 s of frames at 60 Hz.
+ */
+static void gen_trace(unsigned int seconds)
+{
+	unsigned int t = 0, end = seconds * 1000000, gesture = 500000;
+	unsigned int frame_until = 0, next_frame = 0, next_bg = 0;
+
+	printf("# govsim synthetic trace, %u s\n", seconds);
+	while (t < end) {
+		if (t >= gesture) {
+			printf("%.3f %.2f i\n", t / 1000.0,
+			       4 + rnd(400) / 100.0);
+			frame_until = t + 300000 + rnd(700) * 1000;
+			next_frame = t + 16667;
+			gesture = t + 1000000 + rnd(3000) * 1000;
+		}
+		if (t < frame_until && t >= next_frame) {
+			printf("%.3f %.2f\n", t / 1000.0,
+			       3 + rnd(900) / 100.0);
+			next_frame += 16667;
+		}
+		if (t >= next_bg) {
+			printf("%.3f %.2f\n", t / 1000.0,
+			       0.1 + rnd(30) / 100.0);
+			next_bg += 100000;
+		}
+		t += 1000;
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] <trace>\n"
+		"       %s -g <seconds> [-S <seed>]\n"
+		"  -s <ms>   ondemand sampling_rate (%u)\n"
+		"  -u <pct>  ondemand up_threshold (%u)\n"
+		"  -r <ms>   interactive timer_rate (%u)\n"
+		"  -m <ms>   interactive min_sample_time (%u)\n"
+		"  -l <n>    interactive history_len (%u)\n"
+		"  -t <us>   speed transition latency (%u)\n",
+		prog, prog, od.sampling_rate / 1000, od.up_threshold,
+		ia.timer_rate / 1000, ia.min_sample_time / 1000,
+		ia.history_len, trans_us);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const struct governor *govs[] = { &ondemand, &interactive };
+	struct item *items;
+	unsigned int gen = 0;
+	FILE *f;
+	int c, i, nr;
+
+	while ((c = getopt(argc, argv, "g:S:s:u:r:m:l:t:")) != -1) {
+		switch (c) {
+		case 'g':
+			gen = atoi(optarg);
+			break;
+		case 'S':
+			rnd_state = atoi(optarg);
+			break;
+		case 's':
+			od.sampling_rate = atoi(optarg) * 1000;
+			break;
+		case 'u':
+			od.up_threshold = atoi(optarg);
+			break;
+		case 'r':
+			ia.timer_rate = atoi(optarg) * 1000;
+			break;
+		case 'm':
+			ia.min_sample_time = atoi(optarg) * 1000;
+			break;
+		case 'l':
+			ia.history_len = atoi(optarg);
+			break;
+		case 't':
+			trans_us = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (gen) {
+		gen_trace(gen);
+		return 0;
+	}
+	if (optind != argc - 1 || !od.sampling_rate || !ia.timer_rate ||
+	    od.up_threshold <= od.down_differential ||
+	    od.up_threshold > 100 || !ia.history_len ||
+	    ia.history_len > MAX_HISTORY_LEN)
+		usage(argv[0]);
+
+	f = strcmp(argv[optind], "-") ? fopen(argv[optind], "r") : stdin;
+	if (!f) {
+		perror(argv[optind]);
+		return 1;
+	}
+	nr = read_trace(f, &items);
+	if (nr <= 0) {
+		fprintf(stderr, "%s: no work items\n", argv[optind]);
+		return 1;
+	}
+
+	printf("%-12s %10s %8s %8s %8s %8s %8s %8s\n", "governor",
+	       "energy-mJ", "avg-ms", "p95-ms", "max-ms", "in-avg", "in-p95",
+	       "changes");
+	for (i = 0; i < (int)(sizeof(govs) / sizeof(govs[0])); i++)
+		run(govs[i], items, nr);
+
+	return 0;
+}
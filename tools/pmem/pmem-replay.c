@@ -0,0 +1,275 @@
+/*
+ * pmem-replay.c -- replays an allocation trace against a pmem region
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * A trace has one operation per line:
+ *
+ *	a <tag> <bytes>		allocate a buffer and name it <tag>
+ *	f <tag>			free the buffer named <tag>
+ *
+ * Tags are numbers below MAX_TAGS.  Every allocation opens the device and
+ * issues PMEM_ALLOCATE, a free closes the file.  With -v each buffer is
+ * filled with a pattern through a mapping that is dropped again, so that
+ * compaction may move it, and checked through a new mapping before it is
+ * freed; this catches compaction moving data wrongly.  "pmem-replay -g
+ * <ops>" writes a synthetic camera/video style trace of a few large frame
+ * buffers among many small ones.
+ *
+ * At the end it prints the number of failed allocations, PMEM_ALLOCATE
+ * latencies and, with -f, the region's <name>_frag debugfs report
+ * (when pmem.c is built with PMEM_DEBUG).
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -o pmem-replay pmem-replay.c -lrt */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/* from include/linux/android_pmem.h */
+#define PMEM_IOCTL_MAGIC	'p'
+#define PMEM_ALLOCATE		_IOW(PMEM_IOCTL_MAGIC, 5, unsigned int)
+
+#define MAX_TAGS		4096
+
+struct buffer {
+	int fd;
+	size_t len;		/* 0 if not allocated */
+};
+
+static struct buffer bufs[MAX_TAGS];
+static int verify;
+static unsigned long nr_alloc, nr_fail, nr_free, nr_bad;
+static double lat_sum, lat_max;
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static unsigned int pattern(int tag, size_t i)
+{
+	return ((unsigned int)tag << 20) ^ (unsigned int)i ^ 0x5a5a5a5a;
+}
+
+/* fill (check == 0) or check the buffer through a temporary mapping */
+static int touch(int tag, int check)
+{
+	struct buffer *b = &bufs[tag];
+	unsigned int *p;
+	size_t i, n = b->len / sizeof(*p);
+	int bad = 0;
+
+	p = mmap(NULL, b->len, PROT_READ | PROT_WRITE, MAP_SHARED, b->fd, 0);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "tag %d: mmap: %s\n", tag, strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (!check)
+			p[i] = pattern(tag, i);
+		else if (p[i] != pattern(tag, i)) {
+			fprintf(stderr, "tag %d: word %zu is %08x, not %08x\n",
+				tag, i, p[i], pattern(tag, i));
+			bad = 1;
+			break;
+		}
+	}
+	munmap(p, b->len);
+	return bad;
+}
+
+static void do_alloc(const char *dev, int tag, size_t len)
+{
+	struct buffer *b = &bufs[tag];
+	double t;
+	int ret;
+
+	if (b->len) {
+		fprintf(stderr, "tag %d allocated twice\n", tag);
+		exit(1);
+	}
+	b->fd = open(dev, O_RDWR);
+	if (b->fd < 0) {
+		perror(dev);
+		exit(1);
+	}
+	t = now_us();
+	ret = ioctl(b->fd, PMEM_ALLOCATE, len);
+	t = now_us() - t;
+	lat_sum += t;
+	if (t > lat_max)
+		lat_max = t;
+	nr_alloc++;
+
+	if (ret < 0) {
+		nr_fail++;
+		close(b->fd);
+		return;
+	}
+	b->len = (len + getpagesize() - 1) & ~(size_t)(getpagesize() - 1);
+	if (verify && touch(tag, 0))
+		nr_bad++;
+}
+
+static void do_free(int tag)
+{
+	struct buffer *b = &bufs[tag];
+
+	if (!b->len)
+		return;		/* the allocation failed */
+	if (verify && touch(tag, 1))
+		nr_bad++;
+	close(b->fd);
+	b->len = 0;
+	nr_free++;
+}
+
+static int replay(const char *dev, FILE *f)
+{
+	char buf[128], op;
+	unsigned long len;
+	int tag, n, line = 0;
+
+	while (fgets(buf, sizeof(buf), f)) {
+		line++;
+		if (buf[0] == '#' || buf[0] == '\n')
+			continue;
+		n = sscanf(buf, "%c %d %lu", &op, &tag, &len);
+		if (n < 2 || tag < 0 || tag >= MAX_TAGS ||
+		    (op == 'a' && (n != 3 || !len)) ||
+		    (op != 'a' && op != 'f')) {
+			fprintf(stderr, "line %d: bad operation\n", line);
+			return -1;
+		}
+		if (op == 'a')
+			do_alloc(dev, tag, len);
+		else
+			do_free(tag);
+	}
+	for (tag = 0; tag < MAX_TAGS; tag++)
+		do_free(tag);
+	return 0;
+}
+
+static unsigned int rnd_state = 1;
+
+static unsigned int rnd(unsigned int n)
+{
+	rnd_state = rnd_state * 1103515245 + 12345;
+	return (rnd_state >> 16) % n;
+}
+
+/*
+ * Synthetic trace: up to 8 live frame buffers of 2 to 6MB, which live
+ * long, and up to 64 live buffers of 4KB to 1MB, which come and go.
+ */
+static void gen_trace(unsigned long ops)
+{
+	int live[MAX_TAGS] = { 0 };
+	int tag;
+
+	printf("# pmem-replay synthetic trace, %lu operations\n", ops);
+	while (ops--) {
+		if (rnd(10) == 0) {
+			tag = rnd(8);
+			if (live[tag] && rnd(4))
+				continue;
+		} else {
+			tag = 8 + rnd(64);
+		}
+		if (live[tag]) {
+			printf("f %d\n", tag);
+		} else if (tag < 8) {
+			printf("a %d %u\n", tag,
+			       (2 << 20) + rnd(4 << 10) * 1024);
+		} else {
+			printf("a %d %u\n", tag, 4096 + rnd(256) * 4096);
+		}
+		live[tag] = !live[tag];
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-v] [-f <debugfs frag file>] <pmem device> <trace>\n"
+		"       %s -g <operations> [-S <seed>]\n", prog, prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *frag = NULL;
+	unsigned long gen = 0;
+	char buf[256];
+	FILE *f;
+	int c;
+
+	while ((c = getopt(argc, argv, "vf:g:S:")) != -1) {
+		switch (c) {
+		case 'v':
+			verify = 1;
+			break;
+		case 'f':
+			frag = optarg;
+			break;
+		case 'g':
+			gen = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			rnd_state = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (gen) {
+		gen_trace(gen);
+		return 0;
+	}
+	if (optind != argc - 2)
+		usage(argv[0]);
+
+	f = strcmp(argv[optind + 1], "-") ? fopen(argv[optind + 1], "r") :
+					     stdin;
+	if (!f) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+	if (replay(argv[optind], f))
+		return 1;
+
+	printf("allocations: %lu, failed: %lu, freed: %lu\n",
+	       nr_alloc, nr_fail, nr_free);
+	printf("PMEM_ALLOCATE latency: avg %.1f us, max %.1f us\n",
+	       nr_alloc ? lat_sum / nr_alloc : 0, lat_max);
+	if (verify)
+		printf("corrupted buffers: %lu\n", nr_bad);
+
+	if (frag) {
+		f = fopen(frag, "r");
+		if (!f) {
+			perror(frag);
+			return 1;
+		}
+		while (fgets(buf, sizeof(buf), f))
+			fputs(buf, stdout);
+		fclose(f);
+	}
+
+	return nr_bad ? 1 : 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * rzs-write-bench.c -- parallel page write throughput of a ramzswap device
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Swap-out reaches ramzswap as single page writes, from kswapd and from
+ * direct reclaim on any CPU.  This program issues the same requests
+ * from user space: each thread writes its own range of the device one
+ * page at a time with O_DIRECT, so that every write becomes one page
+ * sized bio.  The device must be initialized ("rzscontrol <dev> --init")
+ * but not in use as swap.
+ *
+ * Pages are half random and half zero so that LZO has work to do and
+ * the results are comparable with typical anonymous memory; -z writes
+ * zero pages only, which measures the path that skips compression.
+ * After the first pass every write replaces an object already stored
+ * for that page.  Run it with -t 1, 2, 4... to see how writes scale.
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -o rzs-write-bench rzs-write-bench.c -lpthread -lrt */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS	64
+
+static const char *dev;
+static int nr_threads = 1, passes = 4, zero;
+static unsigned long pages = 4096;
+static long page_size;
+static unsigned long nr_errors;
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void *writer(void *arg)
+{
+	long id = (long)arg;
+	unsigned int seed = id + 1;
+	unsigned long i, first = id * pages;
+	unsigned char *buf;
+	size_t j;
+	int fd, p;
+
+	fd = open(dev, O_WRONLY | O_DIRECT);
+	if (fd < 0) {
+		perror(dev);
+		exit(1);
+	}
+	if (posix_memalign((void **)&buf, page_size, page_size)) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	memset(buf, 0, page_size);
+
+	for (p = 0; p < passes; p++) {
+		for (i = first; i < first + pages; i++) {
+			if (!zero)
+				for (j = 0; j < (size_t)page_size / 2; j++)
+					buf[j] = rand_r(&seed);
+			if (pwrite(fd, buf, page_size, (off_t)i * page_size) !=
+			    page_size)
+				__sync_fetch_and_add(&nr_errors, 1);
+		}
+	}
+
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-t <threads>] [-n <pages per thread>] "
+		"[-l <passes>] [-z] <ramzswap device>\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t tids[MAX_THREADS];
+	unsigned long total;
+	double t;
+	long i;
+	int c;
+
+	while ((c = getopt(argc, argv, "t:n:l:z")) != -1) {
+		switch (c) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'n':
+			pages = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			passes = atoi(optarg);
+			break;
+		case 'z':
+			zero = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || nr_threads < 1 ||
+	    nr_threads > MAX_THREADS || !pages || passes < 1)
+		usage(argv[0]);
+	dev = argv[optind];
+	page_size = sysconf(_SC_PAGESIZE);
+
+	t = now_us();
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&tids[i], NULL, writer, (void *)i);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(tids[i], NULL);
+	t = now_us() - t;
+
+	total = pages * nr_threads * passes;
+	printf("%d threads: %lu pages in %.0f ms, %.0f pages/s, %.1f MB/s, "
+	       "%lu failed writes\n", nr_threads, total, t / 1000,
+	       total / (t / 1e6), total * page_size / t, nr_errors);
+	return nr_errors ? 1 : 0;
+}
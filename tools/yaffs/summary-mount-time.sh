@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# summary-mount-time.sh -- compare yaffs2 mount scan time with and
+# without block summaries on a simulated NAND
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# Needs nandsim, mtd-utils (flash_eraseall) and a kernel with yaffs2.
+# The file system is filled once with summaries off and once with them
+# on, and each time it is mounted with no-checkpoint so that the mount
+# has to scan.  The scan reads summaries whenever they are present, the
+# summary-on/off options only control writing them.
+#
+# usage: summary-mount-time.sh [files] [file size in KB] [mounts]
+
+FILES=${1:-2000}
+SIZE=${2:-64}
+RUNS=${3:-5}
+MNT=/mnt/yaffs-summary-test
+
+set -e
+
+# 256MB, 2KB pages, 128KB blocks
+modprobe nandsim first_id_byte=0x20 second_id_byte=0xaa \
+	third_id_byte=0x00 fourth_id_byte=0x15
+MTD=$(grep "NAND simulator" /proc/mtd | cut -d: -f1)
+mkdir -p $MNT
+
+fill() {
+	flash_eraseall -q /dev/$MTD
+	mount -t yaffs2 -o $1,no-checkpoint /dev/mtdblock${MTD#mtd} $MNT
+	i=0
+	while [ $i -lt $FILES ]; do
+		dd if=/dev/urandom of=$MNT/f$i bs=1024 count=$SIZE 2>/dev/null
+		i=$((i + 1))
+	done
+	umount $MNT
+}
+
+time_mounts() {
+	n=0
+	while [ $n -lt $RUNS ]; do
+		echo 3 > /proc/sys/vm/drop_caches
+		t0=$(date +%s%N)
+		mount -t yaffs2 -o no-checkpoint /dev/mtdblock${MTD#mtd} $MNT
+		t1=$(date +%s%N)
+		grep nSummaryScans /proc/yaffs
+		umount $MNT
+		echo "$1: mount took $(((t1 - t0) / 1000)) us"
+		n=$((n + 1))
+	done
+}
+
+fill summary-off
+time_mounts "no summaries"
+fill summary-on
+time_mounts "summaries"
+
+rmmod nandsim